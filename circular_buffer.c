@@ -1,14 +1,31 @@
+#define _GNU_SOURCE
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include "circular_buffer.h"
 
 // 전역 순환 버퍼 배열
 static H264CircularBuffer circular_buffers[NUM_CAMERAS] = {0};
 static guint8 *codec_data[NUM_CAMERAS] = {NULL};
 static gsize codec_data_size[NUM_CAMERAS] = {0};
+static int codec_width[NUM_CAMERAS] = {0};
+static int codec_height[NUM_CAMERAS] = {0};
+// 카메라별 SPS/PPS 캐시. codec_data와 함께 param_set_mutex로 보호 (writer는 바뀔 때만 잠금)
+static H264ParamSets param_sets[NUM_CAMERAS];
+static pthread_mutex_t param_set_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t disk_flusher_thread;
+
+// 이벤트 클립 스케줄러: 카메라별 기록 중인 태스크 목록(시작 순)과 이를 진행하는 clip writer 스레드
+static pthread_mutex_t scheduler_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scheduler_cond;
+static gboolean scheduler_running = FALSE;
+static SaveEventTask *pending_tasks[NUM_CAMERAS] = {NULL};
+static pthread_t clip_writer_thread;
+static volatile gboolean disk_flusher_running = FALSE;
 static EventSaveCallback g_save_callback = NULL;
 static void *g_callback_user_data = NULL;
 
@@ -17,11 +34,14 @@ void set_event_save_callback(EventSaveCallback callback, void *user_data) {
     g_callback_user_data = user_data;
 }
 
-// codec_data 저장 함수
+// codec_data 저장 함수 (caps 이벤트가 올 때마다 호출)
 void save_codec_data(int camera_id, GstCaps *caps) {
     if (camera_id < 0 || camera_id >= NUM_CAMERAS) return;
     
     const GstStructure *s = gst_caps_get_structure(caps, 0);
+    gst_structure_get_int(s, "width", &codec_width[camera_id]);
+    gst_structure_get_int(s, "height", &codec_height[camera_id]);
+    
     const GValue *codec_data_value = gst_structure_get_value(s, "codec_data");
     
     if (codec_data_value) {
@@ -29,6 +49,8 @@ void save_codec_data(int camera_id, GstCaps *caps) {
         if (codec_buffer) {
             GstMapInfo map;
             if (gst_buffer_map(codec_buffer, &map, GST_MAP_READ)) {
+                pthread_mutex_lock(&param_set_mutex);
+                
                 // 기존 데이터 해제
                 if (codec_data[camera_id]) {
                     g_free(codec_data[camera_id]);
@@ -39,6 +61,8 @@ void save_codec_data(int camera_id, GstCaps *caps) {
                 memcpy(codec_data[camera_id], map.data, map.size);
                 codec_data_size[camera_id] = map.size;
                 
+                pthread_mutex_unlock(&param_set_mutex);
+                
                 g_print("Camera %d: Saved codec_data (%lu bytes)\n", 
                         camera_id, map.size);
                 
@@ -47,6 +71,107 @@ void save_codec_data(int camera_id, GstCaps *caps) {
         }
     }
 }
+// 카메라별 ring 크기 계산 (설정 비트레이트 x 보관 시간)
+static gsize calc_ring_size(int cam_id, int seconds) {
+    gint64 bitrate = 0;
+    if (cam_id < (int)G_N_ELEMENTS(g_config.bitrate_high)) {
+        bitrate = g_config.bitrate_high[cam_id];
+    }
+    if (bitrate <= 0) {
+        bitrate = EVENT_RING_DEFAULT_BITRATE;
+    }
+
+    gsize size = (gsize)(bitrate / 8 * seconds * EVENT_RING_HEADROOM_PERCENT / 100);
+    return MAX(size, EVENT_RING_MIN_ARENA_SIZE);
+}
+
+// 디스크 계층 ring 파일 준비 (fallocate로 미리 확보 후 mmap)
+static int open_disk_tier(H264CircularBuffer *circ_buffer) {
+    H264DiskTier *disk = &circ_buffer->disk;
+    int seconds = g_config.event_disk_ring_sec;
+    
+    disk->fd = -1;
+    disk->map = NULL;
+    if (seconds <= 0 || !g_config.record_path) {
+        return -1;
+    }
+    
+    gsize size = calc_ring_size(circ_buffer->camera_id, seconds);
+    size = MAX(size, 2 * EVENT_DISK_CHUNK_SIZE);
+    size = (size + EVENT_DISK_ALIGN - 1) / EVENT_DISK_ALIGN * EVENT_DISK_ALIGN;
+    
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/.event_ring_cam%d", g_config.record_path, circ_buffer->camera_id);
+    
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        g_warning("Camera %d: Failed to open disk ring %s\n", circ_buffer->camera_id, path);
+        return -1;
+    }
+    
+    // 블록을 미리 할당해 두어 기록 중 단편화/ENOSPC가 없도록 한다
+    if (fallocate(fd, 0, 0, size) != 0 && ftruncate(fd, size) != 0) {
+        g_warning("Camera %d: Failed to allocate disk ring %s (%.1f MB)\n",
+                  circ_buffer->camera_id, path, size / (1024.0 * 1024.0));
+        close(fd);
+        return -1;
+    }
+    
+    void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        g_warning("Camera %d: Failed to mmap disk ring %s\n", circ_buffer->camera_id, path);
+        close(fd);
+        return -1;
+    }
+    
+    void *staging = NULL;
+    if (posix_memalign(&staging, EVENT_DISK_ALIGN, EVENT_DISK_CHUNK_SIZE) != 0) {
+        munmap(map, size);
+        close(fd);
+        return -1;
+    }
+    
+    disk->fd = fd;
+    disk->map = map;
+    disk->file_size = size;
+    disk->write_offset = 0;
+    disk->capacity = seconds * BUFFER_FPS * 2;  // 프레임 레이트 변동 여유
+    disk->frames = g_malloc0(disk->capacity * sizeof(H264Frame));
+    disk->head = 0;
+    disk->count = 0;
+    disk->next_index = 0;
+    disk->valid_from = 0;
+    disk->staging = staging;
+    disk->flushed_bytes = 0;
+    disk->lost_frames = 0;
+    
+    g_print("Camera %d disk ring: %s, %d seconds, %.1f MB\n",
+            circ_buffer->camera_id, path, seconds, size / (1024.0 * 1024.0));
+    return 0;
+}
+
+static void close_disk_tier(H264CircularBuffer *circ_buffer) {
+    H264DiskTier *disk = &circ_buffer->disk;
+    if (!disk->map) {
+        return;
+    }
+    munmap(disk->map, disk->file_size);
+    close(disk->fd);
+    free(disk->staging);
+    g_free(disk->frames);
+    disk->map = NULL;
+    disk->frames = NULL;
+    disk->staging = NULL;
+    disk->fd = -1;
+    disk->count = 0;
+}
+
+static void *disk_flusher_worker(void *arg);
+static gboolean next_nal_unit(const guint8 *data, gsize size, gsize *pos,
+                              const guint8 **nal, gsize *nal_size);
+static void start_event_scheduler(void);
+static void stop_event_scheduler(void);
+
 // 순환 버퍼 초기화 (모든 카메라)
 void init_all_circular_buffers(void) {
     for (int cam_id = 0; cam_id < NUM_CAMERAS; cam_id++) {
@@ -54,38 +179,89 @@ void init_all_circular_buffers(void) {
         
         pthread_mutex_init(&buffer->mutex, NULL);
         buffer->write_pos = 0;
+        buffer->write_offset = 0;
         buffer->frame_count = 0;
         buffer->total_frames_written = 0;
+        buffer->oldest_index = 0;
+        buffer->gop_head = 0;
+        buffer->gop_tail = 0;
         buffer->total_bytes = 0;
-        buffer->initialized = TRUE;
+        buffer->peak_bytes = 0;
+        buffer->peak_frame_count = 0;
+        buffer->max_frame_size = 0;
+        buffer->evicted_by_bytes = 0;
+        buffer->evicted_by_count = 0;
+        buffer->dropped_frames = 0;
+        buffer->bytes_copied = 0;
+        buffer->view_bytes_copied = 0;
+        buffer->lock_count = 0;
+        buffer->lock_hold_total_ns = 0;
+        buffer->lock_hold_max_ns = 0;
         buffer->camera_id = cam_id;
         
-        // 각 프레임의 데이터 버퍼 미리 할당
+        // 프레임 데이터를 담을 연속 arena 한 개만 할당
+        buffer->arena_size = calc_ring_size(cam_id, CIRCULAR_BUFFER_DURATION);
+        buffer->arena = g_malloc(buffer->arena_size);
+        
         for (int i = 0; i < MAX_FRAMES; i++) {
-            buffer->frames[i].data = g_malloc(MAX_FRAME_SIZE);
+            buffer->frames[i].data = NULL;
+            buffer->frames[i].index = -1;
+            buffer->frames[i].offset = 0;
             buffer->frames[i].size = 0;
             buffer->frames[i].camera_id = cam_id;
         }
+        open_disk_tier(buffer);
+        buffer->initialized = TRUE;
         
-        g_print("Camera %d circular buffer initialized: %d frames, %d seconds\n", 
-                cam_id, MAX_FRAMES, CIRCULAR_BUFFER_DURATION);
+        g_print("Camera %d circular buffer initialized: %d frames, %d seconds, arena %.1f MB\n", 
+                cam_id, MAX_FRAMES, CIRCULAR_BUFFER_DURATION,
+                buffer->arena_size / (1024.0 * 1024.0));
+    }
+    
+    start_event_scheduler();
+    
+    for (int cam_id = 0; cam_id < NUM_CAMERAS; cam_id++) {
+        if (circular_buffers[cam_id].disk.map) {
+            disk_flusher_running = TRUE;
+            if (pthread_create(&disk_flusher_thread, NULL, disk_flusher_worker, NULL) != 0) {
+                g_warning("Failed to start disk ring flusher\n");
+                disk_flusher_running = FALSE;
+            }
+            break;
+        }
     }
 }
 
 // 순환 버퍼 정리
 void cleanup_all_circular_buffers(void) {
+    stop_event_scheduler();
+    
+    if (disk_flusher_running) {
+        disk_flusher_running = FALSE;
+        pthread_join(disk_flusher_thread, NULL);
+    }
+    
     for (int cam_id = 0; cam_id < NUM_CAMERAS; cam_id++) {
         H264CircularBuffer *buffer = &circular_buffers[cam_id];
         
+        if (!buffer->initialized) {
+            continue;
+        }
+        
         pthread_mutex_lock(&buffer->mutex);
         
-        // 프레임 데이터 메모리 해제
+        // 남아있는 클립 뷰는 복사본이라 arena를 해제해도 된다.
+        // 파이프라인이 멈춘 뒤 호출되므로 writer는 더 이상 들어오지 않는다
+        buffer->initialized = FALSE;
+        buffer->frame_count = 0;
         for (int i = 0; i < MAX_FRAMES; i++) {
-            if (buffer->frames[i].data) {
-                g_free(buffer->frames[i].data);
-                buffer->frames[i].data = NULL;
-            }
+            buffer->frames[i].data = NULL;
+            buffer->frames[i].index = -1;
         }
+        g_free(buffer->arena);
+        buffer->arena = NULL;
+        buffer->arena_size = 0;
+        close_disk_tier(buffer);
         
         pthread_mutex_unlock(&buffer->mutex);
         pthread_mutex_destroy(&buffer->mutex);
@@ -94,6 +270,292 @@ void cleanup_all_circular_buffers(void) {
     }
 }
 
+// 크기 ring_size인 순환 공간에서 start부터 need 바이트 구간과 프레임이 겹치는지 확인 (순환 거리 기준)
+static gboolean ring_range_overlaps(const H264Frame *frame, gsize ring_size, gsize start, gsize need) {
+    gsize distance = (frame->offset + ring_size - start) % ring_size;
+    return distance < need;
+}
+
+// reader 잠금. 보유 시간을 누적해 get_buffer_status로 보여준다
+static gint64 mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (gint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void ring_lock(H264CircularBuffer *circ_buffer) {
+    pthread_mutex_lock(&circ_buffer->mutex);
+    circ_buffer->lock_acquired_ns = mono_ns();
+}
+
+static void ring_unlock(H264CircularBuffer *circ_buffer) {
+    guint64 held_ns = mono_ns() - circ_buffer->lock_acquired_ns;
+    circ_buffer->lock_count++;
+    circ_buffer->lock_hold_total_ns += held_ns;
+    if (held_ns > circ_buffer->lock_hold_max_ns) {
+        circ_buffer->lock_hold_max_ns = held_ns;
+    }
+    pthread_mutex_unlock(&circ_buffer->mutex);
+}
+
+// RAM에 남아있는 가장 오래된 프레임 index
+static int ram_oldest_index(H264CircularBuffer *circ_buffer) {
+    return g_atomic_int_get(&circ_buffer->oldest_index);
+}
+
+// RAM 슬롯에서 index 프레임의 디스크립터를 복사한다 (with_data면 데이터도 dest_data로 복사).
+// 복사 도중 writer가 슬롯을 제거/재사용했으면 FALSE
+static gboolean read_ram_frame(H264CircularBuffer *circ_buffer, int index, H264Frame *out,
+                               guint8 *dest_data) {
+    H264Frame *frame = &circ_buffer->frames[index % MAX_FRAMES];
+    if (index < 0 || g_atomic_int_get(&frame->index) != index) {
+        return FALSE;
+    }
+    *out = *frame;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (g_atomic_int_get(&frame->index) != index) {
+        return FALSE;
+    }
+    if (dest_data) {
+        // 디스크립터가 유효했으므로 data는 arena 안을 가리킴. 내용은 복사 후 다시 확인
+        memcpy(dest_data, out->data, out->size);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        return g_atomic_int_get(&frame->index) == index;
+    }
+    return TRUE;
+}
+
+// 디스크 FIFO 내 index의 위치 ([valid_from, next_index) 구간은 FIFO 끝에 연속으로 있음)
+static int disk_slot_of(H264DiskTier *disk, int index) {
+    return (disk->head + disk->count - (disk->next_index - index)) % disk->capacity;
+}
+
+// 디스크 계층이 RAM 앞쪽으로 끊김 없이 이어지는지 (mutex 보유 상태에서 호출)
+static gboolean disk_tier_contiguous(H264CircularBuffer *circ_buffer) {
+    H264DiskTier *disk = &circ_buffer->disk;
+    return disk->map && disk->count > 0 && disk->next_index >= ram_oldest_index(circ_buffer);
+}
+
+// 검색 가능한 타임라인(디스크 + RAM)의 첫 index
+static int timeline_first_index(H264CircularBuffer *circ_buffer) {
+    int ram_first = ram_oldest_index(circ_buffer);
+    if (!disk_tier_contiguous(circ_buffer)) {
+        return ram_first;
+    }
+    H264DiskTier *disk = &circ_buffer->disk;
+    int disk_first = MAX(disk->valid_from, disk->frames[disk->head].index);
+    return MIN(disk_first, ram_first);
+}
+
+// 타임라인에서 index 프레임의 디스크립터 (RAM에 있으면 RAM, 아니면 디스크).
+// 검색 중 RAM에서 밀려났고 디스크에도 없으면 FALSE
+static gboolean timeline_frame(H264CircularBuffer *circ_buffer, int index, H264Frame *out) {
+    if (read_ram_frame(circ_buffer, index, out, NULL)) {
+        return TRUE;
+    }
+    H264DiskTier *disk = &circ_buffer->disk;
+    if (disk_tier_contiguous(circ_buffer) && index < disk->next_index &&
+        index >= MAX(disk->valid_from, disk->frames[disk->head].index)) {
+        *out = disk->frames[disk_slot_of(disk, index)];
+        return TRUE;
+    }
+    return FALSE;
+}
+
+// 검색용 시각. 이미 밀려난 프레임은 가장 오래된 것으로 본다
+static double timeline_mono_time(H264CircularBuffer *circ_buffer, int index) {
+    H264Frame frame;
+    return timeline_frame(circ_buffer, index, &frame) ? frame.mono_time : -G_MAXDOUBLE;
+}
+
+static gboolean timeline_is_idr(H264CircularBuffer *circ_buffer, int index) {
+    H264Frame frame;
+    return timeline_frame(circ_buffer, index, &frame) && frame.is_idr;
+}
+
+// [first, last] 구간에서 mono_time >= t 인 첫 프레임 index (없으면 last + 1)
+static int lower_bound_frame(H264CircularBuffer *circ_buffer, int first, int last, double t) {
+    int lo = first, hi = last + 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (timeline_mono_time(circ_buffer, mid) < t) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// [first, last] 구간에서 mono_time > t 인 첫 프레임 index (없으면 last + 1)
+static int upper_bound_frame(H264CircularBuffer *circ_buffer, int first, int last, double t) {
+    int lo = first, hi = last + 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (timeline_mono_time(circ_buffer, mid) <= t) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// frame_index 이하의 마지막 IDR index. 없으면 그 이후 첫 IDR, IDR이 없으면 -1
+// writer와 동시에 읽으므로 결과가 이미 밀려난 프레임이면 그 다음 IDR을 쓴다 (최종 확인은 복사 이후)
+static int find_gop_start(H264CircularBuffer *circ_buffer, int frame_index) {
+    int head = g_atomic_int_get(&circ_buffer->gop_head);
+    int tail = g_atomic_int_get(&circ_buffer->gop_tail);
+    if (tail <= head) {
+        return -1;
+    }
+
+    int lo = head, hi = tail;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (circ_buffer->gop_index[mid % MAX_FRAMES].index <= frame_index) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    int oldest = ram_oldest_index(circ_buffer);
+    for (int entry = (lo > head) ? lo - 1 : head; entry < tail; entry++) {
+        int key_index = circ_buffer->gop_index[entry % MAX_FRAMES].index;
+        if (key_index >= oldest) {
+            return key_index;
+        }
+    }
+    return -1;
+}
+
+// 클립 시작 IDR: start 이전의 가장 가까운 IDR, 없으면 end 이전의 첫 IDR, 그것도 없으면 -1
+static int find_clip_start(H264CircularBuffer *circ_buffer, int first, int start, int end) {
+    int ram_first = ram_oldest_index(circ_buffer);
+    if (start >= ram_first) {
+        int key_index = find_gop_start(circ_buffer, start);
+        if (key_index >= 0 && key_index <= start) {
+            return key_index;
+        }
+    }
+    
+    // RAM GOP 인덱스에 없으면 디스크 계층을 뒤로 탐색 (GOP 길이 이내)
+    for (int i = MIN(start, ram_first - 1); i >= first; i--) {
+        if (timeline_is_idr(circ_buffer, i)) {
+            return i;
+        }
+    }
+    for (int i = start; i <= end && i < ram_first; i++) {
+        if (timeline_is_idr(circ_buffer, i)) {
+            return i;
+        }
+    }
+    int key_index = find_gop_start(circ_buffer, MAX(start, ram_first));
+    return (key_index >= 0 && key_index <= end) ? key_index : -1;
+}
+
+// 키프레임 AU의 첫 slice NAL이 IDR(type 5)인지 확인
+static gboolean is_idr_access_unit(const guint8 *data, gsize size) {
+    for (gsize i = 0; i + 3 < size; i++) {
+        if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1) {
+            int nal_type = data[i + 3] & 0x1F;
+            if (nal_type == 5) {
+                return TRUE;
+            }
+            if (nal_type == 1) {
+                return FALSE;
+            }
+            i += 2;
+        }
+    }
+    return FALSE;
+}
+
+// 키프레임의 in-band SPS/PPS가 캐시와 다르면 갱신 (writer 전용이라 비교는 잠금 없이)
+static void update_param_sets(int camera_id, const guint8 *data, gsize size) {
+    H264ParamSets *ps = &param_sets[camera_id];
+    const guint8 *nal, *sps = NULL, *pps = NULL;
+    gsize nal_size, pos = 0, sps_size = 0, pps_size = 0;
+    
+    while (next_nal_unit(data, size, &pos, &nal, &nal_size)) {
+        if (nal_size == 0) continue;
+        int nal_type = nal[0] & 0x1F;
+        if (nal_type == 7 && !sps) {
+            sps = nal;
+            sps_size = nal_size;
+        } else if (nal_type == 8 && !pps) {
+            pps = nal;
+            pps_size = nal_size;
+        } else if (nal_type == 1 || nal_type == 5) {
+            break;  // 파라미터 셋은 slice 앞에만 온다
+        }
+    }
+    
+    gboolean sps_changed = sps && sps_size >= 4 && sps_size <= H264_MAX_PARAM_SET_SIZE &&
+                           (sps_size != ps->sps_size || memcmp(sps, ps->sps, sps_size) != 0);
+    gboolean pps_changed = pps && pps_size <= H264_MAX_PARAM_SET_SIZE &&
+                           (pps_size != ps->pps_size || memcmp(pps, ps->pps, pps_size) != 0);
+    if (!sps_changed && !pps_changed) {
+        return;
+    }
+    
+    pthread_mutex_lock(&param_set_mutex);
+    if (sps_changed) {
+        memcpy(ps->sps, sps, sps_size);
+        ps->sps_size = sps_size;
+    }
+    if (pps_changed) {
+        memcpy(ps->pps, pps, pps_size);
+        ps->pps_size = pps_size;
+    }
+    ps->version++;
+    pthread_mutex_unlock(&param_set_mutex);
+    
+    g_print("Camera %d: Parameter sets updated (SPS %lu, PPS %lu bytes, version %u)\n",
+            camera_id, ps->sps_size, ps->pps_size, ps->version);
+}
+
+// 최신 SPS/PPS 복사 (클립 저장, 새로 붙는 소비자용). 아직 둘 다 받지 못했으면 FALSE
+gboolean get_param_sets(int camera_id, H264ParamSets *out) {
+    if (camera_id < 0 || camera_id >= NUM_CAMERAS || !out) {
+        return FALSE;
+    }
+    
+    pthread_mutex_lock(&param_set_mutex);
+    gboolean ok = param_sets[camera_id].sps_size > 0 && param_sets[camera_id].pps_size > 0;
+    if (ok) {
+        *out = param_sets[camera_id];
+    }
+    pthread_mutex_unlock(&param_set_mutex);
+    return ok;
+}
+
+// 가장 오래된 프레임 제거 (writer 전용). 클립 뷰는 복사본이라 항상 제거할 수 있다
+static void evict_oldest_frame(H264CircularBuffer *circ_buffer) {
+    int oldest_pos = (circ_buffer->write_pos - circ_buffer->frame_count + MAX_FRAMES) % MAX_FRAMES;
+    H264Frame *oldest = &circ_buffer->frames[oldest_pos];
+    int index = oldest->index;
+
+    g_atomic_int_set(&circ_buffer->oldest_index, index + 1);
+
+    // GOP 인덱스에서도 제거
+    int gop_head = circ_buffer->gop_head;
+    if (gop_head < circ_buffer->gop_tail &&
+        circ_buffer->gop_index[gop_head % MAX_FRAMES].index == index) {
+        g_atomic_int_set(&circ_buffer->gop_head, gop_head + 1);
+    }
+
+    // 슬롯을 무효화한 뒤에야 arena를 덮어쓴다 (reader는 복사 후 index를 다시 확인)
+    g_atomic_int_set(&oldest->index, -1);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    circ_buffer->total_bytes -= oldest->size;
+    oldest->data = NULL;
+    oldest->size = 0;
+    circ_buffer->frame_count--;
+}
+
 // 특정 카메라의 순환 버퍼에 프레임 추가
 void add_frame_to_buffer(GstBuffer *buffer, gboolean is_keyframe, int camera_id) {
     if (camera_id < 0 || camera_id >= NUM_CAMERAS) {
@@ -108,341 +570,1119 @@ void add_frame_to_buffer(GstBuffer *buffer, gboolean is_keyframe, int camera_id)
         return;
     }
     
-    pthread_mutex_lock(&circ_buffer->mutex);
+    // 카메라당 writer는 하나뿐이라 잠금 없이 진행 (reader가 스트리밍 스레드를 막지 않음)
     
-    // 현재 시간
+    // 검색은 monotonic 시각으로 하고, 실제 시각은 표시용으로만 함께 기록 (NTP 보정 영향 없음)
     struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    double mono_time = ts.tv_sec + ts.tv_nsec / 1e9;
     clock_gettime(CLOCK_REALTIME, &ts);
     double timestamp = ts.tv_sec + ts.tv_nsec / 1e9;
     
     // GstBuffer에서 데이터 추출
     GstMapInfo map;
     if (!gst_buffer_map(buffer, &map, GST_MAP_READ)) {
-        pthread_mutex_unlock(&circ_buffer->mutex);
         return;
     }
     
+    if (is_keyframe) {
+        update_param_sets(camera_id, map.data, map.size);
+    }
+    gboolean is_idr = is_keyframe && is_idr_access_unit(map.data, map.size);
+    
     // 프레임 크기 확인
-    if (map.size > MAX_FRAME_SIZE) {
+    if (map.size > MAX_FRAME_SIZE || map.size > circ_buffer->arena_size) {
         g_warning("Camera %d: Frame size %lu exceeds maximum %d\n", 
                   camera_id, map.size, MAX_FRAME_SIZE);
+        circ_buffer->dropped_frames++;
         gst_buffer_unmap(buffer, &map);
-        pthread_mutex_unlock(&circ_buffer->mutex);
         return;
     }
     
-    // 현재 위치의 프레임에 데이터 복사
-    H264Frame *frame = &circ_buffer->frames[circ_buffer->write_pos];
+    // arena 끝에 들어가지 않으면 남은 꼬리 공간은 버리고 처음부터 쓴다
+    gsize frame_offset = circ_buffer->write_offset;
+    gsize need = map.size;
+    if (frame_offset + map.size > circ_buffer->arena_size) {
+        need += circ_buffer->arena_size - frame_offset;
+        frame_offset = 0;
+    }
     
-    // 이전 데이터가 있으면 total_bytes에서 제거
-    if (circ_buffer->frame_count >= MAX_FRAMES) {
-        circ_buffer->total_bytes -= frame->size;
+    // 필요한 공간(바이트) 또는 디스크립터(개수)가 확보될 때까지 오래된 프레임 제거
+    while (circ_buffer->frame_count > 0) {
+        int oldest_pos = (circ_buffer->write_pos - circ_buffer->frame_count + MAX_FRAMES) % MAX_FRAMES;
+        H264Frame *oldest = &circ_buffer->frames[oldest_pos];
+        
+        gboolean by_count = circ_buffer->frame_count >= MAX_FRAMES;
+        if (!by_count && !ring_range_overlaps(oldest, circ_buffer->arena_size, circ_buffer->write_offset, need)) {
+            break;
+        }
+        
+        evict_oldest_frame(circ_buffer);
+        if (by_count) {
+            circ_buffer->evicted_by_count++;
+        } else {
+            circ_buffer->evicted_by_bytes++;
+        }
     }
     
     // 새 데이터 복사
+    H264Frame *frame = &circ_buffer->frames[circ_buffer->write_pos];
+    frame->data = circ_buffer->arena + frame_offset;
+    frame->offset = frame_offset;
     memcpy(frame->data, map.data, map.size);
     frame->size = map.size;
     frame->is_keyframe = is_keyframe;
+    frame->is_idr = is_idr;
     frame->pts = GST_BUFFER_PTS(buffer);
+    frame->mono_time = mono_time;
     frame->timestamp = timestamp;
-    frame->index = circ_buffer->total_frames_written;
+    frame->camera_id = camera_id;
+    
+    // 내용을 모두 쓴 뒤 index를 게시 (reader는 index가 맞는 슬롯만 읽음)
+    int index = circ_buffer->total_frames_written;
+    g_atomic_int_set(&frame->index, index);
+    
+    if (frame->is_idr) {
+        GopEntry *entry = &circ_buffer->gop_index[circ_buffer->gop_tail % MAX_FRAMES];
+        entry->index = index;
+        entry->mono_time = mono_time;
+        g_atomic_int_set(&circ_buffer->gop_tail, circ_buffer->gop_tail + 1);
+    }
     
+    circ_buffer->write_offset = (frame_offset + map.size) % circ_buffer->arena_size;
     circ_buffer->total_bytes += map.size;
-    circ_buffer->total_frames_written++;
+    circ_buffer->bytes_copied += map.size;
+    g_atomic_int_set(&circ_buffer->total_frames_written, index + 1);
 
     // printf("Camera %d: Added frame %d, size: %lu bytes, keyframe: %d, timestamp: %.3f\n",
     //        camera_id, circ_buffer->write_pos, map.size, is_keyframe, frame->timestamp);
     
     // 순환 버퍼 위치 업데이트
     circ_buffer->write_pos = (circ_buffer->write_pos + 1) % MAX_FRAMES;
-    if (circ_buffer->frame_count < MAX_FRAMES) {
-        circ_buffer->frame_count++;
+    circ_buffer->frame_count++;
+    
+    // high-water 갱신
+    if (circ_buffer->total_bytes > circ_buffer->peak_bytes) {
+        circ_buffer->peak_bytes = circ_buffer->total_bytes;
+    }
+    if (circ_buffer->frame_count > circ_buffer->peak_frame_count) {
+        circ_buffer->peak_frame_count = circ_buffer->frame_count;
+    }
+    if (map.size > circ_buffer->max_frame_size) {
+        circ_buffer->max_frame_size = map.size;
     }
     
     // 10초마다 상태 출력
     if (circ_buffer->total_frames_written % (BUFFER_FPS * 10) == 0) {
-        g_print("Camera %d buffer stats - Frames: %d, Size: %.2f MB, Total written: %d\n",
+        g_print("Camera %d buffer stats - Frames: %d, Size: %.2f/%.2f MB (%.0f%%), Total written: %d\n",
                 camera_id, circ_buffer->frame_count,
                 circ_buffer->total_bytes / (1024.0 * 1024.0),
+                circ_buffer->arena_size / (1024.0 * 1024.0),
+                100.0 * circ_buffer->total_bytes / circ_buffer->arena_size,
                 circ_buffer->total_frames_written);
     }
     
     gst_buffer_unmap(buffer, &map);
-    pthread_mutex_unlock(&circ_buffer->mutex);
 }
-int extract_event_clip(int camera_id, double event_time, int before_sec, int after_sec, 
-                      H264Frame **out_frames, int *out_frame_count) {
-    if (camera_id < 0 || camera_id >= NUM_CAMERAS) {
-        return -1;
-    }
+// RAM에서 밀려나기 전의 프레임을 디스크 ring에 큰 정렬 단위로 순차 기록 (flusher 스레드 전용)
+static void flush_to_disk(H264CircularBuffer *circ_buffer) {
+    H264DiskTier *disk = &circ_buffer->disk;
     
-    H264CircularBuffer *circ_buffer = &circular_buffers[camera_id];
-    pthread_mutex_lock(&circ_buffer->mutex);
+    ring_lock(circ_buffer);
     
-    if (circ_buffer->frame_count == 0) {
-        pthread_mutex_unlock(&circ_buffer->mutex);
-        g_warning("Camera %d buffer is empty\n", camera_id);
-        return -1;
+    int ram_first = ram_oldest_index(circ_buffer);
+    if (disk->next_index < ram_first) {
+        // 기록이 늦어 RAM에서 이미 빠진 프레임은 잃는다. 이후 구간부터 다시 이어 붙인다
+        disk->lost_frames += ram_first - disk->next_index;
+        g_warning("Camera %d: disk ring fell behind, lost %d frames\n",
+                  circ_buffer->camera_id, ram_first - disk->next_index);
+        disk->next_index = ram_first;
+        disk->valid_from = ram_first;
     }
     
-    double start_time = event_time - before_sec;
-    double end_time = event_time + after_sec;
+    int pending = g_atomic_int_get(&circ_buffer->total_frames_written) - disk->next_index;
+    H264Frame oldest_pending;
+    if (pending <= 0 || !read_ram_frame(circ_buffer, disk->next_index, &oldest_pending, NULL)) {
+        ring_unlock(circ_buffer);
+        return;
+    }
     
-    g_print("Event time: %.2f\n", event_time);
-    g_print("Requested range: %.2f to %.2f (%.1f seconds)\n", 
-            start_time, end_time, end_time - start_time);
+    // 한 청크가 모였거나, 가장 오래된 미기록 프레임이 RAM 보관 시간의 절반을 넘으면 기록
+    gsize pending_bytes = 0;
+    for (int i = 0; i < pending && pending_bytes < EVENT_DISK_CHUNK_SIZE; i++) {
+        H264Frame frame;
+        if (read_ram_frame(circ_buffer, disk->next_index + i, &frame, NULL)) {
+            pending_bytes += frame.size;
+        }
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    double now = ts.tv_sec + ts.tv_nsec / 1e9;
+    double oldest_age = now - oldest_pending.mono_time;
+    if (pending_bytes < EVENT_DISK_CHUNK_SIZE && oldest_age < CIRCULAR_BUFFER_DURATION / 2.0) {
+        ring_unlock(circ_buffer);
+        return;
+    }
     
-    // 버퍼의 시작 위치 계산
-    int buffer_start = (circ_buffer->write_pos - circ_buffer->frame_count + MAX_FRAMES) % MAX_FRAMES;
+    ring_unlock(circ_buffer);
     
-    // 디버그: 버퍼의 시간 범위 출력
-    double buffer_start_time = circ_buffer->frames[buffer_start].timestamp;
-    double buffer_end_time = circ_buffer->frames[(circ_buffer->write_pos - 1 + MAX_FRAMES) % MAX_FRAMES].timestamp;
-    g_print("Buffer time range: %.2f to %.2f (%.1f seconds)\n", 
-            buffer_start_time, buffer_end_time, buffer_end_time - buffer_start_time);
+    // staging 버퍼로 복사 (최대 한 청크). writer와 경쟁하므로 복사 후 슬롯이 그대로인지 확인하고,
+    // 이미 덮어쓰인 프레임부터는 다음 주기의 유실 처리로 넘긴다
+    int max_frames = MIN(pending, disk->capacity);
+    H264Frame *staged = g_malloc(max_frames * sizeof(H264Frame));
+    gsize staged_bytes = 0;
+    int n = 0;
+    while (n < max_frames) {
+        H264Frame frame;
+        if (!read_ram_frame(circ_buffer, disk->next_index + n, &frame, NULL) ||
+            staged_bytes + frame.size > EVENT_DISK_CHUNK_SIZE ||
+            !read_ram_frame(circ_buffer, disk->next_index + n, &frame, disk->staging + staged_bytes)) {
+            break;
+        }
+        staged[n] = frame;
+        staged[n].offset = staged_bytes;
+        staged_bytes += frame.size;
+        n++;
+    }
+    if (n == 0) {
+        g_free(staged);
+        return;
+    }
     
-    // 시작 프레임 찾기
-    int start_idx = -1;
-    int end_idx = -1;
+    gsize len = (staged_bytes + EVENT_DISK_ALIGN - 1) / EVENT_DISK_ALIGN * EVENT_DISK_ALIGN;
+    memset(disk->staging + staged_bytes, 0, len - staged_bytes);
     
-    for (int i = 0; i < circ_buffer->frame_count; i++) {
-        int idx = (buffer_start + i) % MAX_FRAMES;
-        H264Frame *frame = &circ_buffer->frames[idx];
+    // 기록할 공간 확보 (파일 끝에 안 들어가면 처음부터)
+    ring_lock(circ_buffer);
+    
+    gsize offset = disk->write_offset;
+    gsize need = len;
+    if (offset + len > disk->file_size) {
+        need += disk->file_size - offset;
+        offset = 0;
+    }
+    while (disk->count > 0) {
+        H264Frame *head = &disk->frames[disk->head];
+        gboolean by_count = disk->count + n > disk->capacity;
+        if (!by_count && !ring_range_overlaps(head, disk->file_size, disk->write_offset, need)) {
+            break;
+        }
         
-        // 시작 시간보다 큰 첫 키프레임 찾기
-        if (start_idx == -1 && frame->timestamp >= start_time) {
-            // 키프레임 찾기 (이전으로 최대 50프레임까지만)
-            for (int j = i; j >= MAX(0, i - 50); j--) {
-                int kidx = (buffer_start + j) % MAX_FRAMES;
-                if (circ_buffer->frames[kidx].is_keyframe) {
-                    start_idx = j;
-                    break;
-                }
+        head->data = NULL;
+        disk->head = (disk->head + 1) % disk->capacity;
+        disk->count--;
+    }
+    
+    ring_unlock(circ_buffer);
+    
+    // 확보한 구간은 어떤 디스크립터도 가리키지 않으므로 잠금 없이 기록
+    ssize_t written = pwrite(disk->fd, disk->staging, len, offset);
+    if (written != (ssize_t)len) {
+        g_warning("Camera %d: disk ring write failed at %lu\n", circ_buffer->camera_id, offset);
+        g_free(staged);
+        return;
+    }
+    sync_file_range(disk->fd, offset, len, SYNC_FILE_RANGE_WRITE);
+    
+    ring_lock(circ_buffer);
+    
+    for (int i = 0; i < n; i++) {
+        H264Frame *frame = &disk->frames[(disk->head + disk->count) % disk->capacity];
+        *frame = staged[i];
+        frame->offset = offset + staged[i].offset;
+        frame->data = disk->map + frame->offset;
+        disk->count++;
+    }
+    disk->next_index += n;
+    disk->write_offset = (offset + len) % disk->file_size;
+    disk->flushed_bytes += staged_bytes;
+    
+    ring_unlock(circ_buffer);
+    g_free(staged);
+}
+
+static void *disk_flusher_worker(void *arg) {
+    while (disk_flusher_running) {
+        for (int cam_id = 0; cam_id < NUM_CAMERAS; cam_id++) {
+            H264CircularBuffer *circ_buffer = &circular_buffers[cam_id];
+            if (circ_buffer->initialized && circ_buffer->disk.map) {
+                flush_to_disk(circ_buffer);
             }
-            if (start_idx == -1) start_idx = i; // 키프레임 못찾으면 그냥 시작
         }
-        
-        // 종료 시간 찾기
-        if (frame->timestamp <= end_time) {
-            end_idx = i;
-        } else if (frame->timestamp > end_time) {
-            break; // 종료 시간을 넘어서면 중단
+        usleep(EVENT_DISK_FLUSH_INTERVAL_MS * 1000);
+    }
+    return NULL;
+}
+
+// 실제 시각을 순환 버퍼의 monotonic 타임라인으로 변환 (현재 시점의 대응 관계 사용)
+double realtime_to_mono_time(double realtime) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    double now_mono = ts.tv_sec + ts.tv_nsec / 1e9;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    double now_real = ts.tv_sec + ts.tv_nsec / 1e9;
+    return realtime - (now_real - now_mono);
+}
+
+static void clip_view_free(H264ClipView *view) {
+    g_free(view->frames);
+    g_free(view->data);
+    g_free(view);
+}
+
+// [first_index, end_index] 프레임을 새 뷰로 복사한다 (mutex 보유 상태에서 호출).
+// 이미 디스크에 기록된 앞부분은 디스크 ring에서, 나머지는 RAM에서 읽는다.
+// 복사하는 사이 writer가 RAM 구간을 밀어냈으면 NULL
+static H264ClipView *copy_index_range(H264CircularBuffer *circ_buffer, int first_index, int end_index) {
+    H264DiskTier *disk = &circ_buffer->disk;
+    int ram_first_index = first_index;
+    if (disk_tier_contiguous(circ_buffer)) {
+        ram_first_index = MIN(MAX(first_index, disk->next_index), end_index + 1);
+    }
+    
+    H264ClipView *view = g_malloc0(sizeof(H264ClipView));
+    view->camera_id = circ_buffer->camera_id;
+    view->first_index = first_index;
+    view->frame_count = end_index - first_index + 1;
+    view->disk_frame_count = ram_first_index - first_index;
+    view->frames = g_malloc(view->frame_count * sizeof(H264Frame));
+    view->refcount = 1;
+    
+    // 디스크립터로 전체 크기를 구한 뒤 한 번에 할당 (index가 그대로인 동안 크기는 바뀌지 않음)
+    gsize total = 0;
+    for (int i = 0; i < view->frame_count; i++) {
+        int index = first_index + i;
+        if (index < ram_first_index) {
+            view->frames[i] = disk->frames[disk_slot_of(disk, index)];
+        } else if (!read_ram_frame(circ_buffer, index, &view->frames[i], NULL)) {
+            clip_view_free(view);
+            return NULL;
         }
+        total += view->frames[i].size;
     }
+    view->data = g_malloc(MAX(total, 1));
     
-    if (start_idx == -1 || end_idx == -1 || end_idx < start_idx) {
-        pthread_mutex_unlock(&circ_buffer->mutex);
+    gsize offset = 0;
+    for (int i = 0; i < view->frame_count; i++) {
+        int index = first_index + i;
+        H264Frame *frame = &view->frames[i];
+        guint8 *dest = view->data + offset;
+        if (index < ram_first_index) {
+            // 디스크 FIFO는 mutex 안에서만 밀려나므로 그대로 복사
+            memcpy(dest, frame->data, frame->size);
+        } else if (!read_ram_frame(circ_buffer, index, frame, dest)) {
+            clip_view_free(view);
+            return NULL;
+        }
+        frame->data = dest;
+        frame->offset = offset;
+        offset += frame->size;
+    }
+    circ_buffer->view_bytes_copied += total;
+    return view;
+}
+
+// 구간을 찾아 복사한다 (mutex 보유 상태에서 호출).
+// 0: 성공, -1: 구간 없음, 1: 복사하는 사이 writer가 밀어내서 다시 시도해야 함
+static int copy_clip_range(H264CircularBuffer *circ_buffer, double start_time, double end_time,
+                          H264ClipView **out_view) {
+    int camera_id = circ_buffer->camera_id;
+    
+    // 타임라인(디스크 + RAM) 이진 검색
+    int first = timeline_first_index(circ_buffer);
+    int last = g_atomic_int_get(&circ_buffer->total_frames_written) - 1;
+    if (last < first) {
+        g_warning("Camera %d buffer is empty\n", camera_id);
+        return -1;
+    }
+    int start_index = lower_bound_frame(circ_buffer, first, last, start_time);
+    int end_index = upper_bound_frame(circ_buffer, first, last, end_time) - 1;
+    if (start_index > last || end_index < start_index) {
         g_warning("Camera %d: No frames found in time range\n", camera_id);
         return -1;
     }
     
-    // 실제 추출할 프레임 정보 출력
-    int start_frame_idx = (buffer_start + start_idx) % MAX_FRAMES;
-    int end_frame_idx = (buffer_start + end_idx) % MAX_FRAMES;
-    double actual_start_time = circ_buffer->frames[start_frame_idx].timestamp;
-    double actual_end_time = circ_buffer->frames[end_frame_idx].timestamp;
+    // 클립은 항상 IDR에서 시작
+    int key_index = find_clip_start(circ_buffer, first, start_index, end_index);
+    if (key_index < 0) {
+        g_warning("Camera %d: No IDR frame in time range\n", camera_id);
+        return -1;
+    }
+    
+    H264ClipView *view = copy_index_range(circ_buffer, key_index, end_index);
+    if (!view) {
+        return 1;
+    }
     
-    g_print("Actual extraction: frame %d to %d\n", start_idx, end_idx);
-    g_print("Actual time: %.2f to %.2f (%.1f seconds)\n", 
-            actual_start_time, actual_end_time, actual_end_time - actual_start_time);
+    *out_view = view;
+    return 0;
+}
+
+int extract_event_clip(int camera_id, double start_time, double end_time,
+                      H264ClipView **out_view) {
+    if (camera_id < 0 || camera_id >= NUM_CAMERAS) {
+        return -1;
+    }
     
-    // 프레임 복사
-    int frame_count = end_idx - start_idx + 1;
-    *out_frames = g_malloc(sizeof(H264Frame) * frame_count);
-    *out_frame_count = frame_count;
+    H264CircularBuffer *circ_buffer = &circular_buffers[camera_id];
+    if (!circ_buffer->initialized) {
+        return -1;
+    }
     
-    for (int i = 0; i < frame_count; i++) {
-        int src_idx = (buffer_start + start_idx + i) % MAX_FRAMES;
-        H264Frame *src = &circ_buffer->frames[src_idx];
-        H264Frame *dst = &(*out_frames)[i];
-        
-        dst->data = g_malloc(src->size);
-        memcpy(dst->data, src->data, src->size);
-        dst->size = src->size;
-        dst->is_keyframe = src->is_keyframe;
-        dst->pts = src->pts;
-        dst->timestamp = src->timestamp;
-        dst->index = src->index;
-        dst->camera_id = src->camera_id;
+    H264ClipView *view = NULL;
+    int ret = 1;
+    for (int attempt = 0; attempt < 3 && ret == 1; attempt++) {
+        ring_lock(circ_buffer);
+        ret = copy_clip_range(circ_buffer, start_time, end_time, &view);
+        ring_unlock(circ_buffer);
+    }
+    if (ret != 0) {
+        if (ret == 1) {
+            g_warning("Camera %d: clip range overwritten while copying\n", camera_id);
+        }
+        return -1;
     }
     
-    double actual_duration = (*out_frames)[frame_count-1].timestamp - (*out_frames)[0].timestamp;
-    g_print("Camera %d: Extracted %d frames, duration: %.1f seconds\n", 
-            camera_id, frame_count, actual_duration);
+    double actual_start_time = clip_view_get_frame(view, 0)->mono_time;
+    double actual_end_time = clip_view_get_frame(view, view->frame_count - 1)->mono_time;
+    g_print("Camera %d: Copied frame %d to %d (%d frames, %d from disk), %.1f seconds from IDR (requested %.1f)\n", 
+            camera_id, view->first_index, view->first_index + view->frame_count - 1, view->frame_count,
+            view->disk_frame_count,
+            actual_end_time - actual_start_time, end_time - start_time);
     
-    pthread_mutex_unlock(&circ_buffer->mutex);
+    *out_view = view;
     return 0;
 }
 
-// H.264 클립을 파일로 저장
-void save_h264_clip(H264Frame *frames, int frame_count, const char *filename) {
-    FILE *fp = fopen(filename, "wb");
-    if (!fp) {
-        g_error("Failed to open file: %s\n", filename);
-        return;
+// 진행 중인 클립용: next_index부터 end_time까지 새로 들어온 프레임을 복사한다.
+// 새 프레임이 없으면 *out_view = NULL, next_index가 이미 밀려났으면 -1
+int extract_frames_since(int camera_id, int next_index, double end_time,
+                         H264ClipView **out_view) {
+    *out_view = NULL;
+    if (camera_id < 0 || camera_id >= NUM_CAMERAS) {
+        return -1;
     }
     
-    // 카메라 ID 확인 (첫 프레임에서)
-    int cam_id = (frame_count > 0) ? frames[0].camera_id : -1;
+    H264CircularBuffer *circ_buffer = &circular_buffers[camera_id];
+    if (!circ_buffer->initialized) {
+        return -1;
+    }
     
-    // codec_data가 있으면 먼저 쓰기
-    if (cam_id >= 0 && cam_id < NUM_CAMERAS && codec_data[cam_id]) {
-        // AVC 포맷을 Annex B로 변환
-        guint8 *data = codec_data[cam_id];
-        gsize size = codec_data_size[cam_id];
-        
-        // SPS/PPS 추출 및 쓰기 (간단한 버전)
-        // 실제로는 더 복잡한 파싱이 필요할 수 있음
-        guint8 start_code[] = {0x00, 0x00, 0x00, 0x01};
-        
-        if (size > 5) {
-            // Skip first 5 bytes (version, profile, etc)
-            int pos = 5;
-            
-            // SPS
-            if (pos + 2 < size) {
-                int sps_count = data[pos] & 0x1F;
-                pos++;
-                
-                for (int i = 0; i < sps_count && pos + 2 < size; i++) {
-                    int sps_len = (data[pos] << 8) | data[pos + 1];
-                    pos += 2;
-                    
-                    if (pos + sps_len <= size) {
-                        fwrite(start_code, 1, 4, fp);
-                        fwrite(data + pos, 1, sps_len, fp);
-                        pos += sps_len;
-                    }
-                }
-            }
-            
-            // PPS
-            if (pos + 1 < size) {
-                int pps_count = data[pos];
-                pos++;
-                
-                for (int i = 0; i < pps_count && pos + 2 < size; i++) {
-                    int pps_len = (data[pos] << 8) | data[pos + 1];
-                    pos += 2;
-                    
-                    if (pos + pps_len <= size) {
-                        fwrite(start_code, 1, 4, fp);
-                        fwrite(data + pos, 1, pps_len, fp);
-                        pos += pps_len;
-                    }
-                }
+    int ret = 0;
+    ring_lock(circ_buffer);
+    
+    int first = timeline_first_index(circ_buffer);
+    int last = g_atomic_int_get(&circ_buffer->total_frames_written) - 1;
+    if (next_index < first) {
+        ret = -1;
+    } else if (next_index <= last) {
+        int end_index = upper_bound_frame(circ_buffer, next_index, last, end_time) - 1;
+        if (end_index >= next_index) {
+            *out_view = copy_index_range(circ_buffer, next_index, end_index);
+            if (!*out_view) {
+                ret = -1;
             }
         }
     }
     
-    // 프레임 데이터 쓰기
-    size_t total_size = 0;
-    for (int i = 0; i < frame_count; i++) {
-        fwrite(frames[i].data, 1, frames[i].size, fp);
-        total_size += frames[i].size;
+    ring_unlock(circ_buffer);
+    return ret;
+}
+
+H264ClipView *clip_view_ref(H264ClipView *view) {
+    if (view) {
+        g_atomic_int_inc(&view->refcount);
+    }
+    return view;
+}
+
+void clip_view_unref(H264ClipView *view) {
+    if (view && g_atomic_int_dec_and_test(&view->refcount)) {
+        clip_view_free(view);
+    }
+}
+
+// 뷰는 복사본이므로 잠금 없이 읽는다
+const H264Frame *clip_view_get_frame(H264ClipView *view, int i) {
+    if (!view || i < 0 || i >= view->frame_count) {
+        return NULL;
+    }
+    return &view->frames[i];
+}
+
+// ===== MP4 (fragmented) 저장 =====
+// ftyp + moov(샘플 테이블 없음) 뒤에 moof + mdat 조각을 이어 붙인다. 샘플은 AVCC(4바이트 길이) 형식
+#define MP4_TIMESCALE 90000
+#define MP4_MOVIE_TIMESCALE 1000
+#define MP4_WRITE_BUFFER_SIZE (1024 * 1024)
+
+static void mp4_put_u8(GByteArray *b, guint8 v) {
+    g_byte_array_append(b, &v, 1);
+}
+
+static void mp4_put_u16(GByteArray *b, guint16 v) {
+    guint8 d[2] = { v >> 8, v };
+    g_byte_array_append(b, d, 2);
+}
+
+static void mp4_put_u32(GByteArray *b, guint32 v) {
+    guint8 d[4] = { v >> 24, v >> 16, v >> 8, v };
+    g_byte_array_append(b, d, 4);
+}
+
+static void mp4_put_u64(GByteArray *b, guint64 v) {
+    mp4_put_u32(b, (guint32)(v >> 32));
+    mp4_put_u32(b, (guint32)v);
+}
+
+static void mp4_put_zeros(GByteArray *b, int n) {
+    while (n-- > 0) {
+        mp4_put_u8(b, 0);
     }
-    
-    fclose(fp);
-    g_print("Saved H.264 clip: %s (%.2f MB)\n", filename, total_size / (1024.0 * 1024.0));
 }
 
-// MP4로 변환하여 저장 (FFmpeg 사용)
-void save_mp4_clip(H264Frame *frames, int frame_count, const char *filename, const char *http_path, int event_id) {
-    char temp_h264[PATH_MAX];  // PATH_MAX 사용 (보통 4096)
-    snprintf(temp_h264, sizeof(temp_h264), "%s.temp.h264", filename);
-    save_h264_clip(frames, frame_count, temp_h264);
+static guint mp4_box_begin(GByteArray *b, const char *type) {
+    guint offset = b->len;
+    mp4_put_u32(b, 0);  // 크기는 box_end에서 채움
+    g_byte_array_append(b, (const guint8 *)type, 4);
+    return offset;
+}
+
+static guint mp4_full_box_begin(GByteArray *b, const char *type, guint8 version, guint32 flags) {
+    guint offset = mp4_box_begin(b, type);
+    mp4_put_u32(b, ((guint32)version << 24) | (flags & 0xFFFFFF));
+    return offset;
+}
+
+static void mp4_box_end(GByteArray *b, guint offset) {
+    guint32 size = b->len - offset;
+    b->data[offset] = size >> 24;
+    b->data[offset + 1] = size >> 16;
+    b->data[offset + 2] = size >> 8;
+    b->data[offset + 3] = size;
+}
+
+static void mp4_put_matrix(GByteArray *b) {
+    static const guint32 matrix[9] = { 0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000 };
+    for (int i = 0; i < 9; i++) {
+        mp4_put_u32(b, matrix[i]);
+    }
+}
+
+// Annex-B 스트림에서 다음 NAL 검색. *pos는 다음 검색 시작 위치로 갱신
+static gboolean next_nal_unit(const guint8 *data, gsize size, gsize *pos,
+                              const guint8 **nal, gsize *nal_size) {
+    gsize i = *pos;
+    while (i + 3 <= size && !(data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1)) {
+        i++;
+    }
+    if (i + 3 > size) {
+        return FALSE;
+    }
     
-    // 디버그: 프레임 정보 출력
-    g_print("Converting %d frames to MP4\n", frame_count);
-    if (frame_count > 0) {
-        double duration = frames[frame_count-1].timestamp - frames[0].timestamp;
-        double fps = frame_count / duration;
-        g_print("Duration: %.1f sec, Estimated FPS: %.1f\n", duration, fps);
+    gsize start = i + 3;
+    gsize j = start;
+    while (j + 3 <= size && !(data[j] == 0 && data[j + 1] == 0 && data[j + 2] == 1)) {
+        j++;
     }
+    gsize end = (j + 3 <= size) ? j : size;
+    *pos = end;
     
-    // FFmpeg로 변환 (더 큰 버퍼 사용)
-    char *cmd = g_malloc(PATH_MAX * 2);  // 동적 할당
-    char error_log[PATH_MAX];
+    // 4바이트 시작 코드의 앞 0 / trailing zero 제거
+    while (end > start && data[end - 1] == 0) {
+        end--;
+    }
+    *nal = data + start;
+    *nal_size = end - start;
+    return TRUE;
+}
+
+// 샘플에 넣지 않는 NAL (AUD, SPS/PPS는 avcC로, filler)
+static gboolean mp4_skip_nal(int nal_type) {
+    return nal_type == 7 || nal_type == 8 || nal_type == 9 || nal_type == 12;
+}
+
+// AVCC 샘플 크기 (4바이트 길이 + NAL, 제외 NAL 빼고)
+static guint32 avcc_sample_size(const H264Frame *frame) {
+    const guint8 *nal;
+    gsize nal_size, pos = 0;
+    guint32 sample_size = 0;
+    while (next_nal_unit(frame->data, frame->size, &pos, &nal, &nal_size)) {
+        if (nal_size == 0 || mp4_skip_nal(nal[0] & 0x1F)) continue;
+        sample_size += 4 + nal_size;
+    }
+    return sample_size;
+}
+
+static void write_avcc_sample(FILE *fp, const H264Frame *frame) {
+    const guint8 *nal;
+    gsize nal_size, pos = 0;
+    while (next_nal_unit(frame->data, frame->size, &pos, &nal, &nal_size)) {
+        if (nal_size == 0 || mp4_skip_nal(nal[0] & 0x1F)) continue;
+        guint8 len[4] = { nal_size >> 24, nal_size >> 16, nal_size >> 8, nal_size };
+        fwrite(len, 1, 4, fp);
+        fwrite(nal, 1, nal_size, fp);
+    }
+}
+
+static void put_avcc(GByteArray *b, const guint8 *sps, gsize sps_size,
+                     const guint8 *pps, gsize pps_size) {
+    mp4_put_u8(b, 1);           // configurationVersion
+    mp4_put_u8(b, sps[1]);      // profile
+    mp4_put_u8(b, sps[2]);      // constraint flags
+    mp4_put_u8(b, sps[3]);      // level
+    mp4_put_u8(b, 0xFF);        // lengthSizeMinusOne = 3
+    mp4_put_u8(b, 0xE1);        // SPS 1개
+    mp4_put_u16(b, sps_size);
+    g_byte_array_append(b, sps, sps_size);
+    mp4_put_u8(b, 1);           // PPS 1개
+    mp4_put_u16(b, pps_size);
+    g_byte_array_append(b, pps, pps_size);
     
-    snprintf(error_log, sizeof(error_log), "%s.ffmpeg.log", filename);
+    // High 계열 프로파일 확장 필드 (인코더 출력은 4:2:0 8bit)
+    if (sps[1] == 100 || sps[1] == 110 || sps[1] == 122 || sps[1] == 144) {
+        mp4_put_u8(b, 0xFC | 1);
+        mp4_put_u8(b, 0xF8 | 0);
+        mp4_put_u8(b, 0xF8 | 0);
+        mp4_put_u8(b, 0);
+    }
+}
+
+// avcC 생성: codec_data(avcC)가 있으면 그대로, 없으면 클립의 in-band SPS/PPS,
+// 클립에도 없으면 카메라별 파라미터 셋 캐시로 만든다
+static gboolean build_avcc(H264ClipView *view, GByteArray *b) {
+    int cam_id = view->camera_id;
+    pthread_mutex_lock(&param_set_mutex);
+    if (codec_data[cam_id] && codec_data_size[cam_id] > 6 && codec_data[cam_id][0] == 1) {
+        guint start = b->len;
+        g_byte_array_append(b, codec_data[cam_id], codec_data_size[cam_id]);
+        b->data[start + 4] |= 0x03;  // NAL 길이 4바이트
+        pthread_mutex_unlock(&param_set_mutex);
+        return TRUE;
+    }
+    pthread_mutex_unlock(&param_set_mutex);
     
-    // 길이 체크와 함께 명령어 생성
-    int cmd_len = snprintf(cmd, PATH_MAX * 2,
-             "ffmpeg -y -r %d -i %s -c:v copy -movflags faststart %s 2>%s",
-             BUFFER_FPS, temp_h264, filename, error_log);
+    const guint8 *sps = NULL, *pps = NULL;
+    gsize sps_size = 0, pps_size = 0;
+    for (int i = 0; i < view->frame_count && (!sps || !pps); i++) {
+        const H264Frame *frame = clip_view_get_frame(view, i);
+        const guint8 *nal;
+        gsize nal_size, pos = 0;
+        while (next_nal_unit(frame->data, frame->size, &pos, &nal, &nal_size)) {
+            if (nal_size == 0) continue;
+            int nal_type = nal[0] & 0x1F;
+            if (nal_type == 7 && !sps && nal_size >= 4) {
+                sps = nal;
+                sps_size = nal_size;
+            } else if (nal_type == 8 && !pps) {
+                pps = nal;
+                pps_size = nal_size;
+            }
+        }
+    }
+    if (sps && pps) {
+        put_avcc(b, sps, sps_size, pps, pps_size);
+        return TRUE;
+    }
     
-    if (cmd_len >= PATH_MAX * 2) {
-        g_warning("Command too long, truncated\n");
+    H264ParamSets ps;
+    if (get_param_sets(cam_id, &ps)) {
+        put_avcc(b, ps.sps, ps.sps_size, ps.pps, ps.pps_size);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+// 프레임 간격(90kHz). pts가 없거나 역행하면 수신 시각, 그것도 안되면 BUFFER_FPS 기준
+static guint32 frame_duration(const H264Frame *cur, const H264Frame *next) {
+    if (GST_CLOCK_TIME_IS_VALID(cur->pts) && GST_CLOCK_TIME_IS_VALID(next->pts) &&
+        next->pts > cur->pts) {
+        return (guint32)((next->pts - cur->pts) * MP4_TIMESCALE / GST_SECOND);
+    }
+    if (next->mono_time > cur->mono_time) {
+        return (guint32)((next->mono_time - cur->mono_time) * MP4_TIMESCALE);
     }
+    return MP4_TIMESCALE / BUFFER_FPS;
+}
+
+// 샘플 테이블은 비우고 mvex를 붙인다 (샘플은 moof/mdat 조각으로 기록, 길이는 조각 합)
+static void build_moov(GByteArray *b, H264ClipView *view, GByteArray *avcc) {
+    int width = codec_width[view->camera_id];
+    int height = codec_height[view->camera_id];
+    
+    guint moov = mp4_box_begin(b, "moov");
+    
+    guint mvhd = mp4_full_box_begin(b, "mvhd", 0, 0);
+    mp4_put_u32(b, 0);                      // creation_time
+    mp4_put_u32(b, 0);                      // modification_time
+    mp4_put_u32(b, MP4_MOVIE_TIMESCALE);
+    mp4_put_u32(b, 0);                      // duration
+    mp4_put_u32(b, 0x00010000);             // rate 1.0
+    mp4_put_u16(b, 0x0100);                 // volume 1.0
+    mp4_put_zeros(b, 10);
+    mp4_put_matrix(b);
+    mp4_put_zeros(b, 24);
+    mp4_put_u32(b, 2);                      // next_track_ID
+    mp4_box_end(b, mvhd);
+    
+    guint trak = mp4_box_begin(b, "trak");
+    
+    guint tkhd = mp4_full_box_begin(b, "tkhd", 0, 0x000003);  // enabled | in_movie
+    mp4_put_u32(b, 0);
+    mp4_put_u32(b, 0);
+    mp4_put_u32(b, 1);                      // track_ID
+    mp4_put_u32(b, 0);
+    mp4_put_u32(b, 0);                      // duration
+    mp4_put_zeros(b, 8);
+    mp4_put_u16(b, 0);                      // layer
+    mp4_put_u16(b, 0);                      // alternate_group
+    mp4_put_u16(b, 0);                      // volume
+    mp4_put_u16(b, 0);
+    mp4_put_matrix(b);
+    mp4_put_u32(b, (guint32)width << 16);
+    mp4_put_u32(b, (guint32)height << 16);
+    mp4_box_end(b, tkhd);
+    
+    guint mdia = mp4_box_begin(b, "mdia");
+    
+    guint mdhd = mp4_full_box_begin(b, "mdhd", 0, 0);
+    mp4_put_u32(b, 0);
+    mp4_put_u32(b, 0);
+    mp4_put_u32(b, MP4_TIMESCALE);
+    mp4_put_u32(b, 0);                      // duration
+    mp4_put_u16(b, 0x55C4);                 // 'und'
+    mp4_put_u16(b, 0);
+    mp4_box_end(b, mdhd);
+    
+    guint hdlr = mp4_full_box_begin(b, "hdlr", 0, 0);
+    mp4_put_u32(b, 0);
+    g_byte_array_append(b, (const guint8 *)"vide", 4);
+    mp4_put_zeros(b, 12);
+    g_byte_array_append(b, (const guint8 *)"VideoHandler", 13);
+    mp4_box_end(b, hdlr);
+    
+    guint minf = mp4_box_begin(b, "minf");
+    
+    guint vmhd = mp4_full_box_begin(b, "vmhd", 0, 1);
+    mp4_put_zeros(b, 8);
+    mp4_box_end(b, vmhd);
+    
+    guint dinf = mp4_box_begin(b, "dinf");
+    guint dref = mp4_full_box_begin(b, "dref", 0, 0);
+    mp4_put_u32(b, 1);
+    guint url = mp4_full_box_begin(b, "url ", 0, 1);  // 같은 파일
+    mp4_box_end(b, url);
+    mp4_box_end(b, dref);
+    mp4_box_end(b, dinf);
+    
+    guint stbl = mp4_box_begin(b, "stbl");
+    
+    guint stsd = mp4_full_box_begin(b, "stsd", 0, 0);
+    mp4_put_u32(b, 1);
+    guint avc1 = mp4_box_begin(b, "avc1");
+    mp4_put_zeros(b, 6);
+    mp4_put_u16(b, 1);                      // data_reference_index
+    mp4_put_zeros(b, 16);
+    mp4_put_u16(b, width);
+    mp4_put_u16(b, height);
+    mp4_put_u32(b, 0x00480000);             // 72 dpi
+    mp4_put_u32(b, 0x00480000);
+    mp4_put_u32(b, 0);
+    mp4_put_u16(b, 1);                      // frame_count
+    mp4_put_zeros(b, 32);                   // compressorname
+    mp4_put_u16(b, 0x0018);                 // depth
+    mp4_put_u16(b, 0xFFFF);                 // pre_defined = -1
+    guint avcc_box = mp4_box_begin(b, "avcC");
+    g_byte_array_append(b, avcc->data, avcc->len);
+    mp4_box_end(b, avcc_box);
+    mp4_box_end(b, avc1);
+    mp4_box_end(b, stsd);
+    
+    // 필수 샘플 테이블은 항목 없이 둔다
+    guint stts = mp4_full_box_begin(b, "stts", 0, 0);
+    mp4_put_u32(b, 0);
+    mp4_box_end(b, stts);
+    
+    guint stsc = mp4_full_box_begin(b, "stsc", 0, 0);
+    mp4_put_u32(b, 0);
+    mp4_box_end(b, stsc);
+    
+    guint stsz = mp4_full_box_begin(b, "stsz", 0, 0);
+    mp4_put_u32(b, 0);                      // sample_size
+    mp4_put_u32(b, 0);                      // sample_count
+    mp4_box_end(b, stsz);
+    
+    guint stco = mp4_full_box_begin(b, "stco", 0, 0);
+    mp4_put_u32(b, 0);
+    mp4_box_end(b, stco);
+    
+    mp4_box_end(b, stbl);
+    mp4_box_end(b, minf);
+    mp4_box_end(b, mdia);
+    mp4_box_end(b, trak);
+    
+    guint mvex = mp4_box_begin(b, "mvex");
+    guint trex = mp4_full_box_begin(b, "trex", 0, 0);
+    mp4_put_u32(b, 1);                      // track_ID
+    mp4_put_u32(b, 1);                      // default_sample_description_index
+    mp4_put_u32(b, 0);
+    mp4_put_u32(b, 0);
+    mp4_put_u32(b, 0);
+    mp4_box_end(b, trex);
+    mp4_box_end(b, mvex);
     
-    g_print("Running: %s\n", cmd);
+    mp4_box_end(b, moov);
+}
+
+// 진행 중인 클립을 fragmented MP4로 기록 (moov 뒤에 moof + mdat 조각을 이어 붙임).
+// 마지막 프레임의 간격은 다음 프레임이 와야 알 수 있으므로 한 프레임씩 늦게 기록한다.
+typedef struct Mp4FragmentWriter {
+    FILE *fp;
+    char *path;                     // 마무리 후 rename할 최종 경로
+    char *part_path;                // 기록 중인 "<path>.part"
+    int camera_id;
+    guint32 sequence;
+    guint64 decode_time;            // 다음 조각의 tfdt (90kHz)
+    guint32 last_duration;
+    H264ClipView *held_view;        // 아직 기록하지 않은 마지막 프레임이 든 뷰
+    const H264Frame *held_frame;
+    int frames_written;
+} Mp4FragmentWriter;
+
+static gboolean fragment_writer_open(Mp4FragmentWriter *writer, H264ClipView *view, const char *filename) {
+    memset(writer, 0, sizeof(*writer));
+    writer->camera_id = view->camera_id;
+    writer->last_duration = MP4_TIMESCALE / BUFFER_FPS;
     
-    int ret = system(cmd);
-    gboolean success = (ret == 0);
+    GByteArray *avcc = g_byte_array_new();
+    if (!build_avcc(view, avcc)) {
+        g_warning("Camera %d: No SPS/PPS found for MP4 clip\n", view->camera_id);
+        g_byte_array_free(avcc, TRUE);
+        return FALSE;
+    }
     
-    if (success) {
-        g_print("Converted to MP4: %s\n", filename);
-        unlink(temp_h264);
-        unlink(error_log);
+    GByteArray *header = g_byte_array_new();
+    guint ftyp = mp4_box_begin(header, "ftyp");
+    g_byte_array_append(header, (const guint8 *)"isom", 4);
+    mp4_put_u32(header, 0x200);
+    g_byte_array_append(header, (const guint8 *)"isomiso6avc1mp41", 16);
+    mp4_box_end(header, ftyp);
+    build_moov(header, view, avcc);
+    
+    // 마무리(fragment_writer_close)할 때까지는 .part에 쓴다
+    writer->path = g_strdup(filename);
+    writer->part_path = g_strdup_printf("%s.part", filename);
+    writer->fp = fopen(writer->part_path, "wb");
+    if (writer->fp) {
+        setvbuf(writer->fp, NULL, _IOFBF, MP4_WRITE_BUFFER_SIZE);
+        fwrite(header->data, 1, header->len, writer->fp);
     } else {
-        g_warning("FFmpeg failed (exit code: %d). Check %s for errors\n", 
-                  WEXITSTATUS(ret), error_log);
-        g_print("H.264 file kept: %s\n", temp_h264);
+        g_warning("Failed to open %s\n", writer->part_path);
+        g_free(writer->path);
+        g_free(writer->part_path);
     }
+    
+    g_byte_array_free(header, TRUE);
+    g_byte_array_free(avcc, TRUE);
+    return writer->fp != NULL;
+}
 
-    if (g_save_callback && frame_count > 0) {
-        int camera_id = frames[0].camera_id;
-        double event_time = frames[frame_count/2].timestamp; // 중간 시점
-        g_save_callback(camera_id, event_id, filename, http_path, success, event_time, g_callback_user_data);
+// moof(mfhd + traf(tfhd, tfdt, trun)) + mdat 하나를 기록
+static void write_fragment(Mp4FragmentWriter *writer, const H264Frame **frames,
+                           const guint32 *durations, int n) {
+    GByteArray *b = g_byte_array_new();
+    guint32 payload = 0;
+    
+    guint moof = mp4_box_begin(b, "moof");
+    guint mfhd = mp4_full_box_begin(b, "mfhd", 0, 0);
+    mp4_put_u32(b, ++writer->sequence);
+    mp4_box_end(b, mfhd);
+    
+    guint traf = mp4_box_begin(b, "traf");
+    guint tfhd = mp4_full_box_begin(b, "tfhd", 0, 0x020000);  // default-base-is-moof
+    mp4_put_u32(b, 1);
+    mp4_box_end(b, tfhd);
+    
+    guint tfdt = mp4_full_box_begin(b, "tfdt", 1, 0);
+    mp4_put_u64(b, writer->decode_time);
+    mp4_box_end(b, tfdt);
+    
+    // data-offset, sample-duration, sample-size, sample-flags
+    guint trun = mp4_full_box_begin(b, "trun", 0, 0x000701);
+    mp4_put_u32(b, n);
+    guint data_offset_pos = b->len;
+    mp4_put_u32(b, 0);
+    for (int i = 0; i < n; i++) {
+        guint32 sample_size = avcc_sample_size(frames[i]);
+        mp4_put_u32(b, durations[i]);
+        mp4_put_u32(b, sample_size);
+        mp4_put_u32(b, frames[i]->is_idr ? 0x02000000 : 0x01010000);
+        payload += sample_size;
+        writer->decode_time += durations[i];
     }
+    mp4_box_end(b, trun);
+    mp4_box_end(b, traf);
+    mp4_box_end(b, moof);
     
-    g_free(cmd);  // 메모리 해제
+    guint32 data_offset = b->len + 8;
+    b->data[data_offset_pos] = data_offset >> 24;
+    b->data[data_offset_pos + 1] = data_offset >> 16;
+    b->data[data_offset_pos + 2] = data_offset >> 8;
+    b->data[data_offset_pos + 3] = data_offset;
+    
+    mp4_put_u32(b, 8 + payload);
+    g_byte_array_append(b, (const guint8 *)"mdat", 4);
+    fwrite(b->data, 1, b->len, writer->fp);
+    g_byte_array_free(b, TRUE);
+    
+    for (int i = 0; i < n; i++) {
+        write_avcc_sample(writer->fp, frames[i]);
+    }
+    writer->frames_written += n;
 }
 
-// 이벤트 발생 워커 스레드
-void* save_event_worker(void *arg) {
-    SaveEventTask *task = (SaveEventTask*)arg;
+// IDR마다 또는 EVENT_FRAGMENT_MAX_FRAMES마다 조각을 나눈다
+static void write_fragments(Mp4FragmentWriter *writer, const H264Frame **frames,
+                            const guint32 *durations, int n) {
+    int begin = 0;
+    for (int i = 1; i <= n; i++) {
+        if (i == n || frames[i]->is_idr || i - begin >= EVENT_FRAGMENT_MAX_FRAMES) {
+            write_fragment(writer, frames + begin, durations + begin, i - begin);
+            begin = i;
+        }
+    }
+}
+
+// 새로 복사한 프레임을 이어서 기록 (view의 마지막 프레임은 다음 호출까지 보류)
+static gboolean fragment_writer_append(Mp4FragmentWriter *writer, H264ClipView *view) {
+    int n = view->frame_count + (writer->held_frame ? 1 : 0);
+    const H264Frame **frames = g_malloc(n * sizeof(H264Frame *));
+    guint32 *durations = g_malloc(n * sizeof(guint32));
     
-    g_print("\n=== Save Event Worker ===\n");
-    g_print("Camera %d: Event at %.2f\n", task->camera_id, task->event_time);
-    g_print("Waiting %d seconds for post-event data...\n", task->after_sec + 1);
+    int k = 0;
+    if (writer->held_frame) {
+        frames[k++] = writer->held_frame;
+    }
+    for (int i = 0; i < view->frame_count; i++) {
+        frames[k++] = clip_view_get_frame(view, i);
+    }
+    for (int i = 0; i + 1 < n; i++) {
+        durations[i] = frame_duration(frames[i], frames[i + 1]);
+    }
+    if (n > 1) {
+        writer->last_duration = durations[n - 2];
+        write_fragments(writer, frames, durations, n - 1);
+    }
     
-    sleep(task->after_sec + 1);
+    clip_view_unref(writer->held_view);
+    writer->held_view = clip_view_ref(view);
+    writer->held_frame = frames[n - 1];
     
-    g_print("Extracting clip: %d sec before, %d sec after\n", 
-            task->before_sec, task->after_sec);
+    g_free(frames);
+    g_free(durations);
     
-    H264Frame *frames = NULL;
-    int frame_count = 0;
+    // 조각 단위로 내보내야 기록 중인 파일을 재생할 수 있다
+    return fflush(writer->fp) == 0 && !ferror(writer->fp);
+}
+
+static gboolean fragment_writer_close(Mp4FragmentWriter *writer) {
+    if (writer->held_frame) {
+        write_fragment(writer, &writer->held_frame, &writer->last_duration, 1);
+        writer->held_frame = NULL;
+    }
+    clip_view_unref(writer->held_view);
+    writer->held_view = NULL;
     
-    if (extract_event_clip(task->camera_id, task->event_time, 
-                          task->before_sec, task->after_sec, 
-                          &frames, &frame_count) == 0) {
-        // MP4로 저장
-        save_mp4_clip(frames, frame_count, task->filename, task->http_path, task->event_id);
-        
-        // 메모리 해제
-        for (int i = 0; i < frame_count; i++) {
-            g_free(frames[i].data);
+    // 디스크에 내려간 뒤에만 최종 경로로 옮긴다. 중간에 한 번이라도 쓰기가 실패했으면 ferror로 남아있다
+    gboolean ok = fflush(writer->fp) == 0 && !ferror(writer->fp) && fsync(fileno(writer->fp)) == 0;
+    if (fclose(writer->fp) != 0) {
+        ok = FALSE;
+    }
+    writer->fp = NULL;
+    if (ok && rename(writer->part_path, writer->path) != 0) {
+        ok = FALSE;
+    }
+    if (!ok) {
+        unlink(writer->part_path);
+    }
+    g_free(writer->path);
+    g_free(writer->part_path);
+    return ok;
+}
+
+static double mono_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 태스크를 한 주기만큼 진행한다 (clip writer 스레드): 처음에는 pre-roll부터 지금까지,
+// 이후에는 지난 주기 뒤로 들어온 프레임을 조각으로 덧붙인다. 기록에 실패하면 FALSE
+static gboolean write_clip_task(SaveEventTask *task, double end_time, double now) {
+    int camera_id = task->camera_id;
+    double upto = MIN(end_time, now);
+    H264ClipView *view = NULL;
+    gboolean ok = TRUE;
+    
+    if (!task->writer) {
+        if (upto <= task->start_mono_time ||
+            extract_event_clip(camera_id, task->start_mono_time, upto, &view) != 0) {
+            return TRUE;  // 아직 프레임이 없으면 다음 주기에 다시
+        }
+        task->writer = g_malloc0(sizeof(Mp4FragmentWriter));
+        if (!fragment_writer_open(task->writer, view, task->filename)) {
+            g_free(task->writer);
+            task->writer = NULL;
+            clip_view_unref(view);
+            return FALSE;
         }
-        g_free(frames);
+        ok = fragment_writer_append(task->writer, view);
+        task->next_index = view->first_index + view->frame_count;
+        clip_view_unref(view);
+        g_print("Camera %d: Clip %s recording, %d pre-roll frames\n",
+                camera_id, task->filename, task->writer->frames_written);
+    } else if (extract_frames_since(camera_id, task->next_index, upto, &view) != 0) {
+        g_warning("Camera %d: frames for %s overwritten, finalizing clip early\n",
+                  camera_id, task->filename);
+        ok = FALSE;
+    } else if (view) {
+        ok = fragment_writer_append(task->writer, view);
+        task->next_index += view->frame_count;
+        clip_view_unref(view);
+    }
+    return ok;
+}
+
+// 목록에서 빼고 파일을 마무리한 뒤 합쳐진 모든 이벤트를 실제 결과로 알린다
+// (clip writer 스레드, scheduler_mutex 없이 호출)
+static void finish_clip_task(SaveEventTask *task) {
+    int camera_id = task->camera_id;
+    int ids[EVENT_CLIP_MAX_EVENTS];
+    
+    pthread_mutex_lock(&scheduler_mutex);
+    // 목록에서 빼면 이후 이벤트는 새 클립으로 간다
+    SaveEventTask **link = &pending_tasks[camera_id];
+    while (*link && *link != task) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = task->next;
+    }
+    int id_count = task->event_count;
+    memcpy(ids, task->event_ids, id_count * sizeof(int));
+    pthread_mutex_unlock(&scheduler_mutex);
+    
+    gboolean saved = FALSE;
+    if (task->writer) {
+        int frames = task->writer->frames_written + (task->writer->held_frame ? 1 : 0);
+        saved = fragment_writer_close(task->writer);
+        if (saved) {
+            g_print("Saved MP4: %s (%d frames, %d events merged)\n", task->filename, frames,
+                    task->merged_events);
+        } else {
+            g_warning("Failed to write MP4 clip %s\n", task->filename);
+        }
+        g_free(task->writer);
+    }
+    if (g_save_callback) {
+        g_save_callback(camera_id, ids, id_count, task->filename, task->http_path, saved,
+                        task->event_time, g_callback_user_data);
     }
     
     g_free(task);
+}
+
+// 기록 중인 모든 클립을 스레드 하나가 EVENT_FRAGMENT_INTERVAL_MS마다 돌아가며 진행한다.
+// 클립마다 스레드를 잡아두지 않으므로 동시에 기록하는 클립 수에 제한이 없다.
+static void *clip_writer_worker(void *arg) {
+    pthread_mutex_lock(&scheduler_mutex);
+    while (TRUE) {
+        gboolean running = scheduler_running;
+        
+        // 태스크는 이 스레드만 목록에서 빼므로 잠금을 풀었다 잡아도 next는 유효하다
+        for (int cam_id = 0; cam_id < NUM_CAMERAS; cam_id++) {
+            SaveEventTask *task = pending_tasks[cam_id];
+            while (task) {
+                // on_event_detected가 구간을 늘릴 수 있으므로 매번 다시 읽는다
+                double end_time = task->end_mono_time;
+                double now = mono_now();
+                pthread_mutex_unlock(&scheduler_mutex);
+                
+                gboolean ok = write_clip_task(task, end_time, now);
+                
+                pthread_mutex_lock(&scheduler_mutex);
+                SaveEventTask *next = task->next;
+                if (!ok || !running ||
+                    (now >= end_time + EVENT_CLIP_SAVE_DELAY_SEC && end_time == task->end_mono_time)) {
+                    pthread_mutex_unlock(&scheduler_mutex);
+                    finish_clip_task(task);
+                    pthread_mutex_lock(&scheduler_mutex);
+                }
+                task = next;
+            }
+        }
+        
+        // 멈춘 뒤에는 새 태스크가 들어오지 않고, 남은 태스크는 위에서 모두 마무리했다
+        if (!running) {
+            break;
+        }
+        
+        double deadline = mono_now() + EVENT_FRAGMENT_INTERVAL_MS / 1000.0;
+        struct timespec ts;
+        ts.tv_sec = (time_t)deadline;
+        ts.tv_nsec = (long)((deadline - ts.tv_sec) * 1e9);
+        pthread_cond_timedwait(&scheduler_cond, &scheduler_mutex, &ts);
+    }
+    pthread_mutex_unlock(&scheduler_mutex);
     return NULL;
 }
 
-// 이벤트 발생 시 호출할 함수
-void on_event_detected(int camera_id, int class_id, double event_time) {
-    SaveEventTask *task = g_malloc(sizeof(SaveEventTask));
-    task->camera_id = camera_id;
-    task->event_id = class_id;  // 이벤트
-    task->event_time = event_time;
-    task->before_sec = 15;
-    task->after_sec = 15;
+static void start_event_scheduler(void) {
+    // 조각 기록 주기 타이머는 monotonic 시각 기준
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&scheduler_cond, &attr);
+    pthread_condattr_destroy(&attr);
     
-    // 파일명 생성 - 수정된 버전
-    time_t t = (time_t)event_time;
+    scheduler_running = TRUE;
+    if (pthread_create(&clip_writer_thread, NULL, clip_writer_worker, NULL) != 0) {
+        g_warning("Failed to start clip writer\n");
+        scheduler_running = FALSE;
+        pthread_cond_destroy(&scheduler_cond);
+    }
+}
+
+// 기록 중인 클립은 지금까지의 프레임으로 마무리하고 끝날 때까지 기다린다
+static void stop_event_scheduler(void) {
+    pthread_mutex_lock(&scheduler_mutex);
+    if (!scheduler_running) {
+        pthread_mutex_unlock(&scheduler_mutex);
+        return;
+    }
+    scheduler_running = FALSE;
+    pthread_cond_broadcast(&scheduler_cond);
+    pthread_mutex_unlock(&scheduler_mutex);
+    
+    pthread_join(clip_writer_thread, NULL);
+    pthread_cond_destroy(&scheduler_cond);
+}
+
+static void add_task_event_id(SaveEventTask *task, int event_id) {
+    task->merged_events++;
+    for (int i = 0; i < task->event_count; i++) {
+        if (task->event_ids[i] == event_id) {
+            return;
+        }
+    }
+    if (task->event_count < EVENT_CLIP_MAX_EVENTS) {
+        task->event_ids[task->event_count++] = event_id;
+    }
+}
+
+// 클립 파일 경로 생성 (record_path/EVENT_YYYYMMDD/CAMn_HHMMSS.mp4)
+static void make_event_clip_path(SaveEventTask *task) {
+    time_t t = (time_t)task->event_time;
     struct tm *local_time = localtime(&t);
     char date_folder[256];
     
@@ -464,7 +1704,7 @@ void on_event_detected(int camera_id, int class_id, double event_time) {
             local_time->tm_year + 1900,
             local_time->tm_mon + 1,
             local_time->tm_mday,
-            camera_id,
+            task->camera_id,
             local_time->tm_hour,
             local_time->tm_min,
             local_time->tm_sec);
@@ -474,38 +1714,128 @@ void on_event_detected(int camera_id, int class_id, double event_time) {
             local_time->tm_year + 1900,
             local_time->tm_mon + 1,
             local_time->tm_mday,
-            camera_id,
+            task->camera_id,
             local_time->tm_hour,
             local_time->tm_min,
             local_time->tm_sec);
+}
+
+// 이벤트 발생 시 호출할 함수
+// 같은 카메라에서 구간이 겹치거나 이어지는 이벤트는 기록 중인 클립에 합친다.
+void on_event_detected(int camera_id, int class_id, double event_time) {
+    if (camera_id < 0 || camera_id >= NUM_CAMERAS) {
+        return;
+    }
     
-    // 비동기로 저장 작업 실행
-    pthread_t thread;
-    pthread_create(&thread, NULL, save_event_worker, task);
-    pthread_detach(thread);
+    int before_sec = g_config.event_pre_roll_sec > 0 ? g_config.event_pre_roll_sec : EVENT_DEFAULT_PRE_ROLL_SEC;
+    double event_mono_time = realtime_to_mono_time(event_time);
+    double start_time = event_mono_time - before_sec;
+    double end_time = event_mono_time + EVENT_DEFAULT_POST_ROLL_SEC;
     
-    g_print("Camera %d: Event : %d Event detected at %.2f, clip save scheduled\n", 
+    pthread_mutex_lock(&scheduler_mutex);
+    
+    if (!scheduler_running) {
+        pthread_mutex_unlock(&scheduler_mutex);
+        g_warning("Camera %d: clip scheduler not running, event %d dropped\n", camera_id, class_id);
+        return;
+    }
+    
+    SaveEventTask *last = pending_tasks[camera_id];
+    while (last && last->next) {
+        last = last->next;
+    }
+    
+    if (last && start_time <= last->end_mono_time + EVENT_CLIP_MERGE_GAP_SEC &&
+        end_time - last->start_mono_time <= EVENT_CLIP_MAX_SEC) {
+        // 기록 중인 클립 구간을 늘린다 (워커가 다음 주기에 반영)
+        last->end_mono_time = MAX(last->end_mono_time, end_time);
+        add_task_event_id(last, class_id);
+        pthread_mutex_unlock(&scheduler_mutex);
+        
+        g_print("Camera %d: Event : %d merged into clip %s (%d events)\n",
+                camera_id, class_id, last->filename, last->merged_events);
+        return;
+    }
+    
+    // 합칠 수 없으면 앞 클립과 겹치더라도 요청한 pre-roll을 모두 담은 새 클립으로 기록한다
+    SaveEventTask *task = g_malloc0(sizeof(SaveEventTask));
+    task->camera_id = camera_id;
+    task->event_time = event_time;
+    task->start_mono_time = start_time;
+    task->end_mono_time = end_time;
+    add_task_event_id(task, class_id);
+    make_event_clip_path(task);
+    
+    if (last) {
+        last->next = task;
+    } else {
+        pending_tasks[camera_id] = task;
+    }
+    pthread_cond_signal(&scheduler_cond);  // pre-roll은 다음 주기를 기다리지 않고 바로 기록
+    pthread_mutex_unlock(&scheduler_mutex);
+    
+    g_print("Camera %d: Event : %d Event detected at %.2f, clip recording started\n", 
             camera_id, class_id, event_time);
     g_print("Save path: %s\n", task->filename);
 }
 
 // 버퍼 상태 확인
-void get_buffer_status(int camera_id, int *frame_count, double *duration, size_t *total_size) {
-    if (camera_id < 0 || camera_id >= NUM_CAMERAS) {
+void get_buffer_status(int camera_id, BufferStatus *status) {
+    if (camera_id < 0 || camera_id >= NUM_CAMERAS || !status) {
         return;
     }
     
+    memset(status, 0, sizeof(BufferStatus));
+    
     H264CircularBuffer *buffer = &circular_buffers[camera_id];
-    pthread_mutex_lock(&buffer->mutex);
+    if (!buffer->initialized) {
+        return;
+    }
+    
+    ring_lock(buffer);
     
-    if (frame_count) *frame_count = buffer->frame_count;
-    if (total_size) *total_size = buffer->total_bytes;
+    // writer 통계는 잠금 없이 읽는 근사값
+    int oldest_index = ram_oldest_index(buffer);
+    int newest_index = g_atomic_int_get(&buffer->total_frames_written) - 1;
+    status->frame_count = newest_index - oldest_index + 1;
+    status->total_size = buffer->total_bytes;
+    status->arena_size = buffer->arena_size;
+    status->peak_size = buffer->peak_bytes;
+    status->peak_frame_count = buffer->peak_frame_count;
+    status->max_frame_size = buffer->max_frame_size;
+    status->evicted_by_bytes = buffer->evicted_by_bytes;
+    status->evicted_by_count = buffer->evicted_by_count;
+    status->dropped_frames = buffer->dropped_frames;
+    status->gop_count = g_atomic_int_get(&buffer->gop_tail) - g_atomic_int_get(&buffer->gop_head);
+    status->bytes_copied = buffer->bytes_copied;
+    status->view_bytes_copied = buffer->view_bytes_copied;
+    status->lock_count = buffer->lock_count;
+    status->lock_hold_total_ns = buffer->lock_hold_total_ns;
+    status->lock_hold_max_ns = buffer->lock_hold_max_ns;
     
-    if (duration && buffer->frame_count > 0) {
-        int start_idx = (buffer->write_pos - buffer->frame_count + MAX_FRAMES) % MAX_FRAMES;
-        int end_idx = (buffer->write_pos - 1 + MAX_FRAMES) % MAX_FRAMES;
-        *duration = buffer->frames[end_idx].timestamp - buffer->frames[start_idx].timestamp;
+    H264DiskTier *disk = &buffer->disk;
+    if (disk->map) {
+        status->disk_frame_count = disk->count;
+        if (disk->count > 0) {
+            status->disk_duration = disk->frames[(disk->head + disk->count - 1) % disk->capacity].mono_time -
+                                    disk->frames[disk->head].mono_time;
+        }
+        status->disk_size = disk->file_size;
+        status->disk_flushed_bytes = disk->flushed_bytes;
+        status->disk_lost_frames = disk->lost_frames;
+    }
+    
+    if (buffer->arena_size > 0) {
+        status->arena_fill = (double)buffer->total_bytes / buffer->arena_size;
+        status->peak_fill = (double)buffer->peak_bytes / buffer->arena_size;
     }
     
-    pthread_mutex_unlock(&buffer->mutex);
-}
\ No newline at end of file
+    H264Frame oldest, newest;
+    if (status->frame_count > 0 &&
+        read_ram_frame(buffer, oldest_index, &oldest, NULL) &&
+        read_ram_frame(buffer, newest_index, &newest, NULL)) {
+        status->duration = newest.mono_time - oldest.mono_time;
+    }
+    
+    ring_unlock(buffer);
+}
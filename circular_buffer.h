@@ -13,55 +13,190 @@
 #define MAX_FRAMES (CIRCULAR_BUFFER_DURATION * BUFFER_FPS)
 #define MAX_FRAME_SIZE (1024 * 1024)  // 1MB per frame
 
+// 바이트 arena 크기 = 비트레이트 x 버퍼 시간 x 여유율
+#define EVENT_RING_DEFAULT_BITRATE 4000000  // config에 bitrate_high가 없을 때 (nvv4l2h264enc 설정값)
+#define EVENT_RING_HEADROOM_PERCENT 125     // IDR 프레임 및 비트레이트 변동 여유
+#define EVENT_RING_MIN_ARENA_SIZE (8 * 1024 * 1024)
+
+// 디스크 계층 (config의 event_disk_ring_sec > 0 일 때만 사용)
+#define EVENT_DISK_CHUNK_SIZE (4 * 1024 * 1024)  // 한 번에 내려쓰는 크기
+#define EVENT_DISK_ALIGN 4096
+#define EVENT_DISK_FLUSH_INTERVAL_MS 200
+#define EVENT_DEFAULT_PRE_ROLL_SEC 15
+#define EVENT_DEFAULT_POST_ROLL_SEC 15
+
+// 이벤트 클립 스케줄러
+#define EVENT_CLIP_MERGE_GAP_SEC 1.0    // 이 간격 이내의 이벤트 구간은 하나의 클립으로 합침
+#define EVENT_CLIP_MAX_SEC CIRCULAR_BUFFER_DURATION  // 합쳐진 클립의 최대 길이 (RAM ring 보관 시간 이내)
+#define EVENT_CLIP_MAX_EVENTS 16
+#define EVENT_CLIP_SAVE_DELAY_SEC 1.0   // 구간 종료 후 마무리까지 대기
+#define EVENT_FRAGMENT_INTERVAL_MS 1000 // 기록 중인 클립에 새 프레임을 덧붙이는 주기
+#define EVENT_FRAGMENT_MAX_FRAMES (BUFFER_FPS * 2)
+
 extern WebRTCConfig g_config;
 
-typedef void (*EventSaveCallback)(int camera_id, int event_id, const char *filename, const char *http_path,
+// event_ids: 합쳐진 클립에 포함된 이벤트 id 목록 (중복 제외)
+// 클립 파일을 마무리(fsync, rename)한 뒤 한 번 호출된다. success는 실제 기록 결과
+typedef void (*EventSaveCallback)(int camera_id, const int *event_ids, int event_count,
+                                 const char *filename, const char *http_path,
                                  gboolean success, double event_time, void *user_data);
 // H.264 프레임 정보 구조체
 typedef struct {
-    guint8 *data;
+    guint8 *data;           // 순환 버퍼에서는 arena 내부를 가리킴
+    gsize offset;           // arena 내 위치
     gsize size;
     gboolean is_keyframe;
+    gboolean is_idr;
     GstClockTime pts;
-    double timestamp;
+    double mono_time;       // CLOCK_MONOTONIC 기준 (검색용 타임라인)
+    double timestamp;       // 수신 시점의 실제 시각 (표시용)
     int index;
     int camera_id;
 } H264Frame;
 
+// GOP 인덱스 항목 (IDR 프레임마다 하나)
+typedef struct {
+    int index;              // IDR 프레임의 H264Frame.index
+    double mono_time;
+} GopEntry;
+
+// 디스크 계층: record_path의 ring 파일(fallocate)을 mmap 해서 읽고,
+// RAM에서 밀려나기 전의 프레임을 큰 정렬 단위로 순차 기록한다.
+typedef struct {
+    int fd;
+    guint8 *map;                    // ring 파일 전체 (읽기 전용 mmap)
+    gsize file_size;
+    gsize write_offset;
+    H264Frame *frames;              // 디스크에 기록된 프레임 (기록 순서 FIFO)
+    int capacity;
+    int head;
+    int count;
+    int next_index;                 // 다음에 기록할 프레임 index
+    int valid_from;                 // 이 index부터 RAM까지 끊김 없이 이어짐
+    guint8 *staging;                // 정렬된 쓰기 버퍼 (EVENT_DISK_CHUNK_SIZE)
+    guint64 flushed_bytes;
+    guint64 lost_frames;            // 기록 전에 RAM에서 밀려난 프레임 수
+} H264DiskTier;
+
 // 순환 버퍼 구조체
+// 프레임 데이터는 카메라별 연속 arena에 가변 길이로 연달아 저장하고,
+// frames[]는 arena 위치만 기록하는 디스크립터 링으로 사용한다.
+// writer(h264parse probe)는 카메라당 하나이고 mutex를 잡지 않는다.
+// index i 프레임은 항상 frames[i % MAX_FRAMES]에 있고, 슬롯의 index 값이 세대 번호 역할을 한다
+// (기록 완료 후 index 게시, 제거 시 -1). reader는 읽은 뒤 index가 그대로인지 확인한다.
 typedef struct {
     H264Frame frames[MAX_FRAMES];
+    guint8 *arena;
+    gsize arena_size;
+    gsize write_offset;             // 이하 writer 전용
     int write_pos;
     int frame_count;
-    int total_frames_written;
-    size_t total_bytes;
-    pthread_mutex_t mutex;
+    int total_frames_written;       // 게시된 프레임 수 (atomic, 다음 index)
+    int oldest_index;               // RAM에 남은 가장 오래된 index (atomic)
+    GopEntry gop_index[MAX_FRAMES]; // 버퍼에 남아있는 IDR 프레임 (시간순)
+    int gop_head;                   // 누적 제거 수 (atomic)
+    int gop_tail;                   // 누적 추가 수 (atomic)
+    size_t total_bytes;             // arena에 살아있는 프레임 바이트 합
+    size_t peak_bytes;              // total_bytes 최대치 (high-water)
+    int peak_frame_count;
+    gsize max_frame_size;           // 지금까지 받은 최대 프레임 크기
+    guint64 evicted_by_bytes;       // 공간 부족으로 밀려난 프레임 수
+    guint64 evicted_by_count;       // 디스크립터 부족으로 밀려난 프레임 수
+    guint64 dropped_frames;         // arena보다 커서 버린 프레임 수
+    guint64 bytes_copied;           // arena로 복사한 누적 바이트
+    guint64 view_bytes_copied;      // 클립 뷰로 복사한 누적 바이트 (mutex 보유 중에만 갱신)
+    H264DiskTier disk;              // disk.map == NULL 이면 RAM만 사용
+    pthread_mutex_t mutex;          // reader끼리만 사용 (disk 계층, 뷰 복사)
+    gint64 lock_acquired_ns;        // 이하 mutex 보유 중에만 갱신
+    guint64 lock_count;
+    guint64 lock_hold_total_ns;
+    guint64 lock_hold_max_ns;
     gboolean initialized;
     int camera_id;
 } H264CircularBuffer;
 
-// 이벤트 저장 태스크 구조체
+// 순환 버퍼 프레임 구간의 복사본 (refcount).
+// 만들 때 한 블록으로 복사해 두므로 writer와 디스크 flusher는 뷰를 피해가지 않고 계속 밀어낸다.
+typedef struct H264ClipView {
+    int camera_id;
+    int first_index;                // 첫 프레임의 H264Frame.index
+    int frame_count;
+    int disk_frame_count;           // 앞쪽에서 디스크 계층으로부터 읽은 프레임 수
+    H264Frame *frames;              // data는 아래 블록 안을 가리킴
+    guint8 *data;
+    int refcount;
+} H264ClipView;
+
+// 버퍼 상태 (get_buffer_status)
 typedef struct {
+    int frame_count;
+    double duration;
+    size_t total_size;
+    size_t arena_size;
+    double arena_fill;              // total_size / arena_size (0.0 ~ 1.0)
+    size_t peak_size;
+    double peak_fill;
+    int peak_frame_count;
+    gsize max_frame_size;
+    guint64 evicted_by_bytes;
+    guint64 evicted_by_count;
+    guint64 dropped_frames;
+    int gop_count;
+    int disk_frame_count;           // 디스크 계층 (사용하지 않으면 0)
+    double disk_duration;
+    size_t disk_size;
+    guint64 disk_flushed_bytes;
+    guint64 disk_lost_frames;
+    guint64 bytes_copied;           // writer가 arena로 복사한 누적 바이트
+    guint64 view_bytes_copied;      // reader가 클립 뷰로 복사한 누적 바이트
+    guint64 lock_count;             // reader 잠금 횟수와 보유 시간
+    guint64 lock_hold_total_ns;
+    guint64 lock_hold_max_ns;
+} BufferStatus;
+
+// 카메라별 SPS/PPS 캐시 (in-band 파라미터 셋이 바뀔 때 갱신)
+#define H264_MAX_PARAM_SET_SIZE 256
+typedef struct {
+    guint8 sps[H264_MAX_PARAM_SET_SIZE];
+    gsize sps_size;
+    guint8 pps[H264_MAX_PARAM_SET_SIZE];
+    gsize pps_size;
+    guint version;                  // 바뀔 때마다 증가
+} H264ParamSets;
+
+// 이벤트 저장 태스크 구조체
+// 카메라별로 겹치거나 이어지는 이벤트 구간은 기록 중인 태스크로 합쳐진다.
+typedef struct SaveEventTask {
     int camera_id;
-    int event_id;
-    double event_time;
-    int before_sec;
-    int after_sec;
+    int event_ids[EVENT_CLIP_MAX_EVENTS];
+    int event_count;
+    int merged_events;              // 합쳐진 이벤트 수 (같은 id 포함)
+    double event_time;              // 첫 이벤트의 실제 시각 (파일명, 알림용)
+    double start_mono_time;         // 클립 구간 (순환 버퍼 monotonic 시각)
+    double end_mono_time;
     char filename[256];
     char http_path[256];
+    struct Mp4FragmentWriter *writer;   // 기록 중인 파일 (pre-roll을 쓰기 전에는 NULL)
+    int next_index;                     // 다음에 덧붙일 프레임 index
+    struct SaveEventTask *next;
 } SaveEventTask;
 
 // 함수 선언
 void init_all_circular_buffers(void);
 void cleanup_all_circular_buffers(void);
 void add_frame_to_buffer(GstBuffer *buffer, gboolean is_keyframe, int camera_id);
-int extract_event_clip(int camera_id, double event_time, int before_sec, int after_sec, 
-                      H264Frame **out_frames, int *out_frame_count);
-void save_h264_clip(H264Frame *frames, int frame_count, const char *filename);
-void save_mp4_clip(H264Frame *frames, int frame_count, const char *filename, const char *http_path, int event_id);
+int extract_event_clip(int camera_id, double start_mono_time, double end_mono_time,
+                      H264ClipView **out_view);
+int extract_frames_since(int camera_id, int next_index, double end_mono_time,
+                         H264ClipView **out_view);
+double realtime_to_mono_time(double realtime);
+H264ClipView *clip_view_ref(H264ClipView *view);
+void clip_view_unref(H264ClipView *view);
+const H264Frame *clip_view_get_frame(H264ClipView *view, int i);
 void on_event_detected(int camera_id, int class_id, double event_time);
-void get_buffer_status(int camera_id, int *frame_count, double *duration, size_t *total_size);
+void get_buffer_status(int camera_id, BufferStatus *status);
 void save_codec_data(int camera_id, GstCaps *caps);
+gboolean get_param_sets(int camera_id, H264ParamSets *out);
 void set_event_save_callback(EventSaveCallback callback, void *user_data);
 
 #endif // CIRCULAR_BUFFER_H
\ No newline at end of file
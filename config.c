@@ -14,6 +14,34 @@ static inline char* safe_get_string(JsonObject *obj, const char *member) {
     return str ? g_strdup(str) : NULL;
 }
 
+static inline int safe_get_int(JsonObject *obj, const char *member, int def) {
+    return json_object_has_member(obj, member) ? json_object_get_int_member(obj, member) : def;
+}
+
+// "ladder": [{"width":1280,"height":720,"fps":5,"bitrate":1000000,"gop":5}, ...]
+static void parse_ladder(JsonObject *child, EncoderRung *ladder, int *ladder_cnt)
+{
+    *ladder_cnt = 0;
+    if (!json_object_has_member(child, "ladder"))
+        return;
+
+    JsonArray *array = json_object_get_array_member(child, "ladder");
+    int cnt = MIN((int)json_array_get_length(array), MAX_ENC_RUNGS);
+    for (int r = 0; r < cnt; r++)
+    {
+        JsonObject *rung = json_array_get_object_element(array, r);
+        ladder[r].width = safe_get_int(rung, "width", 0);
+        ladder[r].height = safe_get_int(rung, "height", 0);
+        ladder[r].fps = safe_get_int(rung, "fps", 0);
+        ladder[r].bitrate = safe_get_int(rung, "bitrate", 0);
+        ladder[r].gop = safe_get_int(rung, "gop", 0);
+        ladder[r].peak_bitrate = safe_get_int(rung, "peak_bitrate", 0);
+        glog_trace("parse ladder rung %d : %dx%d %d fps, %d bps, gop %d\n", r, ladder[r].width,
+                   ladder[r].height, ladder[r].fps, ladder[r].bitrate, ladder[r].gop);
+    }
+    *ladder_cnt = cnt;
+}
+
 int load_config(const char *file_name, WebRTCConfig *config, CurlIinfoType *curl_info)
 {
     JsonParser *parser;
@@ -122,6 +150,7 @@ int load_config(const char *file_name, WebRTCConfig *config, CurlIinfoType *curl
             config->bitrate_high[i] = json_object_get_int_member(child, "bitrate_high");
             config->bitrate_low[i] = json_object_get_int_member(child, "bitrate_low");
             config->model_config[i] = safe_get_string(child, "model_config");
+            parse_ladder(child, config->ladder[i], &config->ladder_cnt[i]);
 
             glog_trace("parse member %s : %d, %d, %d, %s\n",
                        video_name, config->flip_method[i],
@@ -249,6 +278,92 @@ int load_config(const char *file_name, WebRTCConfig *config, CurlIinfoType *curl
         return FALSE;
     }
 
+    if (json_object_has_member(object, "event_pre_roll_sec"))
+    {
+        int value = json_object_get_int_member(object, "event_pre_roll_sec");
+        glog_trace("parse member %s : %d\n", "event_pre_roll_sec", value);
+        config->event_pre_roll_sec = value;
+    }
+    else
+    {
+        config->event_pre_roll_sec = 0;
+    }
+
+    if (json_object_has_member(object, "event_disk_ring_sec"))
+    {
+        int value = json_object_get_int_member(object, "event_disk_ring_sec");
+        glog_trace("parse member %s : %d\n", "event_disk_ring_sec", value);
+        config->event_disk_ring_sec = value;
+    }
+    else
+    {
+        config->event_disk_ring_sec = 0;
+    }
+
+    if (json_object_has_member(object, "webrtc_inproc"))
+    {
+        int value = json_object_get_int_member(object, "webrtc_inproc");
+        glog_trace("parse member %s : %d\n", "webrtc_inproc", value);
+        config->webrtc_inproc = value;
+    }
+    else
+    {
+        config->webrtc_inproc = 0;
+    }
+
+    if (json_object_has_member(object, "webrtc_warm_pool"))
+    {
+        int value = json_object_get_int_member(object, "webrtc_warm_pool");
+        glog_trace("parse member %s : %d\n", "webrtc_warm_pool", value);
+        config->webrtc_warm_pool = value;
+    }
+    else
+    {
+        config->webrtc_warm_pool = 0;
+    }
+
+    if (json_object_has_member(object, "webrtc_dtls_cert_hours"))
+    {
+        int value = json_object_get_int_member(object, "webrtc_dtls_cert_hours");
+        glog_trace("parse member %s : %d\n", "webrtc_dtls_cert_hours", value);
+        config->webrtc_dtls_cert_hours = value;
+    }
+    else
+    {
+        config->webrtc_dtls_cert_hours = 24;
+    }
+
+    if (json_object_has_member(object, "webrtc_ice_batch_ms"))
+    {
+        int value = json_object_get_int_member(object, "webrtc_ice_batch_ms");
+        glog_trace("parse member %s : %d\n", "webrtc_ice_batch_ms", value);
+        config->webrtc_ice_batch_ms = value;
+    }
+    else
+    {
+        config->webrtc_ice_batch_ms = 20;
+    }
+
+    if (json_object_has_member(object, "webrtc_ice_batch_max"))
+    {
+        int value = json_object_get_int_member(object, "webrtc_ice_batch_max");
+        glog_trace("parse member %s : %d\n", "webrtc_ice_batch_max", value);
+        config->webrtc_ice_batch_max = value;
+    }
+    else
+    {
+        config->webrtc_ice_batch_max = 8;
+    }
+
+    config->pipeline_backend = PIPELINE_BACKEND_NVIDIA;
+    if (json_object_has_member(object, "pipeline_backend"))
+    {
+        const char *value = json_object_get_string_member(object, "pipeline_backend");
+        glog_trace("parse member %s : %s\n", "pipeline_backend", value);
+        if (value && strcmp(value, "software") == 0)
+            config->pipeline_backend = PIPELINE_BACKEND_SOFTWARE;
+    }
+
     if (json_object_has_member(object, "record_enc_index"))
     {
         int value = json_object_get_int_member(object, "record_enc_index");
@@ -4,6 +4,26 @@
 #include "curllib.h"
 #include "log_wrapper.h"
 
+#define MAX_ENC_RUNGS 4
+
+// 파이프라인 요소 구성 ("pipeline_backend")
+typedef enum
+{
+  PIPELINE_BACKEND_NVIDIA = 0,        // nvvideoconvert, nvinfer, nvv4l2h264enc (Jetson)
+  PIPELINE_BACKEND_SOFTWARE,          // videoconvert, x264enc, 가짜 검출 메타 (GPU 없는 PC/CI)
+} PipelineBackend;
+
+// 송출 화질 단계 (0이면 파이프라인 기본값)
+typedef struct
+{
+  int width;
+  int height;
+  int fps;                            // 0이면 입력 프레임 그대로
+  int bitrate;
+  int gop;                            // idrinterval
+  int peak_bitrate;                   // 0이면 bitrate x 2
+} EncoderRung;
+
 typedef struct 
 {
   char* camera_id;
@@ -20,6 +40,8 @@ typedef struct
   int bitrate_high[2];
   int bitrate_low[2];
   char* model_config[2];
+  EncoderRung ladder[2][MAX_ENC_RUNGS]; // 카메라별 "ladder", rung 0은 항상 인코딩 (이벤트/녹화 공용)
+  int ladder_cnt[2];                    // 0이면 bitrate_high/low로 기본 2단계
   
   char* server_ip;
   char* snapshot_path;
@@ -33,6 +55,14 @@ typedef struct
 
   char* http_service_ip;
   int   event_buf_time;
+  int   event_pre_roll_sec;           // 이벤트 이전 구간 (초)
+  int   event_disk_ring_sec;          // 디스크 pre-event ring 길이 (초, 0이면 RAM만 사용)
+  int   webrtc_inproc;                // 1이면 피어마다 webrtc_sender를 띄우지 않고 gstream_main 안에서 webrtcbin 사용
+  int   webrtc_warm_pool;             // 미리 띄워 대기시킬 webrtc_sender 개수 (0이면 접속 시 실행)
+  int   pipeline_backend;             // PipelineBackend
+  int   webrtc_dtls_cert_hours;       // webrtc_sender 공용 DTLS 인증서 교체 주기 (시간, 0이면 sender마다 생성)
+  int   webrtc_ice_batch_ms;          // ICE 후보를 모아 보내는 시간 (ms, 기본 20. 0이면 후보마다 "candidate" 메시지)
+  int   webrtc_ice_batch_max;         // 한 메시지에 담는 최대 후보 수
   int   event_record_enc_index;
   int   http_service_port;            //LJH, 241209
 } WebRTCConfig;
@@ -433,6 +433,27 @@ gboolean load_device_setting(const char *file_name, DeviceSetting* setting)
   } 
 
 
+  // "encoder": [{"cam":0,"rung":1,"bitrate":800000,"peak_bitrate":0,"gop":10,"fps":5}, ...]
+  memset(setting->encoder, 0, sizeof(setting->encoder));
+  if (json_object_has_member (object, "encoder")) {
+    JsonArray *encoder_array = json_object_get_array_member(object, "encoder");
+    for (guint i = 0; i < json_array_get_length(encoder_array); ++i) {
+      JsonObject *item = json_array_get_object_element(encoder_array, i);
+      int cam = json_object_get_int_member(item, "cam");
+      int rung = json_object_get_int_member(item, "rung");
+      if (cam < 0 || cam >= 2 || rung < 0 || rung >= MAX_ENC_RUNGS)
+        continue;
+
+      EncoderRung *enc = &setting->encoder[cam][rung];
+      enc->bitrate = json_object_get_int_member(item, "bitrate");
+      enc->peak_bitrate = json_object_get_int_member(item, "peak_bitrate");
+      enc->gop = json_object_get_int_member(item, "gop");
+      enc->fps = json_object_get_int_member(item, "fps");
+      glog_trace("parse encoder cam %d rung %d : %d bps (peak %d), gop %d, %d fps\n",
+                 cam, rung, enc->bitrate, enc->peak_bitrate, enc->gop, enc->fps);
+    }
+  }
+
   g_object_unref (reader);
   g_object_unref(parser);
 
@@ -485,6 +506,9 @@ static gchar device_setting_template_string_json[] = "{\n\
 \"threshold_upper_temp\": %d,\n\
 \"threshold_under_temp\": %d,\n\
 \"temp_apply\": %d,\n\
+\"encoder\": [\n\
+%s\
+],\n\
 \"show_normal_text\": %d\n\
 }";
 
@@ -541,6 +565,21 @@ gboolean update_setting(const char *file_name, DeviceSetting* setting)
    else 
      strcat(auto_ptz_code,"\"\n");
  }
+
+ char encoder_code[2 * MAX_ENC_RUNGS * 128] = {0};
+ for(int cam = 0 ; cam < 2 ; cam++){
+   for(int r = 0 ; r < MAX_ENC_RUNGS ; r++){
+     EncoderRung *enc = &setting->encoder[cam][r];
+     if (enc->bitrate == 0 && enc->peak_bitrate == 0 && enc->gop == 0 && enc->fps == 0)
+       continue;
+     char item[128];
+     snprintf(item, sizeof(item), "%s{\"cam\": %d, \"rung\": %d, \"bitrate\": %d, \"peak_bitrate\": %d, \"gop\": %d, \"fps\": %d}",
+              encoder_code[0] ? ",\n" : "", cam, r, enc->bitrate, enc->peak_bitrate, enc->gop, enc->fps);
+     strcat(encoder_code, item);
+   }
+ }
+ if (encoder_code[0])
+   strcat(encoder_code, "\n");
    
  //2. update config - 임시 파일에 쓰기
  FILE *fp = fopen(temp_file, "w");
@@ -597,6 +636,7 @@ gboolean update_setting(const char *file_name, DeviceSetting* setting)
    setting->threshold_upper_temp,
    setting->threshold_under_temp,
    setting->temp_apply,
+   encoder_code,
    setting->show_normal_text
  );
 
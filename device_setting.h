@@ -3,6 +3,7 @@
 
 #include "ptz_control.h"
 #include "log_wrapper.h"
+#include "config.h"
 
 typedef struct 
 {
@@ -45,6 +46,9 @@ typedef struct
   int over_temp_time;
   int temp_correction;
   int show_normal_text;
+
+  // set_encoder 명령으로 바꾼 인코더 설정 (0인 항목은 config.json ladder 값 사용)
+  EncoderRung encoder[2][MAX_ENC_RUNGS];
 } DeviceSetting;
 
 gboolean load_device_setting(const char *file_name, DeviceSetting* setting);
@@ -267,6 +267,7 @@ int get_storage_usage()
 }
 
 static gchar *camera_cam_status_template = "{\"rec_status\": \"%s\", \"rec_usage\": %d, \"cpu_temp\": %d, \"gpu_temp\": %d, \
+                                        \"inference\": %s, \
                                         \"rgb_snaphot\": \"%s\", \"thermal_snaphot\": \"%s\" }";
 void send_camera_info_to_server()
 {
@@ -293,8 +294,10 @@ void send_camera_info_to_server()
     }
 
     gchar *msg;
+    gchar *inference = inference_bypass_to_json();
     msg = g_strdup_printf(camera_cam_status_template, g_setting.record_status ? "On" : "Off", get_storage_usage(),
-                          get_temp(0), get_temp(1), RGB_base64_data, Thermal_base64_data);
+                          get_temp(0), get_temp(1), inference, RGB_base64_data, Thermal_base64_data);
+    g_free(inference);
 
     send_json_info("camstatus", msg);
     g_wait_reply_cnt = g_wait_reply_cnt + 1;
@@ -863,6 +866,50 @@ gboolean process_message_cmd(gJSONObj *jsonObj)
         set_camera_dn_mode(g_setting.camera_dn_mode);
         update_setting(g_config.device_setting_path, &g_setting);
     }
+    else if (json_object_has_member(object, "set_encoder"))
+    {
+        // {"set_encoder": {"cam":0, "rung":1, "bitrate":800000, "peak_bitrate":0, "gop":10, "fps":5}}
+        // 없는 항목(0)은 그대로 둔다
+        glog_trace("set_encoder\n");
+        JsonObject *enc = json_object_get_object_member(object, "set_encoder");
+        if (!enc || !json_object_has_member(enc, "cam") || !json_object_has_member(enc, "rung"))
+        {
+            glog_trace("Can not get cam/rung in set_encoder\n");
+            return FALSE;
+        }
+
+        int cam = json_object_get_int_member(enc, "cam");
+        int rung = json_object_get_int_member(enc, "rung");
+        if (cam < 0 || cam >= NUM_CAMS || rung < 0 || rung >= get_encoder_rung_cnt(cam))
+        {
+            glog_trace("Invalied encoder cam %d rung %d\n", cam, rung);
+            return FALSE;
+        }
+
+        EncoderRung change = {0,};
+        if (json_object_has_member(enc, "bitrate"))
+            change.bitrate = json_object_get_int_member(enc, "bitrate");
+        if (json_object_has_member(enc, "peak_bitrate"))
+            change.peak_bitrate = json_object_get_int_member(enc, "peak_bitrate");
+        if (json_object_has_member(enc, "gop"))
+            change.gop = json_object_get_int_member(enc, "gop");
+        if (json_object_has_member(enc, "fps"))
+            change.fps = json_object_get_int_member(enc, "fps");
+
+        set_encoder_live(cam, rung, &change);
+
+        // 재시작 후에도 유지
+        EncoderRung *saved = &g_setting.encoder[cam][rung];
+        if (change.bitrate > 0)
+            saved->bitrate = change.bitrate;
+        if (change.peak_bitrate > 0)
+            saved->peak_bitrate = change.peak_bitrate;
+        if (change.gop > 0)
+            saved->gop = change.gop;
+        if (change.fps > 0)
+            saved->fps = change.fps;
+        update_setting(g_config.device_setting_path, &g_setting);
+    }
 
 #if MINDULE_INCLUDE
 
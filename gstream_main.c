@@ -8,6 +8,7 @@
  */
 #include <gst/gst.h>
 #include <gst/sdp/sdp.h>
+#include <gst/rtp/gstrtpbuffer.h>
 #define GST_USE_UNSTABLE_API
 #include <gst/webrtc/webrtc.h>
 
@@ -50,6 +51,8 @@ pthread_mutex_t g_retry_connect_mutex;
 
 WebRTCConfig g_config;
 GstElement *g_pipeline;
+static GList *g_egress_branches = NULL; // 피어별 송출 브랜치 (메인 루프에서만 접근)
+static const gchar *g_udp_host = "127.0.0.1";
 CurlIinfoType g_curlinfo;
 DeviceSetting g_setting;
 static gchar *g_config_name = NULL;
@@ -467,6 +470,371 @@ void cleanupSocketFile(const char* socket_path) {
     }
 }
 
+#define KEY_UNIT_MIN_INTERVAL_MS 500                        // 인코더별 IDR 요청 최소 간격
+#define GOP_CACHE_MAX_BYTES      (2 * 1024 * 1024)          // 이보다 긴 GOP는 캐시하지 않고 IDR 요청으로 대신
+
+static gint g_enc_rung_cnt[NUM_CAMS];                      // 카메라별 화질 단계 수
+static gint g_enc_subscribers[NUM_CAMS][MAX_ENC_RUNGS];     // 인코더 tee별 송출 브랜치 수
+
+// 인코더 registry: 화질 단계별 요소 핸들 (start_pipeline에서 채우고 set_encoder 명령이 바로 사용)
+typedef struct {
+    EncoderRung rung;               // 현재 적용된 값
+    gint build_gop;                 // 파이프라인을 만들 때의 gop (인코더 자체 IDR 주기)
+    gint forced_gop;                // 인코더가 실행 중 gop 변경을 못하면 probe로 IDR 요청 (0이면 사용 안 함)
+    gint frames;                    // 마지막 IDR 이후 프레임 수
+    gboolean key_unit_pending;
+    gint64 last_key_unit;           // 마지막 IDR 요청 시각 (us)
+    guint key_unit_timer;           // 최소 간격 안에 들어온 요청을 모아 한 번에 보낼 타이머
+    gint key_unit_coalesced;        // 타이머가 도는 동안 합쳐진 요청 수
+    GstElement *enc;                // video_enc{n}_{cam}
+    GstElement *rate_caps;          // video_enc_rate{n}_{cam}, framerate capsfilter
+    GstElement *valve;              // video_enc_valve{n}_{cam}, rung 1~ 만
+} EncoderHandle;
+
+static EncoderHandle g_encoders[NUM_CAMS][MAX_ENC_RUNGS];
+
+// 인코더 tee별 최근 GOP의 RTP 패킷 (SPS/PPS + IDR + 이후 P 프레임).
+// 새 피어는 DTLS가 끝나면 이 패킷을 먼저 받고 같은 시퀀스로 이어지는 live 패킷으로 넘어간다
+typedef struct {
+    GMutex lock;
+    GPtrArray *packets;             // GstBuffer 참조 (복사 없음)
+    gsize bytes;
+    guint32 au_ts;                  // 마지막 패킷의 RTP timestamp
+    guint au_start;                 // packets 내 현재 접근 단위의 첫 패킷
+    gboolean valid;                 // IDR부터 끊김 없이 모였는지
+    EncoderHandle *handle;
+} GopCache;
+
+static GopCache g_gop_cache[NUM_CAMS][MAX_ENC_RUNGS];
+static GMutex g_key_unit_lock;     // 피어 요청은 소켓/스트리밍 스레드에서도 들어온다
+
+// config.json의 "ladder"로 기본 화질 단계를 덮어쓴다 (0인 항목은 기본값 유지)
+// ladder가 없으면 기존 bitrate_high/low만 반영
+static void apply_ladder_config(PipelineConfig *config)
+{
+    for (gint cam = 0; cam < NUM_CAMS; cam++) {
+        EncoderRung *ladder = config->ladder[cam];
+
+        if (g_config.ladder_cnt[cam] > 0) {
+            for (gint r = 0; r < g_config.ladder_cnt[cam]; r++) {
+                const EncoderRung *src = &g_config.ladder[cam][r];
+                EncoderRung rung = ladder[MIN(r, config->ladder_cnt[cam] - 1)];
+                if (src->width > 0 && src->height > 0) {
+                    rung.width = src->width;
+                    rung.height = src->height;
+                }
+                rung.fps = src->fps;
+                if (src->bitrate > 0)
+                    rung.bitrate = src->bitrate;
+                if (src->gop > 0)
+                    rung.gop = src->gop;
+                if (src->peak_bitrate > 0)
+                    rung.peak_bitrate = src->peak_bitrate;
+                ladder[r] = rung;
+            }
+            config->ladder_cnt[cam] = g_config.ladder_cnt[cam];
+        } else {
+            if (g_config.bitrate_high[cam] > 0)
+                ladder[0].bitrate = g_config.bitrate_high[cam];
+            if (g_config.bitrate_low[cam] > 0)
+                ladder[1].bitrate = g_config.bitrate_low[cam];
+        }
+
+        // set_encoder로 저장해 둔 값이 우선
+        for (gint r = 0; r < config->ladder_cnt[cam]; r++) {
+            const EncoderRung *saved = &g_setting.encoder[cam][r];
+            if (saved->bitrate > 0)
+                ladder[r].bitrate = saved->bitrate;
+            if (saved->peak_bitrate > 0)
+                ladder[r].peak_bitrate = saved->peak_bitrate;
+            if (saved->gop > 0)
+                ladder[r].gop = saved->gop;
+            if (saved->fps > 0)
+                ladder[r].fps = saved->fps;
+        }
+        g_enc_rung_cnt[cam] = config->ladder_cnt[cam];
+    }
+}
+
+gint get_encoder_rung_cnt(gint cam)
+{
+    return (cam >= 0 && cam < NUM_CAMS) ? g_enc_rung_cnt[cam] : 0;
+}
+
+// 인코더 IDR 요청 (valve를 다시 연 뒤, 화질 전환, gop 유지)
+static void request_key_unit(EncoderHandle *handle)
+{
+    if (!handle->enc)
+        return;
+    GstPad *pad = gst_element_get_static_pad(handle->enc, "src");
+    gst_pad_send_event(pad, gst_event_new_custom(GST_EVENT_CUSTOM_UPSTREAM,
+                       gst_structure_new("GstForceKeyUnit", "all-headers", G_TYPE_BOOLEAN, TRUE, NULL)));
+    gst_object_unref(pad);
+}
+
+static gboolean on_key_unit_timer(gpointer user_data)
+{
+    EncoderHandle *handle = (EncoderHandle *)user_data;
+
+    g_mutex_lock(&g_key_unit_lock);
+    handle->key_unit_timer = 0;
+    handle->last_key_unit = g_get_monotonic_time();
+    glog_trace("%s IDR request (%d coalesced)\n", GST_ELEMENT_NAME(handle->enc), handle->key_unit_coalesced);
+    handle->key_unit_coalesced = 0;
+    request_key_unit(handle);
+    g_mutex_unlock(&g_key_unit_lock);
+    return G_SOURCE_REMOVE;
+}
+
+// 피어 접속, PLI/FIR, 화질 전환, valve 열기로 들어오는 IDR 요청을 인코더별로 합친다.
+// KEY_UNIT_MIN_INTERVAL_MS 안에 다시 들어온 요청은 간격이 끝날 때 한 번만 보낸다
+static void request_key_unit_limited(EncoderHandle *handle)
+{
+    if (!handle->enc)
+        return;
+
+    g_mutex_lock(&g_key_unit_lock);
+    gint64 now = g_get_monotonic_time();
+    gint64 wait_ms = (handle->last_key_unit + KEY_UNIT_MIN_INTERVAL_MS * 1000 - now) / 1000;
+    if (handle->key_unit_timer) {
+        handle->key_unit_coalesced++;
+    } else if (wait_ms <= 0) {
+        handle->last_key_unit = now;
+        request_key_unit(handle);
+    } else {
+        handle->key_unit_coalesced = 1;
+        handle->key_unit_timer = g_timeout_add(wait_ms, on_key_unit_timer, handle);
+    }
+    g_mutex_unlock(&g_key_unit_lock);
+}
+
+// 인코더 출력 프레임을 세다가 forced_gop마다 IDR을 요청한다 (gop을 실행 중에 줄였을 때)
+static GstPadProbeReturn encoder_gop_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+    EncoderHandle *handle = (EncoderHandle *)user_data;
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+
+    if (!GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT)) {
+        handle->frames = 0;
+        handle->key_unit_pending = FALSE;
+        return GST_PAD_PROBE_OK;
+    }
+    handle->frames++;
+    if (handle->forced_gop > 0 && handle->frames >= handle->forced_gop - 1 && !handle->key_unit_pending) {
+        handle->key_unit_pending = TRUE;
+        request_key_unit(handle);
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+static void clear_gop_cache(GopCache *cache)
+{
+    if (cache->packets)
+        g_ptr_array_set_size(cache->packets, 0);
+    cache->bytes = 0;
+    cache->au_start = 0;
+    cache->valid = FALSE;
+}
+
+// H.264 RTP 패킷(RFC 6184)이 IDR 슬라이스의 시작인지 본다 (단일 NAL, STAP-A, FU-A 시작)
+static gboolean rtp_starts_idr(const guint8 *payload, guint len)
+{
+    if (len < 2)
+        return FALSE;
+    guint8 nal = payload[0] & 0x1f;
+    if (nal == 5)
+        return TRUE;
+    if (nal == 28)
+        return (payload[1] & 0x80) && (payload[1] & 0x1f) == 5;
+    if (nal == 24) {
+        for (guint pos = 1; pos + 2 < len;) {
+            guint size = (payload[pos] << 8) | payload[pos + 1];
+            if ((payload[pos + 2] & 0x1f) == 5)
+                return TRUE;
+            pos += 2 + size;
+        }
+    }
+    return FALSE;
+}
+
+// tee 입력에서 GOP를 모은다. IDR이 오면 그 접근 단위(같은 timestamp의 SPS/PPS 포함)부터 새로 시작
+static gboolean gop_cache_add(GstBuffer **buffer, guint idx, gpointer user_data)
+{
+    GopCache *cache = (GopCache *)user_data;
+    GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+
+    if (!gst_rtp_buffer_map(*buffer, GST_MAP_READ, &rtp))
+        return TRUE;
+    guint32 ts = gst_rtp_buffer_get_timestamp(&rtp);
+    gboolean idr = rtp_starts_idr(gst_rtp_buffer_get_payload(&rtp), gst_rtp_buffer_get_payload_len(&rtp));
+    gst_rtp_buffer_unmap(&rtp);
+
+    if (cache->packets->len == 0 || ts != cache->au_ts) {
+        // IDR 전에는 현재 접근 단위(SPS/PPS일 수 있음)만 잡아 둔다
+        if (!cache->valid)
+            clear_gop_cache(cache);
+        cache->au_ts = ts;
+        cache->au_start = cache->packets->len;
+    }
+    if (idr) {
+        for (guint i = 0; i < cache->au_start; i++)
+            cache->bytes -= gst_buffer_get_size(g_ptr_array_index(cache->packets, i));
+        g_ptr_array_remove_range(cache->packets, 0, cache->au_start);
+        cache->au_start = 0;
+        cache->valid = TRUE;
+    }
+    g_ptr_array_add(cache->packets, gst_buffer_ref(*buffer));
+    cache->bytes += gst_buffer_get_size(*buffer);
+    if (cache->bytes > GOP_CACHE_MAX_BYTES)
+        clear_gop_cache(cache);
+    return TRUE;
+}
+
+// rtph264pay는 FU-A 조각을 buffer list로 내보내므로 둘 다 받는다
+static GstPadProbeReturn gop_cache_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+    GopCache *cache = (GopCache *)user_data;
+
+    g_mutex_lock(&cache->lock);
+    if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+        gst_buffer_list_foreach(GST_PAD_PROBE_INFO_BUFFER_LIST(info), gop_cache_add, cache);
+    } else {
+        GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+        gop_cache_add(&buffer, 0, cache);
+    }
+    g_mutex_unlock(&cache->lock);
+    return GST_PAD_PROBE_OK;
+}
+
+// 피어 브랜치로 가는 다음 live 패킷 직전에 캐시된 GOP를 먼저 밀어 넣는다.
+// live 패킷은 이미 캐시 끝에 들어 있으므로 그 앞까지만 보내면 시퀀스가 이어진다
+static GstPadProbeReturn fast_start_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+    GopCache *cache = (GopCache *)user_data;
+    GstBuffer *live;
+    guint live_cnt = 1;
+    GPtrArray *burst = NULL;
+    gsize bytes = 0;
+
+    if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+        GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+        live_cnt = gst_buffer_list_length(list);
+        if (live_cnt == 0)
+            return GST_PAD_PROBE_OK;
+        live = gst_buffer_list_get(list, live_cnt - 1);
+    } else {
+        live = GST_PAD_PROBE_INFO_BUFFER(info);
+    }
+
+    g_mutex_lock(&cache->lock);
+    guint len = cache->packets->len;
+    if (cache->valid && len >= live_cnt && g_ptr_array_index(cache->packets, len - 1) == live) {
+        burst = g_ptr_array_new();
+        for (guint i = 0; i < len - live_cnt; i++) {
+            GstBuffer *buffer = g_ptr_array_index(cache->packets, i);
+            g_ptr_array_add(burst, gst_buffer_ref(buffer));
+            bytes += gst_buffer_get_size(buffer);
+        }
+    }
+    g_mutex_unlock(&cache->lock);
+
+    GstPad *peer = gst_pad_get_peer(pad);
+    if (!burst || !peer) {
+        glog_trace("fast start %s: no gop cached, request IDR\n", GST_PAD_NAME(pad));
+        request_key_unit_limited(cache->handle);
+    } else {
+        for (guint i = 0; i < burst->len; i++)
+            gst_pad_chain(peer, g_ptr_array_index(burst, i));
+        glog_trace("fast start %s: %u packets %lu bytes from gop cache\n", GST_PAD_NAME(pad), burst->len, bytes);
+    }
+    if (burst)
+        g_ptr_array_free(burst, TRUE);
+    if (peer)
+        gst_object_unref(peer);
+    return GST_PAD_PROBE_REMOVE;
+}
+
+// 인코더 tee 요청 패드에 붙은 피어 브랜치를 GOP 캐시로 먼저 채운다 (캐시가 없으면 IDR 요청)
+void fast_start_branch(GstPad *tee_pad)
+{
+    GstElement *tee = gst_pad_get_parent_element(tee_pad);
+    gint tee_no, cam;
+
+    if (!tee)
+        return;
+    if (sscanf(GST_ELEMENT_NAME(tee), "video_enc_tee%d_%d", &tee_no, &cam) == 2 &&
+        tee_no >= 1 && tee_no <= MAX_ENC_RUNGS && cam >= 0 && cam < NUM_CAMS &&
+        g_gop_cache[cam][tee_no - 1].packets) {
+        gst_pad_add_probe(tee_pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST, fast_start_probe, &g_gop_cache[cam][tee_no - 1], NULL);
+    }
+    gst_object_unref(tee);
+}
+
+static void register_encoders(PipelineConfig *config)
+{
+    for (gint cam = 0; cam < NUM_CAMS; cam++) {
+        for (gint r = 0; r < config->ladder_cnt[cam]; r++) {
+            EncoderHandle *handle = &g_encoders[cam][r];
+            gchar name[32];
+
+            memset(handle, 0, sizeof(EncoderHandle));
+            handle->rung = config->ladder[cam][r];
+            handle->build_gop = handle->rung.gop;
+
+            snprintf(name, sizeof(name), "video_enc%d_%d", r + 1, cam);
+            handle->enc = gst_bin_get_by_name(GST_BIN(g_pipeline), name);
+            snprintf(name, sizeof(name), "video_enc_rate%d_%d", r + 1, cam);
+            handle->rate_caps = gst_bin_get_by_name(GST_BIN(g_pipeline), name);
+            if (r > 0) {
+                snprintf(name, sizeof(name), "video_enc_valve%d_%d", r + 1, cam);
+                handle->valve = gst_bin_get_by_name(GST_BIN(g_pipeline), name);
+            }
+
+            if (!handle->enc) {
+                glog_error("encoder cam %d rung %d not found\n", cam, r);
+                continue;
+            }
+            GstPad *pad = gst_element_get_static_pad(handle->enc, "src");
+            gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, encoder_gop_probe, handle, NULL);
+            gst_object_unref(pad);
+
+            GopCache *cache = &g_gop_cache[cam][r];
+            snprintf(name, sizeof(name), "video_enc_tee%d_%d", r + 1, cam);
+            GstElement *tee = gst_bin_get_by_name(GST_BIN(g_pipeline), name);
+            if (tee) {
+                if (!cache->packets)
+                    cache->packets = g_ptr_array_new_with_free_func((GDestroyNotify)gst_buffer_unref);
+                clear_gop_cache(cache);
+                cache->handle = handle;
+                pad = gst_element_get_static_pad(tee, "sink");
+                gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST, gop_cache_probe, cache, NULL);
+                gst_object_unref(pad);
+                gst_object_unref(tee);
+            }
+        }
+    }
+}
+
+static void release_encoders(void)
+{
+    for (gint cam = 0; cam < NUM_CAMS; cam++) {
+        for (gint r = 0; r < MAX_ENC_RUNGS; r++) {
+            g_mutex_lock(&g_key_unit_lock);
+            if (g_encoders[cam][r].key_unit_timer) {
+                g_source_remove(g_encoders[cam][r].key_unit_timer);
+                g_encoders[cam][r].key_unit_timer = 0;
+            }
+            g_mutex_unlock(&g_key_unit_lock);
+            g_mutex_lock(&g_gop_cache[cam][r].lock);
+            clear_gop_cache(&g_gop_cache[cam][r]);
+            g_mutex_unlock(&g_gop_cache[cam][r].lock);
+            g_clear_object(&g_encoders[cam][r].enc);
+            g_clear_object(&g_encoders[cam][r].rate_caps);
+            g_clear_object(&g_encoders[cam][r].valve);
+        }
+    }
+}
+
 static gboolean start_pipeline(void)
 {
     GstStateChangeReturn ret;
@@ -476,12 +844,11 @@ static gboolean start_pipeline(void)
     gchar *pipeline_string;
 
     config = get_default_config();
+    g_udp_host = config->udp_host;
     config->rgb_flip_method = g_config.flip_method[RGB_CAM];
 
-    config->bitrate_high_rgb = g_config.bitrate_high[RGB_CAM];
-    config->bitrate_low_rgb = g_config.bitrate_low[RGB_CAM];
-    config->bitrate_high_thermal = g_config.bitrate_high[THERMAL_CAM];
-    config->bitrate_low_thermal = g_config.bitrate_low[THERMAL_CAM];
+    apply_ladder_config(config);
+    config->backend = g_config.pipeline_backend;
     config->model_config_rgb = g_config.model_config[RGB_CAM];
     config->model_config_thermal = g_config.model_config[THERMAL_CAM];
 
@@ -499,6 +866,8 @@ static gboolean start_pipeline(void)
         goto err;
     }
 
+    register_encoders(config);
+
     // setup OSD  and event detection.
     setup_nv_analysis();
 
@@ -536,6 +905,7 @@ static gboolean start_pipeline(void)
 
 err:
     glog_critical("State change failure\n");
+    release_encoders();
     if (g_pipeline)
         g_clear_object(&g_pipeline);
     return FALSE;
@@ -748,7 +1118,7 @@ static void on_server_message(SoupWebsocketConnection *conn, SoupWebsocketDataTy
         handle_peer_message(peer_id, msg);
         g_free(msg);
     }
-    else if (g_strcmp0(action, "candidate") == 0)
+    else if (g_strcmp0(action, "candidate") == 0 || g_strcmp0(action, "candidates") == 0)
     {
         const gchar *peer_id;
         get_json_data_from_message(jsonObj, "peer_id", &peer_id);
@@ -1408,6 +1778,7 @@ int main(int argc, char *argv[])
     if (g_config.status_timer_interval > 0)
         kill_heartbit();
 
+    release_encoders();
     gst_object_unref(g_pipeline);
     free_config(&g_config);
 
@@ -1451,10 +1822,12 @@ PipelineConfig* get_default_config() {
     config->snapshot_path_rgb = "/home/nvidia/webrtc/cam0_snapshot.jpg";
     config->snapshot_path_thermal = "/home/nvidia/webrtc/cam1_snapshot.jpg";
     
-    config->bitrate_high_rgb = 2000000;
-    config->bitrate_low_rgb = 1000000;
-    config->bitrate_high_thermal = 4000000;
-    config->bitrate_low_thermal = 24000;
+    config->ladder[RGB_CAM][0] = (EncoderRung){ 1920, 1080, 0, 2000000, 5 };
+    config->ladder[RGB_CAM][1] = (EncoderRung){ 1280, 720, 5, 1000000, 5 };
+    config->ladder_cnt[RGB_CAM] = 2;
+    config->ladder[THERMAL_CAM][0] = (EncoderRung){ 384, 288, 0, 4000000, 5 };
+    config->ladder[THERMAL_CAM][1] = (EncoderRung){ 384, 288, 5, 24000, 5 };
+    config->ladder_cnt[THERMAL_CAM] = 2;
     
     config->model_config_rgb = "RGB_yoloV7.txt";
     config->model_config_thermal = "Thermal_yoloV7.txt";
@@ -1465,7 +1838,22 @@ PipelineConfig* get_default_config() {
     return config;
 }
 
+// 빌더들이 쓸 요소 구성 (build_complete_pipeline에서 설정)
+static PipelineBackend g_backend = PIPELINE_BACKEND_NVIDIA;
+
 gchar* build_udp_source(gint port, gint flip_method, gint width, gint height) {
+    if (g_backend == PIPELINE_BACKEND_SOFTWARE) {
+        // nvvideoconvert flip-method -> videoflip method (회전 방향과 대각선 번호가 다르다)
+        static const gint flip_map[8] = { 0, 3, 2, 1, 4, 7, 5, 6 };
+        return g_strdup_printf(
+            "udpsrc port=%d ! "
+            "application/x-rtp,media=video,clock-rate=90000,encoding-name=RAW,sampling=YCbCr-4:2:0,width=(string)%d,height=(string)%d,depth=(string)8 ! "
+            "rtpvrawdepay ! "
+            "videoconvert ! videoflip method=%d ! video/x-raw,format=NV12 ! "
+            "queue max-size-buffers=5 leaky=downstream",
+            port, width, height, flip_map[flip_method & 7]
+        );
+    }
     return g_strdup_printf(
         "udpsrc port=%d ! "
         "application/x-rtp,media=video,clock-rate=90000,encoding-name=RAW,sampling=YCbCr-4:2:0,width=(string)%d,height=(string)%d,depth=(string)8 ! "
@@ -1489,93 +1877,481 @@ gchar* build_inference_branch(const gchar *tee_name, const gchar *mux_name,
                              gint width, gint height, const gchar *config_file,
                              const gchar *nvinfer_name, const gchar *postproc_name,
                              const gchar *osd_name) {
+    if (g_backend == PIPELINE_BACKEND_SOFTWARE) {
+        // 추론 없이 통과, nvinfer 자리의 identity에 setup_nv_analysis()가 가짜 검출 메타를 붙인다
+        return g_strdup_printf(
+            "%s. ! queue ! videoscale ! videoconvert ! "
+            "video/x-raw,format=RGBA,width=%d,height=%d ! "
+            "identity name=%s ! identity name=%s ! identity name=%s",
+            tee_name, width, height, nvinfer_name, postproc_name, osd_name
+        );
+    }
+    // nvstreammux 뒤 output-selector: src_0은 nvinfer ! nvof, src_1은 바로 OSD로 (분석 off, PTZ 이동 중)
+    // 배치 메타는 nvstreammux가 붙이므로 bypass 중에도 OSD 프로브는 그대로 동작한다
     return g_strdup_printf(
         "%s. ! queue ! nvvideoconvert ! "
         "video/x-raw(memory:NVMM),format=NV12,width=%d,height=%d ! %s.sink_0 "
         "nvstreammux name=%s batch-size=1 width=%d height=%d "
         "live-source=1 batched-push-timeout=4000000 ! "
-        "nvinfer config-file-path=%s name=%s ! "
-        "nvof ! nvvideoconvert ! "
+        "output-selector name=%s_sel "
+        "%s_sel.src_0 ! nvinfer config-file-path=%s name=%s ! nvof ! %s_join. "
+        "%s_sel.src_1 ! %s_join. "
+        "funnel name=%s_join ! nvvideoconvert ! "
         "dspostproc name=%s ! "
         "nvdsosd name=%s display-clock=0",
         tee_name, width, height, mux_name,
         mux_name, width, height,
-        config_file, nvinfer_name,
+        nvinfer_name,
+        nvinfer_name, config_file, nvinfer_name, nvinfer_name,
+        nvinfer_name, nvinfer_name,
+        nvinfer_name,
         postproc_name, osd_name
     );
 }
 
-gchar* build_encoder_branch(gint output_width, gint output_height, 
-                           gint bitrate, const gchar *parse_name,
-                           const gchar *tee_name) {
-    return g_strdup_printf(
-        "nvvideoconvert ! video/x-raw(memory:NVMM),format=NV12,width=%d,height=%d ! "
-        "nvv4l2h264enc bitrate=4000000 peak-bitrate=8000000 control-rate=1 preset-level=FastPreset idrinterval=5 ! "
+// videorate + 이름 있는 capsfilter (caps: 입력 메모리 종류)
+// fps가 0이어도 두어서 set_encoder가 실행 중에 framerate caps만 바꿔 재협상할 수 있게 한다
+static gchar* build_rate_filter(gint fps, const gchar *caps, const gchar *rate_name) {
+    if (fps <= 0) {
+        return g_strdup_printf("videorate drop-only=true ! capsfilter name=%s caps=\"%s\" ! ", rate_name, caps);
+    }
+    return g_strdup_printf("videorate drop-only=true ! capsfilter name=%s caps=\"%s,framerate=%d/1\" ! ",
+                           rate_name, caps, fps);
+}
+
+static gchar* build_h264_encoder(const EncoderRung *rung, const gchar *enc_name,
+                                 const gchar *parse_name, const gchar *tee_name) {
+    gchar *parse_attr = parse_name ? g_strdup_printf(" name=%s", parse_name) : g_strdup("");
+    gchar *enc;
+    if (g_backend == PIPELINE_BACKEND_SOFTWARE) {
+        // x264enc bitrate는 kbps
+        enc = g_strdup_printf(
+            "videoconvert ! videoscale ! video/x-raw,format=I420,width=%d,height=%d ! "
+            "x264enc name=%s bitrate=%d vbv-buf-capacity=1000 tune=zerolatency speed-preset=ultrafast key-int-max=%d",
+            rung->width, rung->height, enc_name, MAX(rung->bitrate / 1000, 1), rung->gop
+        );
+    } else {
+        enc = g_strdup_printf(
+            "nvvideoconvert ! video/x-raw(memory:NVMM),format=NV12,width=%d,height=%d ! "
+            "nvv4l2h264enc name=%s bitrate=%d peak-bitrate=%d control-rate=1 preset-level=FastPreset idrinterval=%d",
+            rung->width, rung->height, enc_name, rung->bitrate,
+            rung->peak_bitrate > 0 ? rung->peak_bitrate : rung->bitrate * 2, rung->gop
+        );
+    }
+    gchar *branch = g_strdup_printf(
+        "%s ! "
         "video/x-h264,stream-format=byte-stream ! "
-        "h264parse config-interval=-1 name=%s ! "
+        "h264parse config-interval=-1%s ! "
         "video/x-h264,stream-format=byte-stream,alignment=au ! "
         "rtph264pay pt=96 config-interval=1 ! "
-        "queue max-size-buffers=5 ! tee name=%s",
-        output_width, output_height, parse_name, tee_name
+        "queue max-size-buffers=5 ! tee name=%s allow-not-linked=true",
+        enc, parse_attr, tee_name
     );
+    g_free(enc);
+    g_free(parse_attr);
+    return branch;
 }
 
-gchar* build_low_res_branch(const gchar *tee_name, gint framerate, 
-                           gint width, gint height, gint bitrate,
-                           const gchar *enc_tee_name) {
-    // return g_strdup_printf(
-    //     "%s. ! queue ! videorate ! video/x-raw,framerate=%d/1 ! "
-    //     "videoscale ! video/x-raw,width=%d,height=%d ! "
-    //     "nvvideoconvert ! "
-    //     "nvv4l2h264enc preset-level=FastPreset idrinterval=5 bitrate=%d ! "
-    //     "rtph264pay pt=96 config-interval=1 ! "
-    //     "queue ! tee name=%s",
-    //     tee_name, framerate, width, height, bitrate, enc_tee_name
-    // );
-    return g_strdup_printf(
-        "%s. ! queue ! nvvideoconvert ! video/x-raw(memory:NVMM),format=NV12,width=%d,height=%d ! "
-        "nvv4l2h264enc bitrate=4000000 peak-bitrate=8000000 control-rate=1 preset-level=FastPreset ! "
-        "video/x-h264,stream-format=byte-stream ! "
-        "h264parse config-interval=-1 ! "
-        "video/x-h264,stream-format=byte-stream,alignment=au ! "
-        "rtph264pay pt=96 config-interval=1 ! "
-        "queue max-size-buffers=5 ! tee name=%s",
-        tee_name, width, height, enc_tee_name
+// rung 0: 추론/OSD 출력을 인코딩 (이벤트 버퍼가 h264parse_N에 붙어 있어 항상 동작)
+gchar* build_encoder_branch(const EncoderRung *rung, const gchar *rate_name, const gchar *enc_name,
+                           const gchar *parse_name, const gchar *tee_name) {
+    gchar *rate = build_rate_filter(rung->fps, g_backend == PIPELINE_BACKEND_SOFTWARE ?
+                                    "video/x-raw" : "video/x-raw(memory:NVMM)", rate_name);
+    gchar *enc = build_h264_encoder(rung, enc_name, parse_name, tee_name);
+    gchar *branch = g_strconcat(rate, enc, NULL);
+    g_free(rate);
+    g_free(enc);
+    return branch;
+}
+
+// rung 1 이상: 입력 tee에서 갈라진다. 보는 피어가 없으면 valve가 닫혀 변환/인코딩을 하지 않는다
+gchar* build_low_res_branch(const gchar *tee_name, const EncoderRung *rung,
+                           const gchar *valve_name, const gchar *rate_name,
+                           const gchar *enc_name, const gchar *enc_tee_name) {
+    gchar *rate = build_rate_filter(rung->fps, "video/x-raw", rate_name);
+    gchar *enc = build_h264_encoder(rung, enc_name, NULL, enc_tee_name);
+    gchar *branch = g_strdup_printf(
+        "%s. ! queue max-size-buffers=2 leaky=downstream ! valve name=%s drop=true ! %s%s",
+        tee_name, valve_name, rate, enc
     );
+    g_free(rate);
+    g_free(enc);
+    return branch;
 }
 
-gchar* build_udp_sinks(PipelineConfig *config) {
-    GString *sinks = g_string_new("");
-    
-    // 고해상도 스트림
-    for (int i = 0; i < config->num_streams; i++) {
-        g_string_append_printf(sinks,
-            "video_enc_tee1_0. ! queue ! udpsink host=%s port=%d sync=false async=false ",
-            config->udp_host, config->base_port_high + i * 2);
-        
-        g_string_append_printf(sinks,
-            "video_enc_tee1_1. ! queue ! udpsink host=%s port=%d sync=false async=false ",
-            config->udp_host, config->base_port_high + i * 2 + 1);
+static void append_low_res_ladder(GString *pipeline, PipelineConfig *config, gint cam, const gchar *src_tee) {
+    for (gint r = 1; r < config->ladder_cnt[cam]; r++) {
+        gchar valve_name[32], rate_name[32], enc_name[32], tee_name[32];
+        snprintf(valve_name, sizeof(valve_name), "video_enc_valve%d_%d", r + 1, cam);
+        snprintf(rate_name, sizeof(rate_name), "video_enc_rate%d_%d", r + 1, cam);
+        snprintf(enc_name, sizeof(enc_name), "video_enc%d_%d", r + 1, cam);
+        snprintf(tee_name, sizeof(tee_name), "video_enc_tee%d_%d", r + 1, cam);
+
+        gchar *temp = build_low_res_branch(src_tee, &config->ladder[cam][r], valve_name, rate_name,
+                                           enc_name, tee_name);
+        g_string_append_printf(pipeline, "%s ", temp);
+        g_free(temp);
     }
-    
-    // 저해상도 스트림
-    for (int i = 0; i < config->num_streams; i++) {
-        g_string_append_printf(sinks,
-            "video_enc_tee2_0. ! queue ! udpsink host=%s port=%d sync=false async=false ",
-            config->udp_host, config->base_port_low + i * 2);
-        
-        g_string_append_printf(sinks,
-            "video_enc_tee2_1. ! queue ! udpsink host=%s port=%d sync=false async=false ",
-            config->udp_host, config->base_port_low + i * 2 + 1);
+}
+
+// 인코더 tee에 송출 브랜치가 붙거나 떨어질 때 호출 (메인 루프)
+// 첫 구독자가 생기면 valve를 열고, 마지막 구독자가 떠나면 닫는다
+static void update_encoder_subscribers(const gchar *tee_name, gint delta) {
+    gint tee_no, cam;
+    if (sscanf(tee_name, "video_enc_tee%d_%d", &tee_no, &cam) != 2 ||
+        tee_no < 1 || tee_no > MAX_ENC_RUNGS || cam < 0 || cam >= NUM_CAMS) {
+        return;
+    }
+
+    gint *count = &g_enc_subscribers[cam][tee_no - 1];
+    *count = MAX(*count + delta, 0);
+    if (tee_no == 1) {
+        return;
+    }
+
+    EncoderHandle *handle = &g_encoders[cam][tee_no - 1];
+    GstElement *valve = handle->valve;
+    if (!valve) {
+        return;
+    }
+
+    gboolean drop;
+    gboolean open = *count > 0;
+    g_object_get(valve, "drop", &drop, NULL);
+    if (drop == open) {
+        g_object_set(valve, "drop", !open, NULL);
+        glog_trace("encoder %s %s (subscribers %d)\n", tee_name, open ? "opened" : "closed", *count);
+        if (open) {
+            request_key_unit_limited(handle);
+        }
+    }
+}
+
+// 인코더 tee 이름으로 IDR 요청 (피어 접속, PLI/FIR, sender 화질 전환). 아무 스레드에서나 호출 가능
+void request_encoder_key_unit(const gchar *tee_name) {
+    gint tee_no, cam;
+    if (sscanf(tee_name, "video_enc_tee%d_%d", &tee_no, &cam) != 2 ||
+        tee_no < 1 || tee_no > MAX_ENC_RUNGS || cam < 0 || cam >= NUM_CAMS) {
+        return;
+    }
+    request_key_unit_limited(&g_encoders[cam][tee_no - 1]);
+}
+
+// PLAYING 중에 바꿀 수 있다고 표시된 속성만 바로 적용한다
+static gboolean set_live_property(GstElement *element, const gchar *name, gint value) {
+    GParamSpec *pspec = g_object_class_find_property(G_OBJECT_GET_CLASS(element), name);
+    if (!pspec || !(pspec->flags & GST_PARAM_MUTABLE_PLAYING)) {
+        glog_trace("%s %s=%d can not be changed while playing\n", GST_ELEMENT_NAME(element), name, value);
+        return FALSE;
+    }
+
+    GValue v = G_VALUE_INIT;
+    g_value_init(&v, G_TYPE_INT);
+    g_value_set_int(&v, value);
+    g_object_set_property(G_OBJECT(element), name, &v);
+    g_value_unset(&v);
+    return TRUE;
+}
+
+// framerate caps만 바꿔 videorate와 인코더를 재협상시킨다
+// videorate는 drop-only라 입력보다 높게는 못 올리므로 그 경우 입력 프레임 그대로 보낸다
+static void set_encoder_fps(EncoderHandle *handle, gint fps) {
+    gint in_num = 0, in_den = 1;
+    GstPad *sink = gst_element_get_static_pad(handle->rate_caps, "sink");
+    GstPad *peer = gst_pad_get_peer(sink);
+    GstElement *videorate = peer ? gst_pad_get_parent_element(peer) : NULL;
+    if (videorate) {
+        GstPad *in_pad = gst_element_get_static_pad(videorate, "sink");
+        GstCaps *in_caps = gst_pad_get_current_caps(in_pad);
+        if (in_caps) {
+            gst_structure_get_fraction(gst_caps_get_structure(in_caps, 0), "framerate", &in_num, &in_den);
+            gst_caps_unref(in_caps);
+        }
+        gst_object_unref(in_pad);
+        gst_object_unref(videorate);
+    }
+    if (peer)
+        gst_object_unref(peer);
+    gst_object_unref(sink);
+
+    GstCaps *caps;
+    g_object_get(handle->rate_caps, "caps", &caps, NULL);
+    caps = gst_caps_make_writable(caps);
+    if (in_num > 0 && (gint64)fps * in_den >= in_num) {
+        gst_structure_remove_field(gst_caps_get_structure(caps, 0), "framerate");
+    } else {
+        gst_caps_set_simple(caps, "framerate", GST_TYPE_FRACTION, fps, 1, NULL);
+    }
+    g_object_set(handle->rate_caps, "caps", caps, NULL);
+    gst_caps_unref(caps);
+}
+
+// set_encoder 명령 (메인 루프): change에서 0이 아닌 항목만 실행 중인 인코더에 반영한다
+// 바로 반영하지 못한 항목이 있으면 FALSE (호출한 쪽이 저장해 두면 재시작 후 적용)
+gboolean set_encoder_live(gint cam, gint rung, const EncoderRung *change) {
+    if (cam < 0 || cam >= NUM_CAMS || rung < 0 || rung >= g_enc_rung_cnt[cam] ||
+        !g_encoders[cam][rung].enc) {
+        glog_error("set_encoder invalid cam %d rung %d\n", cam, rung);
+        return FALSE;
+    }
+
+    EncoderHandle *handle = &g_encoders[cam][rung];
+    gboolean software = g_backend == PIPELINE_BACKEND_SOFTWARE;
+    gboolean live = TRUE;
+
+    if (change->bitrate > 0) {
+        // x264enc bitrate는 kbps
+        live &= set_live_property(handle->enc, "bitrate", software ? MAX(change->bitrate / 1000, 1) : change->bitrate);
+        handle->rung.bitrate = change->bitrate;
+    }
+    if (change->peak_bitrate > 0)
+        handle->rung.peak_bitrate = change->peak_bitrate;
+    if (!software && (change->bitrate > 0 || change->peak_bitrate > 0)) {
+        gint peak = handle->rung.peak_bitrate > 0 ? handle->rung.peak_bitrate : handle->rung.bitrate * 2;
+        live &= set_live_property(handle->enc, "peak-bitrate", peak);
+    }
+
+    if (change->gop > 0) {
+        // 인코더가 실행 중 변경을 지원하지 않으면 더 짧은 gop은 IDR 요청으로 맞추고,
+        // 더 긴 gop은 저장만 해 두었다가 재시작 때 적용
+        if (set_live_property(handle->enc, software ? "key-int-max" : "idrinterval", change->gop)) {
+            handle->forced_gop = 0;
+        } else if (change->gop <= handle->build_gop) {
+            handle->forced_gop = change->gop < handle->build_gop ? change->gop : 0;
+        } else {
+            live = FALSE;
+        }
+        handle->rung.gop = change->gop;
+    }
+
+    if (change->fps > 0 && handle->rate_caps) {
+        set_encoder_fps(handle, change->fps);
+        handle->rung.fps = change->fps;
+    }
+
+    glog_trace("set_encoder cam %d rung %d : %d bps (peak %d), gop %d, %d fps%s\n", cam, rung,
+               handle->rung.bitrate, handle->rung.peak_bitrate, handle->rung.gop, handle->rung.fps,
+               live ? "" : " (partly after restart)");
+    return live;
+}
+
+void subscribe_encoder(const gchar *tee_name) {
+    update_encoder_subscribers(tee_name, 1);
+}
+
+void unsubscribe_encoder(const gchar *tee_name) {
+    update_encoder_subscribers(tee_name, -1);
+}
+
+// 피어별 송출 브랜치 (인코더 tee ! queue ! udpsink 또는 shmsink)
+// 피어가 스트림을 받을 때만 만들고, 떠나면 tee 요청 패드와 함께 제거한다.
+// shm 브랜치는 tee마다 하나를 두고 같은 스트림을 보는 모든 sender가 함께 읽는다.
+typedef struct {
+    gint port;                      // udpsink 포트 (shm 브랜치면 0)
+    gchar *tee_name;
+    gint refcount;                  // shm 브랜치를 읽는 피어 수
+    guint overruns;                 // 느린 reader 때문에 버린 버퍼 수 (shm)
+    GstElement *tee;
+    GstPad *tee_pad;
+    GstElement *queue;
+    GstElement *sink;
+} EgressBranch;
+
+static EgressBranch *find_egress(const gchar *tee_name, gint port) {
+    for (GList *l = g_egress_branches; l; l = l->next) {
+        EgressBranch *egress = (EgressBranch *)l->data;
+        if (port != 0 ? egress->port == port
+                      : (egress->port == 0 && strcmp(egress->tee_name, tee_name) == 0)) {
+            return egress;
+        }
+    }
+    return NULL;
+}
+
+// queue ! sink 를 파이프라인에 넣고 tee 요청 패드에 연결
+static EgressBranch *link_egress(const gchar *tee_name, gint port, GstElement *queue, GstElement *sink) {
+    GstElement *tee = gst_bin_get_by_name(GST_BIN(g_pipeline), tee_name);
+    if (!tee) {
+        glog_error("link_egress can not find %s\n", tee_name);
+        gst_object_unref(queue);
+        gst_object_unref(sink);
+        return NULL;
+    }
+
+    EgressBranch *egress = g_new0(EgressBranch, 1);
+    egress->port = port;
+    egress->tee_name = g_strdup(tee_name);
+    egress->refcount = 1;
+    egress->tee = tee;
+    egress->queue = queue;
+    egress->sink = sink;
+
+    gst_bin_add_many(GST_BIN(g_pipeline), egress->queue, egress->sink, NULL);
+    gst_element_link(egress->queue, egress->sink);
+    gst_element_sync_state_with_parent(egress->sink);
+    gst_element_sync_state_with_parent(egress->queue);
+
+    // 하위 요소가 준비된 뒤 tee에 연결해야 첫 버퍼가 not-linked로 끊기지 않는다
+    egress->tee_pad = gst_element_get_request_pad(tee, "src_%u");
+    GstPad *queue_pad = gst_element_get_static_pad(egress->queue, "sink");
+    GstPadLinkReturn ret = gst_pad_link(egress->tee_pad, queue_pad);
+    gst_object_unref(queue_pad);
+
+    if (ret != GST_PAD_LINK_OK) {
+        glog_error("link_egress link fail %s -> port %d (%d)\n", tee_name, port, ret);
+        gst_element_set_state(egress->sink, GST_STATE_NULL);
+        gst_element_set_state(egress->queue, GST_STATE_NULL);
+        gst_bin_remove_many(GST_BIN(g_pipeline), egress->queue, egress->sink, NULL);
+        gst_element_release_request_pad(tee, egress->tee_pad);
+        gst_object_unref(egress->tee_pad);
+        gst_object_unref(tee);
+        g_free(egress->tee_name);
+        g_free(egress);
+        return NULL;
+    }
+
+    g_egress_branches = g_list_prepend(g_egress_branches, egress);
+    subscribe_encoder(tee_name);
+    return egress;
+}
+
+// 떼어낸 브랜치의 상태 변경/제거와 tee 패드 반납은 메인 루프에서 한다.
+// probe는 tee 스트리밍 스레드에서 불릴 수 있고, 거기서 상태를 바꾸면 교착될 수 있다
+static gboolean free_egress_idle(gpointer user_data) {
+    EgressBranch *egress = (EgressBranch *)user_data;
+
+    gst_element_set_state(egress->sink, GST_STATE_NULL);
+    gst_element_set_state(egress->queue, GST_STATE_NULL);
+    gst_bin_remove_many(GST_BIN(g_pipeline), egress->queue, egress->sink, NULL);
+
+    gst_element_release_request_pad(egress->tee, egress->tee_pad);
+    gst_object_unref(egress->tee_pad);
+    gst_object_unref(egress->tee);
+
+    glog_trace("egress detached %s port %d (overruns %u)\n", egress->tee_name, egress->port, egress->overruns);
+    g_free(egress->tee_name);
+    g_free(egress);
+    return G_SOURCE_REMOVE;
+}
+
+// tee 패드에 데이터가 흐르지 않는 시점에 브랜치를 떼어낸다 (unlink만)
+static GstPadProbeReturn remove_egress_cb(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    EgressBranch *egress = (EgressBranch *)user_data;
+
+    GstPad *queue_pad = gst_element_get_static_pad(egress->queue, "sink");
+    gst_pad_unlink(egress->tee_pad, queue_pad);
+    gst_object_unref(queue_pad);
+
+    g_idle_add(free_egress_idle, egress);
+    return GST_PAD_PROBE_REMOVE;
+}
+
+static void unlink_egress(EgressBranch *egress) {
+    g_egress_branches = g_list_remove(g_egress_branches, egress);
+    unsubscribe_encoder(egress->tee_name);
+    gst_pad_add_probe(egress->tee_pad, GST_PAD_PROBE_TYPE_IDLE, remove_egress_cb, egress, NULL);
+}
+
+gboolean attach_udp_egress(const gchar *tee_name, gint port) {
+    if (find_egress(tee_name, port)) {
+        glog_trace("udp egress port %d already attached\n", port);
+        return TRUE;
+    }
+
+    GstElement *queue = gst_element_factory_make("queue", NULL);
+    GstElement *sink = gst_element_factory_make("udpsink", NULL);
+    g_object_set(sink, "host", g_udp_host, "port", port,
+                 "sync", FALSE, "async", FALSE, NULL);
+
+    if (!link_egress(tee_name, port, queue, sink)) {
+        return FALSE;
+    }
+    glog_trace("udp egress attached %s -> %s:%d\n", tee_name, g_udp_host, port);
+    return TRUE;
+}
+
+// 피어의 송출 브랜치(port가 0이면 tee의 shm 브랜치)를 GOP 캐시로 먼저 채운다.
+// 제한: shm 브랜치는 tee마다 하나라 피어별로 캐시를 보낼 수 없다. 다른 피어도 읽고 있으면
+// 그 sender들에 지난 GOP가 다시 들어가 화면이 뒤로 튀므로 캐시를 쓰지 않고 FALSE를 돌려준다.
+// 호출한 쪽은 IDR을 요청하므로 이 경우 첫 화면은 다음 키프레임까지 기다린다.
+gboolean fast_start_egress(const gchar *tee_name, gint port) {
+    EgressBranch *egress = find_egress(tee_name, port);
+    if (!egress) {
+        return FALSE;
+    }
+    if (egress->refcount > 1) {
+        glog_trace("fast start %s: shm egress shared by %d peers, request IDR instead of gop cache\n",
+                   tee_name, egress->refcount);
+        return FALSE;
+    }
+    fast_start_branch(egress->tee_pad);
+    return TRUE;
+}
+
+void detach_udp_egress(gint port) {
+    EgressBranch *egress = find_egress(NULL, port);
+    if (egress) {
+        unlink_egress(egress);
+    }
+}
+
+// shmsink가 공유 메모리를 비우지 못하면(느린 reader) 인코더를 막지 않고 오래된 버퍼를 버린다
+static void on_shm_egress_overrun(GstElement *queue, gpointer user_data) {
+    EgressBranch *egress = (EgressBranch *)user_data;
+    if (egress->overruns++ % 100 == 0) {
+        glog_error("shm egress %s overrun, slow reader (%u)\n", egress->tee_name, egress->overruns);
+    }
+}
+
+void shm_egress_path(const gchar *tee_name, gchar *path, gsize len) {
+    snprintf(path, len, SHM_EGRESS_PATH_FMT, tee_name);
+}
+
+// tee의 출력을 공유 메모리에 한 번만 쓰고, sender들은 shmsrc로 같은 영역을 읽는다.
+// shm 플러그인이 없으면 FALSE (호출한 쪽은 UDP로 대체)
+gboolean attach_shm_egress(const gchar *tee_name) {
+    EgressBranch *egress = find_egress(tee_name, 0);
+    if (egress) {
+        egress->refcount++;
+        return TRUE;
+    }
+
+    GstElement *sink = gst_element_factory_make("shmsink", NULL);
+    if (!sink) {
+        return FALSE;
+    }
+    GstElement *queue = gst_element_factory_make("queue", NULL);
+    g_object_set(queue, "leaky", 2, "max-size-buffers", SHM_EGRESS_QUEUE_SIZE,
+                 "max-size-bytes", 0, "max-size-time", (guint64)0, NULL);
+
+    gchar path[128];
+    shm_egress_path(tee_name, path, sizeof(path));
+    unlink(path);
+    g_object_set(sink, "socket-path", path, "shm-size", SHM_EGRESS_SIZE,
+                 "wait-for-connection", FALSE, "sync", FALSE, "async", FALSE, NULL);
+
+    egress = link_egress(tee_name, 0, queue, sink);
+    if (!egress) {
+        return FALSE;
+    }
+    g_signal_connect(queue, "overrun", G_CALLBACK(on_shm_egress_overrun), egress);
+    glog_trace("shm egress attached %s -> %s\n", tee_name, path);
+    return TRUE;
+}
+
+void detach_shm_egress(const gchar *tee_name) {
+    EgressBranch *egress = find_egress(tee_name, 0);
+    if (egress && --egress->refcount == 0) {
+        unlink_egress(egress);
     }
-    
-    return g_string_free(sinks, FALSE);
 }
 
 // 전체 파이프라인 빌더
 gchar* build_complete_pipeline(PipelineConfig *config) {
     GString *pipeline = g_string_new("");
     gchar *temp;
+
+    g_backend = config->backend;
     
     // RGB 카메라 소스
     temp = build_udp_source(config->rgb_port, config->rgb_flip_method, config->rgb_width, config->rgb_height);
@@ -1598,19 +2374,14 @@ gchar* build_complete_pipeline(PipelineConfig *config) {
     g_string_append_printf(pipeline, "%s ! ", temp);
     g_free(temp);
     
-    // RGB 고해상도 인코더
-    temp = build_encoder_branch(config->rgb_output_width, config->rgb_output_height,
-                               config->bitrate_high_rgb,
+    // RGB 고해상도 인코더 (rung 0)
+    temp = build_encoder_branch(&config->ladder[RGB_CAM][0], "video_enc_rate1_0", "video_enc1_0",
                                "h264parse_1", "video_enc_tee1_0");
     g_string_append_printf(pipeline, "%s ", temp);
     g_free(temp);
     
-    // RGB 저해상도 브랜치
-    temp = build_low_res_branch("video_src_tee0", config->low_framerate,
-                               config->rgb_width, config->rgb_height,
-                               config->bitrate_low_rgb, "video_enc_tee2_0");
-    g_string_append_printf(pipeline, "%s ", temp);
-    g_free(temp);
+    // RGB 저해상도 브랜치 (rung 1~)
+    append_low_res_ladder(pipeline, config, RGB_CAM, "video_src_tee0");
     
     // Thermal 카메라 소스
     temp = build_udp_source(config->thermal_port, 0, config->thermal_width, config->thermal_height);
@@ -1633,24 +2404,16 @@ gchar* build_complete_pipeline(PipelineConfig *config) {
     g_string_append_printf(pipeline, "%s ! ", temp);
     g_free(temp);
     
-    // Thermal 고해상도 인코더 (실제로는 384x288)
-    temp = build_encoder_branch(config->thermal_output_width, config->thermal_output_height,
-                               config->bitrate_high_thermal,
+    // Thermal 고해상도 인코더 (rung 0, 실제로는 384x288)
+    temp = build_encoder_branch(&config->ladder[THERMAL_CAM][0], "video_enc_rate1_1", "video_enc1_1",
                                "h264parse_2", "video_enc_tee1_1");
     g_string_append_printf(pipeline, "%s ", temp);
     g_free(temp);
     
-    // Thermal 저해상도 브랜치
-    temp = build_low_res_branch("video_src_tee1", config->low_framerate,
-                               384, 288,
-                               config->bitrate_low_thermal, "video_enc_tee2_1");
-    g_string_append_printf(pipeline, "%s ", temp);
-    g_free(temp);
+    // Thermal 저해상도 브랜치 (rung 1~)
+    append_low_res_ladder(pipeline, config, THERMAL_CAM, "video_src_tee1");
     
-    // UDP 싱크들
-    temp = build_udp_sinks(config);
-    g_string_append(pipeline, temp);
-    g_free(temp);
+    // UDP 송출 브랜치는 피어가 붙을 때 attach_udp_egress()로 추가한다
     
     return g_string_free(pipeline, FALSE);
 }
\ No newline at end of file
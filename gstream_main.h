@@ -6,6 +6,7 @@
 #include "log_wrapper.h"
 #include "version.h"
 #include "global_define.h"
+#include "config.h"
 
 enum AppState
 {
@@ -70,11 +71,12 @@ typedef struct
 	const gchar *snapshot_path_rgb;
 	const gchar *snapshot_path_thermal;
 
-	// 인코더 설정
-	gint bitrate_high_rgb;
-	gint bitrate_low_rgb;
-	gint bitrate_high_thermal;
-	gint bitrate_low_thermal;
+	// 인코더 설정: 카메라별 화질 단계 (video_enc_tee{rung+1}_{cam})
+	// rung 0은 항상 인코딩, 나머지는 구독하는 피어가 있을 때만 valve를 연다
+	EncoderRung ladder[NUM_CAMS][MAX_ENC_RUNGS];
+	gint ladder_cnt[NUM_CAMS];
+
+	PipelineBackend backend;	// nvidia 또는 software (GPU 없는 환경)
 
 	// AI 모델 설정
 	const gchar *model_config_rgb;
@@ -85,6 +87,11 @@ typedef struct
 	gint low_framerate;
 } PipelineConfig;
 
+// 인코더 tee -> webrtc_sender 공유 메모리 전송 (shmsink/shmsrc)
+#define SHM_EGRESS_PATH_FMT "/tmp/webrtc_shm_%s"
+#define SHM_EGRESS_SIZE (4 * 1024 * 1024)   // 약 4초 (8Mbps)
+#define SHM_EGRESS_QUEUE_SIZE 200
+
 #define MAX_WAIT_REPLY_CNT 5
 
 #define PING_TEST "ping -c 1 8.8.8.8 > /dev/null 2>&1"
@@ -108,13 +115,23 @@ gchar *build_inference_branch(const gchar *tee_name, const gchar *mux_name,
 							  gint width, gint height, const gchar *config_file,
 							  const gchar *nvinfer_name, const gchar *postproc_name,
 							  const gchar *osd_name);
-gchar *build_encoder_branch(gint output_width, gint output_height,
-							gint bitrate, const gchar *parse_name,
-							const gchar *tee_name);
-gchar *build_low_res_branch(const gchar *tee_name, gint framerate,
-							gint width, gint height, gint bitrate,
-							const gchar *enc_tee_name);
-gchar *build_udp_sinks(PipelineConfig *config);
+gchar *build_encoder_branch(const EncoderRung *rung, const gchar *rate_name, const gchar *enc_name,
+							const gchar *parse_name, const gchar *tee_name);
+gchar *build_low_res_branch(const gchar *tee_name, const EncoderRung *rung,
+							const gchar *valve_name, const gchar *rate_name,
+							const gchar *enc_name, const gchar *enc_tee_name);
+gint get_encoder_rung_cnt(gint cam);
+void subscribe_encoder(const gchar *tee_name);
+void unsubscribe_encoder(const gchar *tee_name);
+void request_encoder_key_unit(const gchar *tee_name);
+void fast_start_branch(GstPad *tee_pad);
+gboolean fast_start_egress(const gchar *tee_name, gint port);
+gboolean set_encoder_live(gint cam, gint rung, const EncoderRung *change);
+gboolean attach_udp_egress(const gchar *tee_name, gint port);
+void detach_udp_egress(gint port);
+gboolean attach_shm_egress(const gchar *tee_name);
+void detach_shm_egress(const gchar *tee_name);
+void shm_egress_path(const gchar *tee_name, gchar *path, gsize len);
 gchar *build_complete_pipeline(PipelineConfig *config);
 
 extern gboolean cleanup_and_retry_connect(const gchar *msg, enum AppState state);
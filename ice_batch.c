@@ -0,0 +1,159 @@
+// trickle ICE 후보 묶음 전송 (webrtc_sender, webrtc_inproc, webrtc_peer 공용)
+#include "ice_batch.h"
+
+struct _IceBatch {
+    gint ref;               // 타이머가 하나 잡고 있다
+    GMutex lock;            // 보내는 순서를 지키기 위해 flush 콜백도 잠금 안에서 부른다
+    JsonArray *pending;
+    guint timer;
+    guint delay_ms;
+    guint max_count;
+    gboolean closed;
+    IceBatchFlushFunc flush;
+    gpointer user_data;
+    GDestroyNotify destroy;
+};
+
+static IceBatch *ice_batch_ref(IceBatch *batch) {
+    g_atomic_int_inc(&batch->ref);
+    return batch;
+}
+
+static void ice_batch_unref(gpointer data) {
+    IceBatch *batch = (IceBatch *)data;
+    if (!g_atomic_int_dec_and_test(&batch->ref)) {
+        return;
+    }
+    json_array_unref(batch->pending);
+    g_mutex_clear(&batch->lock);
+    if (batch->destroy) {
+        batch->destroy(batch->user_data);
+    }
+    g_free(batch);
+}
+
+static gchar *json_array_to_string(JsonArray *array) {
+    JsonNode *root = json_node_init_array(json_node_alloc(), array);
+    JsonGenerator *generator = json_generator_new();
+    json_generator_set_root(generator, root);
+    gchar *text = json_generator_to_data(generator, NULL);
+
+    g_object_unref(generator);
+    json_node_free(root);
+    return text;
+}
+
+// batch->lock 잡은 상태에서 호출
+static void flush_locked(IceBatch *batch, gboolean end) {
+    if (batch->timer) {
+        g_source_remove(batch->timer);
+        batch->timer = 0;
+    }
+    guint count = json_array_get_length(batch->pending);
+    if (count == 0 || batch->closed) {
+        return;
+    }
+
+    gchar *text = json_array_to_string(batch->pending);
+    json_array_unref(batch->pending);
+    batch->pending = json_array_new();
+
+    batch->flush(text, count, end, batch->user_data);
+    g_free(text);
+}
+
+static gboolean on_ice_batch_timer(gpointer data) {
+    IceBatch *batch = (IceBatch *)data;
+    GSource *source = g_main_current_source();
+
+    g_mutex_lock(&batch->lock);
+    // 잠금을 기다리는 사이 다른 스레드의 flush가 이 타이머를 지웠으면 새로 잡힌 타이머를 건드리지 않는다
+    if (g_source_is_destroyed(source) || batch->timer != g_source_get_id(source)) {
+        g_mutex_unlock(&batch->lock);
+        return G_SOURCE_REMOVE;
+    }
+    // flush_locked에서 g_source_remove 하지 않도록 잠금 안에서 먼저 비운다
+    batch->timer = 0;
+    flush_locked(batch, FALSE);
+    g_mutex_unlock(&batch->lock);
+    return G_SOURCE_REMOVE;
+}
+
+IceBatch *ice_batch_new(guint delay_ms, guint max_count, IceBatchFlushFunc flush,
+                        gpointer user_data, GDestroyNotify destroy) {
+    IceBatch *batch = g_new0(IceBatch, 1);
+    batch->ref = 1;
+    g_mutex_init(&batch->lock);
+    batch->pending = json_array_new();
+    batch->delay_ms = delay_ms;
+    batch->max_count = max_count;
+    batch->flush = flush;
+    batch->user_data = user_data;
+    batch->destroy = destroy;
+    return batch;
+}
+
+void ice_batch_add(IceBatch *batch, guint mlineindex, const gchar *candidate) {
+    JsonObject *ice = json_object_new();
+    json_object_set_string_member(ice, "candidate", candidate ? candidate : "");
+    json_object_set_int_member(ice, "sdpMLineIndex", mlineindex);
+
+    g_mutex_lock(&batch->lock);
+    if (batch->closed) {
+        g_mutex_unlock(&batch->lock);
+        json_object_unref(ice);
+        return;
+    }
+    json_array_add_object_element(batch->pending, ice);
+
+    gboolean end = candidate == NULL || candidate[0] == '\0';
+    if (end || (batch->max_count > 0 && json_array_get_length(batch->pending) >= batch->max_count)) {
+        flush_locked(batch, end);
+    } else if (batch->timer == 0) {
+        batch->timer = g_timeout_add_full(G_PRIORITY_DEFAULT, batch->delay_ms, on_ice_batch_timer,
+                                          ice_batch_ref(batch), ice_batch_unref);
+    }
+    g_mutex_unlock(&batch->lock);
+}
+
+// 남은 후보와 end-of-candidates를 바로 보낸다
+void ice_batch_end(IceBatch *batch) {
+    ice_batch_add(batch, 0, NULL);
+}
+
+void ice_batch_free(IceBatch *batch) {
+    if (!batch) {
+        return;
+    }
+    g_mutex_lock(&batch->lock);
+    batch->closed = TRUE;
+    if (batch->timer) {
+        g_source_remove(batch->timer);
+        batch->timer = 0;
+    }
+    g_mutex_unlock(&batch->lock);
+    ice_batch_unref(batch);
+}
+
+guint ice_candidates_foreach(JsonNode *ice, IceCandidateFunc func, gpointer user_data) {
+    guint count = 0;
+    if (JSON_NODE_HOLDS_OBJECT(ice)) {
+        JsonObject *object = json_node_get_object(ice);
+        func(json_object_get_int_member(object, "sdpMLineIndex"),
+             json_object_get_string_member(object, "candidate"), user_data);
+        count++;
+    } else if (JSON_NODE_HOLDS_ARRAY(ice)) {
+        JsonArray *array = json_node_get_array(ice);
+        for (guint i = 0; i < json_array_get_length(array); i++) {
+            JsonNode *node = json_array_get_element(array, i);
+            if (!JSON_NODE_HOLDS_OBJECT(node)) {
+                continue;
+            }
+            JsonObject *object = json_node_get_object(node);
+            func(json_object_get_int_member(object, "sdpMLineIndex"),
+                 json_object_get_string_member(object, "candidate"), user_data);
+            count++;
+        }
+    }
+    return count;
+}
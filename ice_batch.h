@@ -0,0 +1,26 @@
+#ifndef __ICE_BATCH_H__
+#define __ICE_BATCH_H__
+
+#include <glib.h>
+#include <json-glib/json-glib.h>
+
+// trickle ICE 후보를 delay_ms 동안 또는 max_count 개까지 모아서 한 번에 보낸다
+// (config webrtc_ice_batch_ms / webrtc_ice_batch_max, 0이면 후보마다 "candidate" 메시지)
+// 모은 후보는 [{candidate, sdpMLineIndex}, ...] JSON 배열로 넘기고,
+// 빈 candidate 항목은 end-of-candidates (브라우저 addIceCandidate({candidate: ""})와 동일)
+typedef struct _IceBatch IceBatch;
+
+typedef void (*IceBatchFlushFunc)(const gchar *ice_array, guint count, gboolean end, gpointer user_data);
+typedef void (*IceCandidateFunc)(guint mlineindex, const gchar *candidate, gpointer user_data);
+
+// 타이머는 기본 메인 컨텍스트에 붙는다. add/end는 아무 스레드에서나 불러도 된다
+IceBatch *ice_batch_new(guint delay_ms, guint max_count, IceBatchFlushFunc flush,
+                        gpointer user_data, GDestroyNotify destroy);
+void      ice_batch_add(IceBatch *batch, guint mlineindex, const gchar *candidate);
+void      ice_batch_end(IceBatch *batch);
+void      ice_batch_free(IceBatch *batch);     // 아직 안 보낸 후보는 버린다
+
+// 받은 메시지의 "ice" 값 (후보 하나 또는 배열)을 후보마다 func로 넘긴다. 넘긴 개수를 돌려준다
+guint     ice_candidates_foreach(JsonNode *ice, IceCandidateFunc func, gpointer user_data);
+
+#endif	// __ICE_BATCH_H__
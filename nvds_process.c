@@ -30,6 +30,7 @@
 #include "nvds_utils.h"
 #include "circular_buffer.h"
 #include "ptz_control.h"
+#include "tegrastats_monitor.h"
 
 static int *g_cam_indices = NULL;
 #define MAX_OPT_FLOW_ITERATIONS 1000
@@ -55,6 +56,25 @@ typedef struct {
     double throttle_interval;  // 필터링 간격 (초)
 } EventThrottle;
 
+// 추론 bypass: 분석이 꺼져 있거나 PTZ가 움직이는 동안은 결과를 버리므로
+// nvinfer_N_sel을 src_1로 돌려 nvinfer/nvof를 건너뛴다
+#define INFER_BYPASS_CHECK_MS 200
+#define INFER_BYPASS_SAMPLE_TICKS 5		// 1초마다 GPU/전력 샘플
+
+typedef struct {
+	guint64 samples;
+	guint64 gpu_load_sum;
+	guint64 gpu_samples;
+	guint64 power_sum;
+	guint64 power_samples;
+} InferStateStats;
+
+static GMutex g_bypass_lock;
+static gboolean g_analysis_on = TRUE;
+static gboolean g_infer_bypass = FALSE;
+static guint g_bypass_timer_id = 0;
+static InferStateStats g_infer_stats[2];	// 0: 추론, 1: bypass
+
 static EventThrottle g_event_throttle = {
     .throttle_interval = 60.0  // 10초 간격
 };
@@ -126,7 +146,8 @@ void set_tracker_analysis(gboolean OnOff)
 		}
 
 		gboolean rest_val = OnOff ? FALSE : TRUE;
-		g_object_set(G_OBJECT(dspostproc), "reset-object", rest_val, NULL);
+		if (g_object_class_find_property(G_OBJECT_GET_CLASS(dspostproc), "reset-object"))
+			g_object_set(G_OBJECT(dspostproc), "reset-object", rest_val, NULL);
 		g_clear_object(&dspostproc);
 	}
 }
@@ -182,9 +203,88 @@ BboxColor get_object_color(guint camera_id, guint object_id, gint class_id)
 	}
 }
 
+static void update_inference_bypass(void)
+{
+	g_mutex_lock(&g_bypass_lock);
+	gboolean bypass = !g_analysis_on || g_move_speed > 0;
+	if (bypass == g_infer_bypass || g_pipeline == NULL)
+	{
+		g_mutex_unlock(&g_bypass_lock);
+		return;
+	}
+	g_infer_bypass = bypass;
+
+	for (int cam_idx = 0; cam_idx < g_config.device_cnt; cam_idx++)
+	{
+		char element_name[32];
+		sprintf(element_name, "nvinfer_%d_sel", cam_idx + 1);
+		GstElement *sel = gst_bin_get_by_name(GST_BIN(g_pipeline), element_name);
+		if (sel == NULL)
+			continue;		// software 백엔드에는 없음
+
+		GstPad *pad = gst_element_get_static_pad(sel, bypass ? "src_1" : "src_0");
+		if (pad)
+		{
+			g_object_set(sel, "active-pad", pad, NULL);
+			gst_object_unref(pad);
+		}
+		gst_object_unref(sel);
+	}
+	g_mutex_unlock(&g_bypass_lock);
+
+	glog_trace("inference %s (analysis %d, ptz speed %d)\n", bypass ? "bypassed" : "resumed",
+			   g_analysis_on, g_move_speed);
+}
+
+// PTZ 이동 상태는 여러 스레드에서 바뀌므로 메인 루프에서 주기적으로 확인한다
+static gboolean inference_bypass_timer(gpointer user_data)
+{
+	static int ticks = 0;
+
+	update_inference_bypass();
+	if (++ticks < INFER_BYPASS_SAMPLE_TICKS)
+		return G_SOURCE_CONTINUE;
+	ticks = 0;
+
+	InferStateStats *stats = &g_infer_stats[g_infer_bypass ? 1 : 0];
+	int gpu_load = read_gpu_load();
+	int power = read_power_mw();
+	stats->samples++;
+	if (gpu_load >= 0)
+	{
+		stats->gpu_load_sum += gpu_load;
+		stats->gpu_samples++;
+	}
+	if (power >= 0)
+	{
+		stats->power_sum += power;
+		stats->power_samples++;
+	}
+	return G_SOURCE_CONTINUE;
+}
+
+// 상태별 평균 GPU 사용률/전력 (camstatus 텔레메트리)
+char *inference_bypass_to_json(void)
+{
+	InferStateStats *infer = &g_infer_stats[0];
+	InferStateStats *bypass = &g_infer_stats[1];
+	guint64 total = infer->samples + bypass->samples;
+
+	return g_strdup_printf("{\"bypass\": %d, \"bypass_pct\": %.1f, "
+						   "\"gpu_load_infer\": %.1f, \"gpu_load_bypass\": %.1f, "
+						   "\"power_infer_mw\": %.0f, \"power_bypass_mw\": %.0f}",
+						   g_infer_bypass, total ? 100.0 * bypass->samples / total : 0.0,
+						   infer->gpu_samples ? (double)infer->gpu_load_sum / infer->gpu_samples : 0.0,
+						   bypass->gpu_samples ? (double)bypass->gpu_load_sum / bypass->gpu_samples : 0.0,
+						   infer->power_samples ? (double)infer->power_sum / infer->power_samples : 0.0,
+						   bypass->power_samples ? (double)bypass->power_sum / bypass->power_samples : 0.0);
+}
+
 void set_process_analysis(gboolean OnOff)
 {
 	printf("set_process_analysis OnOff=%d\n", OnOff);
+	g_analysis_on = OnOff;
+	update_inference_bypass();
     if (OnOff == 0)
         check_events_for_notification(0, 1);
 
@@ -201,8 +301,10 @@ void set_process_analysis(gboolean OnOff)
 			continue;
 		}
 
+		// software 백엔드의 identity 스텁에는 interval/reset-object가 없다
 		gint interval = OnOff ? g_setting.nv_interval : G_MAXINT;
-		g_object_set(G_OBJECT(nvinfer), "interval", interval, NULL);
+		if (g_object_class_find_property(G_OBJECT_GET_CLASS(nvinfer), "interval"))
+			g_object_set(G_OBJECT(nvinfer), "interval", interval, NULL);
 		g_clear_object (&nvinfer);
 
         GstElement *dspostproc = NULL;
@@ -212,7 +314,8 @@ void set_process_analysis(gboolean OnOff)
         dspostproc = gst_bin_get_by_name(GST_BIN(g_pipeline), element_name);
         if (dspostproc) {
             gboolean reset_val = OnOff ? FALSE : TRUE;
-            g_object_set(G_OBJECT(dspostproc), "reset-object", reset_val, NULL);
+            if (g_object_class_find_property(G_OBJECT_GET_CLASS(dspostproc), "reset-object"))
+                g_object_set(G_OBJECT(dspostproc), "reset-object", reset_val, NULL);
             g_clear_object(&dspostproc);
         } else {
             glog_error("Failed to get %s element\n", element_name);
@@ -893,6 +996,10 @@ void get_bbox_temp(GstBuffer *buf, int obj_id)
         return;
     }
 
+    // software 백엔드 버퍼는 NvBufSurface가 아니다
+    if (g_config.pipeline_backend == PIPELINE_BACKEND_SOFTWARE)
+        return;
+
     NvBufSurface *surface = NULL;
     GstMapInfo map_info;
 
@@ -1703,60 +1810,81 @@ void set_custom_label(NvDsObjectMeta *obj_meta, NvDsFrameMeta *frame_meta,
     nvds_add_display_meta_to_frame(frame_meta, display_meta);
 }
 
+// 카메라별 h264parse 출력이 H.264인지 (caps 이벤트가 올 때만 갱신)
+static gint g_h264_stream[NUM_CAMERAS] = {FALSE};
+
+static void update_h264_caps(int camera_id, GstCaps *caps) {
+    const GstStructure *s = gst_caps_get_structure(caps, 0);
+    gboolean is_h264 = gst_structure_has_name(s, "video/x-h264");
+    
+    gchar *caps_str = gst_caps_to_string(caps);
+    printf("Camera %d caps: %s\n", camera_id, caps_str);
+    g_free(caps_str);
+    
+    // 해상도나 codec_data가 바뀌면 다시 저장
+    if (is_h264) {
+        save_codec_data(camera_id, caps);
+    }
+    g_atomic_int_set(&g_h264_stream[camera_id], is_h264);
+}
+
+static GstPadProbeReturn
+h264_event_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+    int camera_id = *(int *)user_data;
+    
+    if (GST_EVENT_TYPE(event) == GST_EVENT_CAPS && camera_id < NUM_CAMERAS) {
+        GstCaps *caps = NULL;
+        gst_event_parse_caps(event, &caps);
+        if (caps) {
+            update_h264_caps(camera_id, caps);
+        }
+    }
+    
+    return GST_PAD_PROBE_OK;
+}
+
+// 버퍼마다 캡스를 조회하지 않고 이벤트 프로브가 캐시한 스트림 종류만 확인
 static GstPadProbeReturn
 h264_buffer_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
     GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
     int camera_id = *(int *)user_data;
     
-    // 캡스 확인하여 H.264 스트림인지 확인
-    GstCaps *caps = gst_pad_get_current_caps(pad);
-    if (caps) {
-		static gboolean codec_data_saved[NUM_CAMERAS] = {FALSE};
-        if (!codec_data_saved[camera_id]) {
-            save_codec_data(camera_id, caps);
-            codec_data_saved[camera_id] = TRUE;
-        }
-		
-        gchar *caps_str = gst_caps_to_string(caps);
-        
-        // 디버그: 처음 몇 번만 출력
-        static int debug_count = 0;
-        if (debug_count++ < 5) {
-            printf("Camera %d caps: %s\n", camera_id, caps_str);
-        }
+    if (camera_id < NUM_CAMERAS && g_atomic_int_get(&g_h264_stream[camera_id])) {
+        // 키프레임 확인
+        gboolean is_keyframe = !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
         
-        // H.264 스트림인지 확인
-        if (strstr(caps_str, "video/x-h264")) {
-            // 키프레임 확인
-            gboolean is_keyframe = !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
-            
-            // 순환 버퍼에 추가
-            add_frame_to_buffer(buffer, is_keyframe, camera_id);
-        }
-        
-        g_free(caps_str);
-        gst_caps_unref(caps);
+        // 순환 버퍼에 추가 (SPS/PPS 캐시도 여기서 갱신)
+        add_frame_to_buffer(buffer, is_keyframe, camera_id);
     }
     
     return GST_PAD_PROBE_OK;
 }
 
-static void on_event_save_complete(int camera_id, int event_id, const char *filename, const char *http_path, 
+static void on_event_save_complete(int camera_id, const int *event_ids, int event_count,
+                                  const char *filename, const char *http_path, 
                                   gboolean success, double event_time, void *user_data) {
+    // clip writer 스레드에서 호출된다. g_curlinfo는 다른 스레드와 같이 쓰므로 직렬화
+    static pthread_mutex_t notify_mutex = PTHREAD_MUTEX_INITIALIZER;
+
     if (success) {
         g_print("=== Event Save Complete ===\n");
         g_print("Camera: %d\n", camera_id);
         g_print("File: %s\n", filename);
         g_print("Event time: %.2f\n", event_time);
+        g_print("Events: %d\n", event_count);
         
         // 여기서 필요한 추가 작업 수행
         // 예: 데이터베이스에 기록, 알림 전송 등
-		char event_class_id[2] = {0};
-		event_class_id[0] = event_id + '0';
-
+        // 합쳐진 클립은 이벤트 종류마다 같은 영상으로 알림
+        pthread_mutex_lock(&notify_mutex);
 		strcpy(g_curlinfo.video_url, http_path);
-		
-		notification_request(g_config.camera_id, event_class_id, &g_curlinfo);
+		for (int i = 0; i < event_count; i++) {
+			char event_class_id[2] = {0};
+			event_class_id[0] = event_ids[i] + '0';
+			notification_request(g_config.camera_id, event_class_id, &g_curlinfo);
+		}
+        pthread_mutex_unlock(&notify_mutex);
         
         // 파일 정보 확인
         struct stat st;
@@ -1770,6 +1898,77 @@ static void on_event_save_complete(int camera_id, int event_id, const char *file
     }
 }
 
+// software 백엔드: nvinfer 대신 identity를 지나는 프레임에 가짜 검출 결과를 붙인다
+// OSD/이벤트 프로브가 실제 추론과 같은 NvDsBatchMeta 경로를 타도록 정상 소 몇 마리를 좌우로 움직인다
+#define FAKE_DETECTION_OBJS 3
+
+static GstPadProbeReturn fake_detection_probe(GstPad *pad, GstPadProbeInfo *info, gpointer u_data)
+{
+	GstBuffer *buf = gst_buffer_make_writable(GST_PAD_PROBE_INFO_BUFFER(info));
+	GST_PAD_PROBE_INFO_DATA(info) = buf;
+
+	GstCaps *caps = gst_pad_get_current_caps(pad);
+	gint width = 640, height = 480;
+	if (caps)
+	{
+		GstStructure *s = gst_caps_get_structure(caps, 0);
+		gst_structure_get_int(s, "width", &width);
+		gst_structure_get_int(s, "height", &height);
+		gst_caps_unref(caps);
+	}
+
+	static guint frame_num[NUM_CAMS];
+	int cam_idx = *(int *)u_data;
+	guint n = frame_num[cam_idx]++;
+
+	NvDsBatchMeta *batch_meta = nvds_create_batch_meta(1);
+	NvDsFrameMeta *frame_meta = nvds_acquire_frame_meta_from_pool(batch_meta);
+	frame_meta->pad_index = 0;
+	frame_meta->batch_id = 0;
+	frame_meta->frame_num = n;
+	frame_meta->buf_pts = GST_BUFFER_PTS(buf);
+	frame_meta->source_frame_width = width;
+	frame_meta->source_frame_height = height;
+	nvds_add_frame_meta_to_batch(batch_meta, frame_meta);
+
+	for (int i = 0; i < FAKE_DETECTION_OBJS; i++)
+	{
+		NvDsObjectMeta *obj_meta = nvds_acquire_obj_meta_from_pool(batch_meta);
+		float box_w = width / 6.0f, box_h = height / 5.0f;
+		obj_meta->class_id = CLASS_NORMAL_COW;
+		obj_meta->confidence = 0.9f;
+		obj_meta->object_id = i;
+		obj_meta->rect_params.left = (n * (i + 1)) % (guint)(width - box_w);
+		obj_meta->rect_params.top = (height / FAKE_DETECTION_OBJS) * i;
+		obj_meta->rect_params.width = box_w;
+		obj_meta->rect_params.height = box_h;
+		obj_meta->text_params.display_text = g_strdup("fake");
+		nvds_add_obj_meta_to_frame(frame_meta, obj_meta, NULL);
+	}
+
+	NvDsMeta *meta = gst_buffer_add_nvds_meta(buf, batch_meta, NULL,
+											  nvds_batch_meta_copy_func, nvds_batch_meta_release_func);
+	meta->meta_type = NVDS_BATCH_GST_META;
+	return GST_PAD_PROBE_OK;
+}
+
+static void setup_fake_detection(int cam_idx)
+{
+	char element_name[32];
+	sprintf(element_name, "nvinfer_%d", cam_idx + 1);
+	GstElement *stub = gst_bin_get_by_name(GST_BIN(g_pipeline), element_name);
+	if (stub == NULL)
+	{
+		glog_error("Fail get %s element\n", element_name);
+		return;
+	}
+
+	GstPad *src_pad = gst_element_get_static_pad(stub, "src");
+	gst_pad_add_probe(src_pad, GST_PAD_PROBE_TYPE_BUFFER, fake_detection_probe, &g_cam_indices[cam_idx], NULL);
+	gst_object_unref(src_pad);
+	gst_object_unref(stub);
+}
+
 void setup_nv_analysis()
 {
 	glog_trace("g_config.device_cnt=%d\n", g_config.device_cnt);
@@ -1807,6 +2006,9 @@ void setup_nv_analysis()
 		// 각 카메라별로 고유한 인덱스 저장
 		g_cam_indices[cam_idx] = cam_idx;
 
+		if (g_config.pipeline_backend == PIPELINE_BACKEND_SOFTWARE)
+			setup_fake_detection(cam_idx);
+
 		g_print("osd_sink_pad_buffer_probe cam_idx=%d\n", cam_idx);
 		gst_pad_add_probe(osd_sink_pad, GST_PAD_PROBE_TYPE_BUFFER,
 						  osd_sink_pad_buffer_probe, &g_cam_indices[cam_idx], NULL);
@@ -1817,8 +2019,19 @@ void setup_nv_analysis()
 		if (h264parse) {
 			// src pad에 프로브 추가 (파싱된 H.264 스트림)
 			GstPad *srcpad = gst_element_get_static_pad(h264parse, "src");
+			gst_pad_add_probe(srcpad, GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+							h264_event_probe, &g_cam_indices[cam_idx], NULL);
 			gst_pad_add_probe(srcpad, GST_PAD_PROBE_TYPE_BUFFER,
 							h264_buffer_probe, &g_cam_indices[cam_idx], NULL);
+
+			// 이미 협상된 캡스가 있으면 이벤트를 기다리지 않고 반영
+			GstCaps *caps = gst_pad_get_current_caps(srcpad);
+			if (caps && cam_idx < NUM_CAMERAS) {
+				update_h264_caps(cam_idx, caps);
+			}
+			if (caps) {
+				gst_caps_unref(caps);
+			}
 			gst_object_unref(srcpad);
 			g_print("Added probe to camera %d h264parse element\n", cam_idx);
 		} else {
@@ -1833,6 +2046,8 @@ void setup_nv_analysis()
 	}
 
 	pthread_create(&g_tid, NULL, event_sender_thread, NULL);
+
+	g_bypass_timer_id = g_timeout_add(INFER_BYPASS_CHECK_MS, inference_bypass_timer, NULL);
 }
 
 void endup_nv_analysis()
@@ -1844,6 +2059,12 @@ void endup_nv_analysis()
 		pthread_join(g_tid, NULL);
 	}
 
+	if (g_bypass_timer_id)
+	{
+		g_source_remove(g_bypass_timer_id);
+		g_bypass_timer_id = 0;
+	}
+
 	cleanup_all_circular_buffers();
 
 	if (g_cam_indices)
@@ -173,6 +173,7 @@ extern void remove_newlines(char *str);
 extern void init_obj_info();
 
 void set_process_analysis(gboolean OnOff);
+char *inference_bypass_to_json(void);
 void setup_nv_analysis();
 void endup_nv_analysis();
 void check_events_for_notification(int cam_idx, int init);
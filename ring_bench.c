@@ -0,0 +1,245 @@
+// 이벤트 순환 버퍼 벤치마크
+// 합성 H.264 GstBuffer로 모든 카메라에 프레임을 넣으면서 클립 추출/상태 조회를 동시에 돌리고
+// add_frame_to_buffer() 지연(p50/p99/max), 복사한 바이트, reader 잠금 보유 시간을 출력한다.
+//
+// 사용법: ring_bench [fps] [bitrate(bps)] [seconds] [readers] [disk_ring_sec]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "circular_buffer.h"
+
+WebRTCConfig g_config;
+
+typedef struct {
+    int camera_id;
+    int fps;
+    int seconds;
+    gsize idr_size;
+    gsize p_size;
+    double *latency_us;             // 프레임별 삽입 지연
+    int inserts;
+} WriterArgs;
+
+typedef struct {
+    int seed;
+    int extracts;
+    int failed;
+    int status_calls;
+    guint64 bytes_read;
+} ReaderArgs;
+
+static volatile gboolean bench_running = TRUE;
+
+static double now_mono(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Annex B 접근 단위: IDR은 SPS/PPS를 앞에 붙인다 (h264parse config-interval=-1 출력과 동일)
+static GstBuffer *make_frame(gsize size, gboolean idr) {
+    static const guint8 sps[] = {0, 0, 0, 1, 0x67, 0x64, 0x00, 0x28, 0xac, 0xd9, 0x40, 0x78};
+    static const guint8 pps[] = {0, 0, 0, 1, 0x68, 0xeb, 0xe3, 0xcb, 0x22, 0xc0};
+    GstBuffer *buffer = gst_buffer_new_allocate(NULL, size, NULL);
+    GstMapInfo map;
+    gst_buffer_map(buffer, &map, GST_MAP_WRITE);
+
+    gsize pos = 0;
+    if (idr) {
+        memcpy(map.data + pos, sps, sizeof(sps));
+        pos += sizeof(sps);
+        memcpy(map.data + pos, pps, sizeof(pps));
+        pos += sizeof(pps);
+    }
+    map.data[pos++] = 0;
+    map.data[pos++] = 0;
+    map.data[pos++] = 1;
+    map.data[pos++] = idr ? 0x65 : 0x41;
+    // 시작 코드가 생기지 않도록 0이 아닌 값으로 채운다
+    for (; pos < map.size; pos++) {
+        map.data[pos] = 0x80 | (pos & 0x7F);
+    }
+
+    gst_buffer_unmap(buffer, &map);
+    if (!idr) {
+        GST_BUFFER_FLAG_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+    }
+    return buffer;
+}
+
+// 스트리밍 스레드 역할: fps 간격으로 프레임을 넣고 호출 시간만 잰다
+static void *writer_thread(void *arg) {
+    WriterArgs *w = (WriterArgs *)arg;
+    GstBuffer *idr = make_frame(w->idr_size, TRUE);
+    GstBuffer *p = make_frame(w->p_size, FALSE);
+    int total = w->fps * w->seconds;
+
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    long interval_ns = 1000000000L / w->fps;
+
+    for (int n = 0; n < total && bench_running; n++) {
+        GstBuffer *buffer = (n % w->fps == 0) ? idr : p;
+        GST_BUFFER_PTS(buffer) = gst_util_uint64_scale(n, GST_SECOND, w->fps);
+
+        double t0 = now_mono();
+        add_frame_to_buffer(buffer, buffer == idr, w->camera_id);
+        w->latency_us[w->inserts++] = (now_mono() - t0) * 1e6;
+
+        next.tv_nsec += interval_ns;
+        while (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+
+    gst_buffer_unref(idr);
+    gst_buffer_unref(p);
+    return NULL;
+}
+
+// 이벤트 저장과 상태 조회를 흉내내는 reader: 최근 구간을 복사해 읽고 풀어준다
+static void *reader_thread(void *arg) {
+    ReaderArgs *r = (ReaderArgs *)arg;
+    unsigned int seed = r->seed;
+
+    while (bench_running) {
+        int camera_id = rand_r(&seed) % NUM_CAMERAS;
+        double now = now_mono();
+        double length = 2 + rand_r(&seed) % 15;
+        H264ClipView *view = NULL;
+
+        if (extract_event_clip(camera_id, now - length - 1, now - 1, &view) == 0) {
+            for (int i = 0; i < view->frame_count; i++) {
+                const H264Frame *frame = clip_view_get_frame(view, i);
+                r->bytes_read += frame->size;
+            }
+            clip_view_unref(view);
+            r->extracts++;
+        } else {
+            r->failed++;
+        }
+
+        BufferStatus status;
+        for (int cam = 0; cam < NUM_CAMERAS; cam++) {
+            get_buffer_status(cam, &status);
+            r->status_calls++;
+        }
+
+        g_usleep(10000);
+    }
+    return NULL;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, int n, double p) {
+    if (n == 0) {
+        return 0;
+    }
+    int i = (int)(p * (n - 1) + 0.5);
+    return sorted[i];
+}
+
+int main(int argc, char *argv[]) {
+    int fps = argc > 1 ? atoi(argv[1]) : 30;
+    int bitrate = argc > 2 ? atoi(argv[2]) : EVENT_RING_DEFAULT_BITRATE;
+    int seconds = argc > 3 ? atoi(argv[3]) : 30;
+    int readers = argc > 4 ? atoi(argv[4]) : 2;
+    int disk_ring_sec = argc > 5 ? atoi(argv[5]) : 0;
+
+    if (fps <= 1 || bitrate <= 0 || seconds <= 0 || readers < 0) {
+        printf("usage: %s [fps] [bitrate] [seconds] [readers] [disk_ring_sec]\n", argv[0]);
+        return 1;
+    }
+
+    gst_init(&argc, &argv);
+
+    memset(&g_config, 0, sizeof(g_config));
+    g_config.record_path = "/tmp";
+    g_config.http_service_ip = "127.0.0.1";
+    g_config.event_disk_ring_sec = disk_ring_sec;
+    for (int i = 0; i < (int)G_N_ELEMENTS(g_config.bitrate_high); i++) {
+        g_config.bitrate_high[i] = bitrate;
+    }
+
+    // GOP = 1초, IDR은 P 프레임의 5배 크기로 가정
+    gsize unit = (gsize)bitrate / 8 / (fps - 1 + 5);
+    gsize p_size = MAX(unit, 64);
+    gsize idr_size = MAX(unit * 5, 128);
+
+    printf("=== Event ring benchmark ===\n");
+    printf("Cameras %d, %d fps, %.1f Mbps, %d sec, %d readers, disk ring %d sec\n",
+           NUM_CAMERAS, fps, bitrate / 1e6, seconds, readers, disk_ring_sec);
+    printf("Frame size: IDR %lu bytes, P %lu bytes\n", idr_size, p_size);
+
+    init_all_circular_buffers();
+
+    pthread_t writer_tids[NUM_CAMERAS];
+    WriterArgs writers[NUM_CAMERAS];
+    for (int cam = 0; cam < NUM_CAMERAS; cam++) {
+        writers[cam] = (WriterArgs){ cam, fps, seconds, idr_size, p_size, NULL, 0 };
+        writers[cam].latency_us = g_malloc(sizeof(double) * fps * seconds);
+        pthread_create(&writer_tids[cam], NULL, writer_thread, &writers[cam]);
+    }
+
+    pthread_t *reader_tids = g_malloc(sizeof(pthread_t) * MAX(readers, 1));
+    ReaderArgs *reader_args = g_malloc0(sizeof(ReaderArgs) * MAX(readers, 1));
+    for (int i = 0; i < readers; i++) {
+        reader_args[i].seed = i + 1;
+        pthread_create(&reader_tids[i], NULL, reader_thread, &reader_args[i]);
+    }
+
+    for (int cam = 0; cam < NUM_CAMERAS; cam++) {
+        pthread_join(writer_tids[cam], NULL);
+    }
+    bench_running = FALSE;
+    for (int i = 0; i < readers; i++) {
+        pthread_join(reader_tids[i], NULL);
+    }
+
+    // 결과
+    printf("\n%-6s %8s %10s %10s %10s %12s %10s %12s %12s %8s\n", "camera", "inserts",
+           "p50(us)", "p99(us)", "max(us)", "copied(MB)", "locks", "avg lock(us)", "max lock(us)", "dropped");
+    guint64 view_bytes = 0;
+    for (int cam = 0; cam < NUM_CAMERAS; cam++) {
+        WriterArgs *w = &writers[cam];
+        qsort(w->latency_us, w->inserts, sizeof(double), compare_double);
+
+        BufferStatus status;
+        get_buffer_status(cam, &status);
+        double avg_lock_us = status.lock_count ? status.lock_hold_total_ns / 1e3 / status.lock_count : 0;
+        view_bytes += status.view_bytes_copied;
+
+        printf("%-6d %8d %10.1f %10.1f %10.1f %12.1f %10lu %12.1f %12.1f %8lu\n", cam, w->inserts,
+               percentile(w->latency_us, w->inserts, 0.50),
+               percentile(w->latency_us, w->inserts, 0.99),
+               w->inserts ? w->latency_us[w->inserts - 1] : 0,
+               status.bytes_copied / (1024.0 * 1024.0), status.lock_count, avg_lock_us,
+               status.lock_hold_max_ns / 1e3, status.dropped_frames);
+        g_free(w->latency_us);
+    }
+
+    int extracts = 0, failed = 0, status_calls = 0;
+    guint64 bytes_read = 0;
+    for (int i = 0; i < readers; i++) {
+        extracts += reader_args[i].extracts;
+        failed += reader_args[i].failed;
+        status_calls += reader_args[i].status_calls;
+        bytes_read += reader_args[i].bytes_read;
+    }
+    printf("\nReaders: %d clips extracted (%d failed), %.1f MB read from clip views (%.1f MB copied), %d status calls\n",
+           extracts, failed, bytes_read / (1024.0 * 1024.0), view_bytes / (1024.0 * 1024.0), status_calls);
+
+    cleanup_all_circular_buffers();
+    g_free(reader_tids);
+    g_free(reader_args);
+    return 0;
+}
@@ -1,4 +1,4 @@
-// Client side implementation of UDP client-server model
+// 피어 IPC (gstream_main <-> webrtc_sender), AF_UNIX SOCK_SEQPACKET
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -8,6 +8,10 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/un.h>
+#include <glib-unix.h>
 #include "socket_comm.h"
 #include "log_wrapper.h"
 #include "device_setting.h"
@@ -34,101 +38,220 @@ void wait_ptz_stop()
 
 // static struct Queue queue;
 
-void *process_socket_comm_input(void *arg)
+static GMainContext *g_comm_context = NULL;
+static GMutex g_comm_lock;          // 콜백 실행과 close_socket_comm 사이 보호
+
+// 모든 피어 소켓을 하나의 스레드(GMainContext)에서 처리한다. 소켓마다 스레드를 만들지 않는다
+static gpointer socket_comm_thread(gpointer arg)
 {
-    SOCKETINFO *pInfo = (SOCKETINFO *)arg;
-    char buffer[MAX_BUF_SIZE];
-    struct sockaddr_in readaddr;
-    int n;
-    socklen_t len;
+    GMainLoop *loop = g_main_loop_new(g_comm_context, FALSE);
+    g_main_loop_run(loop);
+    g_main_loop_unref(loop);
+    return NULL;
+}
 
-    memset(&readaddr, 0, sizeof(readaddr));
-    // glog_trace("thread start %d , %d\n", pInfo->socketfd, pInfo->port);
+static GMainContext *socket_comm_context(void)
+{
+    static gsize once = 0;
+    if (g_once_init_enter(&once))
+    {
+        g_comm_context = g_main_context_new();
+        g_thread_unref(g_thread_new("socket_comm", socket_comm_thread, NULL));
+        g_once_init_leave(&once, 1);
+    }
+    return g_comm_context;
+}
 
-    while (1)
+static void socket_comm_path(int port, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    snprintf(addr->sun_path, sizeof(addr->sun_path), SOCKET_COMM_PATH_FMT, port);
+}
+
+static void set_socket_buffer(int fd)
+{
+    int size = SOCKET_COMM_MAX_MSG * 2;
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+}
+
+// 길이 + 본문을 한 패킷으로 읽는다. 상대가 끊었으면 NULL, *len = 0
+// 잘못된 패킷(길이 불일치, 너무 큼)은 버리고 NULL, *len = -1
+static char *recv_message(int fd, int *len)
+{
+    guint32 size = 0;
+
+    *len = 0;
+    ssize_t n = recv(fd, &size, sizeof(size), MSG_PEEK | MSG_DONTWAIT);
+    if (n == 0)
+        return NULL;
+    if (n < 0)
     {
-        len = sizeof(readaddr);
-        n = recvfrom(pInfo->socketfd, (char *)buffer, MAX_BUF_SIZE,
-                     MSG_WAITALL, (struct sockaddr *)&readaddr, &len);
+        *len = (errno == EAGAIN || errno == EINTR) ? -1 : 0;
+        return NULL;
+    }
+    if (n != sizeof(size) || size > SOCKET_COMM_MAX_MSG)
+    {
+        glog_error("socket_comm drop invalid message (%d bytes, size %u)\n", (int)n, size);
+        recv(fd, &size, sizeof(size), MSG_DONTWAIT);     // SEQPACKET은 남은 부분이 같이 버려진다
+        *len = -1;
+        return NULL;
+    }
 
-        buffer[n] = 0;
-        // glog_trace("recvfrom %d %s \n", n, buffer);
-        if (strcmp(buffer, "EXIT") == 0)
-        {
-            break;
-        }
-        else if (strcmp(buffer, "CONNECT") == 0)
+    char *buffer = g_malloc(size + 1);
+    struct iovec iov[2] = {{&size, sizeof(size)}, {buffer, size}};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    n = recvmsg(fd, &msg, MSG_DONTWAIT);
+    if (n != (ssize_t)(sizeof(size) + size) || (msg.msg_flags & MSG_TRUNC))
+    {
+        glog_error("socket_comm drop truncated message (%d of %u bytes)\n", (int)n, size);
+        g_free(buffer);
+        *len = n == 0 ? 0 : -1;
+        return NULL;
+    }
+    buffer[size] = 0;
+    *len = size;
+    return buffer;
+}
+
+static void close_connection(SOCKETINFO *pInfo)
+{
+    if (pInfo->conn_source)
+    {
+        g_source_destroy(pInfo->conn_source);
+        g_source_unref(pInfo->conn_source);
+        pInfo->conn_source = NULL;
+    }
+    g_mutex_lock(&pInfo->fd_lock);
+    if (pInfo->socketfd >= 0)
+    {
+        close(pInfo->socketfd);
+        pInfo->socketfd = -1;
+    }
+    g_mutex_unlock(&pInfo->fd_lock);
+    pInfo->connect = 0;
+}
+
+static gboolean on_socket_comm_input(gint fd, GIOCondition condition, gpointer user_data)
+{
+    SOCKETINFO *pInfo = (SOCKETINFO *)user_data;
+
+    g_mutex_lock(&g_comm_lock);
+    if (g_source_is_destroyed(g_main_current_source()))
+    {
+        g_mutex_unlock(&g_comm_lock);
+        return G_SOURCE_REMOVE;
+    }
+
+    int n;
+    char *buffer = recv_message(fd, &n);
+    if (!buffer)
+    {
+        if (n == 0)
         {
-            glog_trace("connected client [%d] \n", pInfo->port);
-            pInfo->clientaddr = readaddr;
-            pInfo->connect = 1;
-            continue;
+            // 상대 프로세스가 끝났다
+            glog_trace("socket_comm peer closed [%d]\n", pInfo->port);
+            close_connection(pInfo);
+            g_mutex_unlock(&g_comm_lock);
+            return G_SOURCE_REMOVE;
         }
+        g_mutex_unlock(&g_comm_lock);
+        return G_SOURCE_CONTINUE;
+    }
 
-        if (pInfo->call_fun)
+    if (strcmp(buffer, "CONNECT") == 0)
+    {
+        glog_trace("connected client [%d] \n", pInfo->port);
+        pInfo->connect = 1;
+        if (pInfo->connect_fun)
         {
-            pInfo->call_fun(buffer, n, pInfo);
+            pInfo->connect_fun(pInfo);
         }
     }
+    else if (pInfo->call_fun)
+    {
+        pInfo->call_fun(buffer, n, pInfo);
+    }
+    g_free(buffer);
+    g_mutex_unlock(&g_comm_lock);
+    return G_SOURCE_CONTINUE;
+}
 
-    glog_trace("thread end %d , %d\n", pInfo->socketfd, pInfo->port);
-    return 0;
+static void watch_connection(SOCKETINFO *pInfo, int fd)
+{
+    g_mutex_lock(&pInfo->fd_lock);
+    pInfo->socketfd = fd;
+    g_mutex_unlock(&pInfo->fd_lock);
+    pInfo->conn_source = g_unix_fd_source_new(fd, G_IO_IN | G_IO_HUP | G_IO_ERR);
+    g_source_set_callback(pInfo->conn_source, (GSourceFunc)on_socket_comm_input, pInfo, NULL);
+    g_source_attach(pInfo->conn_source, socket_comm_context());
 }
 
-SOCKETINFO *init_socket_comm_server(int port)
+// 슬롯마다 sender는 하나. 새 sender가 붙으면 이전 연결은 닫는다
+static gboolean on_socket_comm_accept(gint fd, GIOCondition condition, gpointer user_data)
 {
-    int sockfd;
-    struct sockaddr_in servaddr;
+    SOCKETINFO *pInfo = (SOCKETINFO *)user_data;
 
-    // Creating socket file descriptor
-    if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    g_mutex_lock(&g_comm_lock);
+    if (g_source_is_destroyed(g_main_current_source()))
     {
-        glog_error("socket creation failed");
-        return NULL;
+        g_mutex_unlock(&g_comm_lock);
+        return G_SOURCE_REMOVE;
     }
 
-    // Set SO_REUSEADDR option
-    int reuseaddr = 1; // LJH, 20250319
-    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuseaddr, sizeof(reuseaddr)) < 0)
+    int connfd = accept(fd, NULL, NULL);
+    if (connfd >= 0)
     {
-        glog_error("setsockopt SO_REUSEADDR failed");
-        close(sockfd);
-        return NULL;
+        // fork 하는 sender에 연결이 넘어가지 않도록
+        fcntl(connfd, F_SETFD, FD_CLOEXEC);
+        close_connection(pInfo);
+        set_socket_buffer(connfd);
+        watch_connection(pInfo, connfd);
     }
+    g_mutex_unlock(&g_comm_lock);
+    return G_SOURCE_CONTINUE;
+}
+
+static SOCKETINFO *new_socket_info(int port)
+{
+    SOCKETINFO *pSocketInfo = (SOCKETINFO *)calloc(1, sizeof(SOCKETINFO));
+    pSocketInfo->socketfd = -1;
+    pSocketInfo->listenfd = -1;
+    pSocketInfo->port = port;
+    g_mutex_init(&pSocketInfo->fd_lock);
+    return pSocketInfo;
+}
+
+SOCKETINFO *init_socket_comm_server(int port)
+{
+    struct sockaddr_un servaddr;
+    int sockfd;
 
-    // Set SO_REUSEPORT option (optional, depending on the platform)
-    int reuseport = 1; // LJH, 20250319
-    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &reuseport, sizeof(reuseport)) < 0)
+    if ((sockfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0)
     {
-        glog_error("setsockopt SO_REUSEPORT failed");
-        close(sockfd);
+        glog_error("socket creation failed");
         return NULL;
     }
 
-    memset(&servaddr, 0, sizeof(servaddr));
-
-    // Filling server information
-    servaddr.sin_family = AF_INET; // IPv4
-    servaddr.sin_addr.s_addr = INADDR_ANY;
-    servaddr.sin_port = htons(port);
-
-    // Bind the socket with the server address
-    if (bind(sockfd, (const struct sockaddr *)&servaddr, sizeof(servaddr)) < 0)
+    socket_comm_path(port, &servaddr);
+    unlink(servaddr.sun_path);
+    if (bind(sockfd, (const struct sockaddr *)&servaddr, sizeof(servaddr)) < 0 || listen(sockfd, 4) < 0)
     {
-        glog_error("bind failed");
+        glog_error("bind failed %s (%s)\n", servaddr.sun_path, strerror(errno));
         close(sockfd);
         return NULL;
     }
 
-    SOCKETINFO *pSocketInfo = (SOCKETINFO *)malloc(sizeof(SOCKETINFO));
-    pSocketInfo->socketfd = sockfd;
-    pSocketInfo->port = port;
-
-    pthread_t tid;
-    pthread_create(&tid, NULL, process_socket_comm_input, (void *)pSocketInfo);
-    pSocketInfo->tid = tid;
-    pSocketInfo->call_fun = NULL;
-    pSocketInfo->data = NULL;
+    SOCKETINFO *pSocketInfo = new_socket_info(port);
+    pSocketInfo->listenfd = sockfd;
+    pSocketInfo->listen_source = g_unix_fd_source_new(sockfd, G_IO_IN);
+    g_source_set_callback(pSocketInfo->listen_source, (GSourceFunc)on_socket_comm_accept, pSocketInfo, NULL);
+    g_source_attach(pSocketInfo->listen_source, socket_comm_context());
 
     return pSocketInfo;
 }
@@ -490,78 +613,87 @@ SOCKETINFO *init_socket_server(int port, void *(*func_ptr)(void *), void (*call_
 }
 #endif // end of MINDULE_INCLUDE
 
+// gstream_main의 슬롯 소켓에 연결한다 (init_webrtc_peer가 먼저 열어 둔다)
 SOCKETINFO *init_socket_comm_client(int port)
 {
+    struct sockaddr_un servaddr;
     int sockfd;
 
-    // Creating socket file descriptor
-    if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    if ((sockfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0)
     {
         glog_error("socket creation failed");
         return NULL;
     }
 
-    SOCKETINFO *pSocketInfo = (SOCKETINFO *)malloc(sizeof(SOCKETINFO));
-    
-    // 먼저 구조체 초기화
-    pSocketInfo->socketfd = sockfd;
-    pSocketInfo->port = port;
-    pSocketInfo->call_fun = NULL;
-    pSocketInfo->data = NULL;
-    pSocketInfo->connect = 0;  // 이것도 초기화 필요
-    
-    // 그 다음에 스레드 시작
-    pthread_t tid;
-    pthread_create(&tid, NULL, process_socket_comm_input, (void *)pSocketInfo);
-    pSocketInfo->tid = tid;
+    socket_comm_path(port, &servaddr);
+    if (connect(sockfd, (const struct sockaddr *)&servaddr, sizeof(servaddr)) < 0)
+    {
+        glog_error("connect failed %s (%s)\n", servaddr.sun_path, strerror(errno));
+        close(sockfd);
+        return NULL;
+    }
+    set_socket_buffer(sockfd);
 
+    SOCKETINFO *pSocketInfo = new_socket_info(port);
+    watch_connection(pSocketInfo, sockfd);
     return pSocketInfo;
 }
 
+// 연결된 상대에게 보낸다 (is_self는 UDP 시절 인자, 사용하지 않음). 아무 스레드에서나 호출 가능
+// 콜백 안(g_comm_lock 잡은 상태)에서도 불리므로 g_comm_lock 대신 fd_lock으로 fd를 복제해서 보낸다.
+// socket_comm 스레드가 그 사이 연결을 닫거나 새 sender로 바꿔도 다른 fd에 쓰지 않는다
 int send_data_socket_comm(SOCKETINFO *socket, const char *data, int len, int is_self)
 {
-    struct sockaddr_in sendaddr;
-    memset(&sendaddr, 0, sizeof(sendaddr));
-
-    // Filling server information
-    if (is_self)
-    {
-        sendaddr.sin_family = AF_INET;
-        sendaddr.sin_port = htons(socket->port);
-        sendaddr.sin_addr.s_addr = inet_addr("127.0.0.1");
-    }
-    else
+    if (socket == NULL)
+        return -1;
+    if (len < 0 || len > SOCKET_COMM_MAX_MSG)
     {
-        sendaddr = socket->clientaddr;
+        glog_error("send_data_socket_comm message too large (%d bytes)\n", len);
+        return -1;
     }
 
-    int n = sendto(socket->socketfd, data, len,
-                   MSG_CONFIRM, (const struct sockaddr *)&sendaddr,
-                   sizeof(sendaddr));
-
-    return n;
+    g_mutex_lock(&socket->fd_lock);
+    int fd = socket->socketfd >= 0 ? fcntl(socket->socketfd, F_DUPFD_CLOEXEC, 0) : -1;
+    g_mutex_unlock(&socket->fd_lock);
+    if (fd < 0)
+        return -1;
+
+    guint32 size = len;
+    struct iovec iov[2] = {{&size, sizeof(size)}, {(void *)data, len}};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if (n < 0)
+        glog_error("send_data_socket_comm fail [%d] (%s)\n", socket->port, strerror(errno));
+    close(fd);
+    return n < 0 ? -1 : len;
 }
 
 void close_socket_comm(SOCKETINFO *socket)
 {
     if (socket == NULL)
         return;
-    
-    glog_trace("close_socket_comm\n");
-    
-    // 1. EXIT 전송
-    char szTemp[16] = "EXIT";
-    send_data_socket_comm(socket, szTemp, 5, 1);
-    usleep(100000);  // 100ms 대기
-    
-    // 2. 스레드 강제 종료 (pthread_join 대신)
-    pthread_cancel(socket->tid);
-    
-    // 3. 소켓 닫기
-    close(socket->socketfd);
-    
-    // 4. 메모리 해제
+
+    g_mutex_lock(&g_comm_lock);
+    close_connection(socket);
+    if (socket->listen_source)
+    {
+        g_source_destroy(socket->listen_source);
+        g_source_unref(socket->listen_source);
+    }
+    if (socket->listenfd >= 0)
+    {
+        struct sockaddr_un addr;
+        socket_comm_path(socket->port, &addr);
+        close(socket->listenfd);
+        unlink(addr.sun_path);
+    }
+    g_mutex_unlock(&g_comm_lock);
+
+    g_mutex_clear(&socket->fd_lock);
     free(socket);
-    
     glog_trace("close_socket_comm completed\n");
 }
@@ -5,21 +5,31 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <glib.h>
 #include "device_setting.h"
 #include "curllib.h"
 #include "config.h"
 
+// 피어 IPC: AF_UNIX SOCK_SEQPACKET (SOCKET_COMM_PATH_FMT, port는 슬롯 구분용)
+// 메시지는 길이(guint32) + 본문으로 보내고, 프로세스의 모든 소켓은 하나의 socket_comm 스레드에서 처리한다
+#define SOCKET_COMM_PATH_FMT    "/tmp/webrtc_comm_%d.sock"
+#define SOCKET_COMM_MAX_MSG     (256 * 1024)
+
 typedef struct 
 {
-  int 				    socketfd;
+  int 				    socketfd;       // 연결된 상대 (없으면 -1)
+  GMutex          fd_lock;        // socketfd 교체/close와 send 사이 보호 (g_comm_lock 안쪽에서만 잡는다)
+  int             listenfd;       // 서버만 (클라이언트는 -1)
   unsigned short  port;
   pthread_t 		  tid;
   
   //call back func
   void *data;
   void (*call_fun)(char *ptr , int len, void* arg);
+  void (*connect_fun)(void* arg);     // CONNECT 수신 시 호출 (소켓 스레드)
 
-  struct sockaddr_in	clientaddr;
+  GSource *listen_source;
+  GSource *conn_source;
   int   connect;
 }SOCKETINFO;
 
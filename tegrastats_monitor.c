@@ -9,6 +9,7 @@
 #include <unistd.h>
 #include <sys/wait.h>
 #include <errno.h>
+#include <glob.h>
 #include "log_wrapper.h"
 #include "tegrastats_monitor.h"
 
@@ -214,6 +215,63 @@ TegrastatsInfo* get_tegrastats_info() {
     return &info;
 }
 
+static int read_sysfs_int(const char* path, int* value) {
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        return 0;
+    }
+    int ret = fscanf(fp, "%d", value) == 1;
+    fclose(fp);
+    return ret;
+}
+
+// GPU 사용률 (%), sysfs load는 0~1000. 읽지 못하면 -1
+int read_gpu_load(void) {
+    static const char* paths[] = {
+        "/sys/devices/gpu.0/load",                          // Nano, Xavier
+        "/sys/devices/platform/gpu.0/load",
+        "/sys/devices/platform/17000000.ga10b/load",        // Orin
+        NULL
+    };
+    int load;
+    for (int i = 0; paths[i]; i++) {
+        if (read_sysfs_int(paths[i], &load)) {
+            return load / 10;
+        }
+    }
+    return -1;
+}
+
+// 보드 입력 전력 (mW), INA3221 첫 채널. 읽지 못하면 -1
+int read_power_mw(void) {
+    glob_t g;
+    int value = -1;
+
+    // Nano, Xavier: iio in_power0_input (mW)
+    if (glob("/sys/bus/i2c/drivers/ina3221x/*/iio:device*/in_power0_input", 0, NULL, &g) == 0) {
+        if (!read_sysfs_int(g.gl_pathv[0], &value)) {
+            value = -1;
+        }
+        globfree(&g);
+        return value;
+    }
+
+    // Orin: hwmon in1_input (mV) x curr1_input (mA)
+    if (glob("/sys/bus/i2c/drivers/ina3221/*/hwmon/hwmon*/in1_input", 0, NULL, &g) == 0) {
+        char path[256];
+        int mv, ma;
+        snprintf(path, sizeof(path), "%s", g.gl_pathv[0]);
+        globfree(&g);
+        if (read_sysfs_int(path, &mv)) {
+            strcpy(strrchr(path, '/'), "/curr1_input");
+            if (read_sysfs_int(path, &ma)) {
+                value = (int)((long)mv * ma / 1000);
+            }
+        }
+    }
+    return value;
+}
+
 // JSON 형태로 변환
 char* tegrastats_to_json(TegrastatsInfo* info) {
     static char json_buffer[2048];
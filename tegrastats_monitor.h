@@ -23,5 +23,7 @@ typedef struct {
 gboolean parse_tegrastats_line(const char* line, TegrastatsInfo* info);
 TegrastatsInfo* get_tegrastats_info();
 char* tegrastats_to_json(TegrastatsInfo* info);
+int read_gpu_load(void);
+int read_power_mw(void);
 
 #endif
\ No newline at end of file
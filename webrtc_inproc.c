@@ -0,0 +1,421 @@
+// in-process WebRTC 모드
+// 피어가 들어오면 인코더 tee 요청 패드에 queue ! capsfilter ! webrtcbin 을 붙이고,
+// SDP/ICE는 webrtc_sender 소켓을 거치지 않고 on_server_message()에서 바로 넘겨받는다.
+#include <string.h>
+#include <gst/gst.h>
+#include <gst/sdp/sdp.h>
+#define GST_USE_UNSTABLE_API
+#include <gst/webrtc/webrtc.h>
+#include <json-glib/json-glib.h>
+
+#include "gstream_main.h"
+#include "webrtc_inproc.h"
+#define USE_JSON_MESSAGE_TEMPLATE
+#include "json_utils.h"
+#include "log_wrapper.h"
+#include "ice_batch.h"
+
+#define INPROC_STUN_SERVER      "stun://stun.l.google.com:19302"
+#define INPROC_RTP_CAPS         "application/x-rtp,media=video,encoding-name=H264,payload=96,clock-rate=90000"
+#define INPROC_QUEUE_SIZE       200     // 느린 피어는 오래된 RTP 패킷부터 버린다
+
+extern GstElement *g_pipeline;
+extern WebRTCConfig g_config;
+
+typedef struct {
+    gchar *peer_id;
+    gchar *tee_name;
+    GstElement *tee;
+    GstPad *tee_pad;
+    GstElement *queue;
+    GstElement *capsfilter;
+    GstElement *webrtc;
+    gint64 join_time;       // 접속 시각 (us), offer까지 걸린 시간 로그용
+    gboolean fast_started;  // rtp/rtcp transport마다 key-set이 올 수 있어 한 번만
+    IceBatch *ice_batch;    // webrtc_ice_batch_ms > 0 일 때 후보를 모아 보낸다 (아니면 NULL)
+} InprocPeer;
+
+// 추가/삭제는 메인 루프, promise 콜백은 webrtcbin 스레드에서 조회하므로 잠금
+static GList *g_inproc_peers = NULL;
+static GMutex g_inproc_lock;
+
+static InprocPeer *find_inproc_peer(const gchar *peer_id) {
+    for (GList *l = g_inproc_peers; l; l = l->next) {
+        InprocPeer *peer = (InprocPeer *)l->data;
+        if (strcmp(peer->peer_id, peer_id) == 0) {
+            return peer;
+        }
+    }
+    return NULL;
+}
+
+// 피어의 webrtcbin 참조를 얻는다 (없으면 NULL, 호출한 쪽에서 unref)
+static GstElement *get_inproc_webrtc(const gchar *peer_id) {
+    GstElement *webrtc = NULL;
+    g_mutex_lock(&g_inproc_lock);
+    InprocPeer *peer = find_inproc_peer(peer_id);
+    if (peer) {
+        webrtc = gst_object_ref(peer->webrtc);
+    }
+    g_mutex_unlock(&g_inproc_lock);
+    return webrtc;
+}
+
+static gchar *get_string_from_json_object(JsonObject *object) {
+    JsonNode *root = json_node_init_object(json_node_alloc(), object);
+    JsonGenerator *generator = json_generator_new();
+    json_generator_set_root(generator, root);
+    gchar *text = json_generator_to_data(generator, NULL);
+
+    g_object_unref(generator);
+    json_node_free(root);
+    return text;
+}
+
+static void send_inproc_peer_msg(const gchar *action, const gchar *peer_id, const gchar *key, const gchar *value) {
+    gchar *msg = g_strdup_printf(json_msssage_template, action, peer_id, key, value);
+    send_msg_server(msg);
+    g_free(msg);
+}
+
+static void send_inproc_peer_sdp(GstWebRTCSessionDescription *desc, const gchar *peer_id) {
+    const gchar *sdptype = desc->type == GST_WEBRTC_SDP_TYPE_OFFER ? "offer" : "answer";
+    gchar *text = gst_sdp_message_as_text(desc->sdp);
+
+    JsonObject *sdp = json_object_new();
+    json_object_set_string_member(sdp, "type", sdptype);
+    json_object_set_string_member(sdp, "sdp", text);
+    g_free(text);
+
+    gchar *sdptext = get_string_from_json_object(sdp);
+    json_object_unref(sdp);
+
+    send_inproc_peer_msg(sdptype, peer_id, "sdp", sdptext);
+    g_free(sdptext);
+}
+
+// user_data는 ice_batch가 가진 peer_id 사본 (피어가 먼저 정리되어도 유효)
+static void send_inproc_ice_batch(const gchar *ice_array, guint count, gboolean end, gpointer user_data) {
+    const gchar *peer_id = (const gchar *)user_data;
+    glog_trace("[%s] inproc send %u ICE candidates%s\n", peer_id, count, end ? " (end-of-candidates)" : "");
+    send_inproc_peer_msg("candidates", peer_id, "ice", ice_array);
+}
+
+static void on_inproc_ice_candidate(GstElement *webrtc, guint mlineindex, gchar *candidate, InprocPeer *peer) {
+    if (peer->ice_batch) {
+        ice_batch_add(peer->ice_batch, mlineindex, candidate);
+        return;
+    }
+
+    JsonObject *ice = json_object_new();
+    json_object_set_string_member(ice, "candidate", candidate);
+    json_object_set_int_member(ice, "sdpMLineIndex", mlineindex);
+    gchar *text = get_string_from_json_object(ice);
+    json_object_unref(ice);
+
+    send_inproc_peer_msg("candidate", peer->peer_id, "ice", text);
+    g_free(text);
+}
+
+// create-offer / create-answer 결과를 local description으로 설정하고 서버에 보낸다
+static void on_inproc_sdp_created(GstPromise *promise, gchar *peer_id) {
+    if (gst_promise_wait(promise) != GST_PROMISE_RESULT_REPLIED) {
+        glog_error("[%s] inproc sdp create fail\n", peer_id);
+        gst_promise_unref(promise);
+        return;
+    }
+
+    GstWebRTCSessionDescription *desc = NULL;
+    const GstStructure *reply = gst_promise_get_reply(promise);
+    if (!gst_structure_get(reply, "offer", GST_TYPE_WEBRTC_SESSION_DESCRIPTION, &desc, NULL)) {
+        gst_structure_get(reply, "answer", GST_TYPE_WEBRTC_SESSION_DESCRIPTION, &desc, NULL);
+    }
+    gst_promise_unref(promise);
+
+    GstElement *webrtc = get_inproc_webrtc(peer_id);
+    if (!desc || !webrtc) {
+        // 응답 전에 피어가 나갔다
+        if (desc) {
+            gst_webrtc_session_description_free(desc);
+        }
+        if (webrtc) {
+            gst_object_unref(webrtc);
+        }
+        return;
+    }
+
+    promise = gst_promise_new();
+    g_signal_emit_by_name(webrtc, "set-local-description", desc, promise);
+    gst_promise_interrupt(promise);
+    gst_promise_unref(promise);
+
+    send_inproc_peer_sdp(desc, peer_id);
+    gst_webrtc_session_description_free(desc);
+    gst_object_unref(webrtc);
+}
+
+static void on_inproc_negotiation_needed(GstElement *webrtc, InprocPeer *peer) {
+    glog_trace("[%s] inproc offer, %ld ms after join\n", peer->peer_id,
+               (long)((g_get_monotonic_time() - peer->join_time) / 1000));
+
+    GstPromise *promise = gst_promise_new_with_change_func(
+        (GstPromiseChangeFunc)on_inproc_sdp_created, g_strdup(peer->peer_id), g_free);
+    g_signal_emit_by_name(webrtc, "create-offer", NULL, promise);
+}
+
+static void on_inproc_ice_gathering_state_notify(GstElement *webrtc, GParamSpec *pspec, InprocPeer *peer) {
+    GstWebRTCICEGatheringState state;
+    g_object_get(webrtc, "ice-gathering-state", &state, NULL);
+    if (state == GST_WEBRTC_ICE_GATHERING_STATE_COMPLETE) {
+        glog_trace("[%s] inproc ICE gathering complete, %ld ms after join\n", peer->peer_id,
+                   (long)((g_get_monotonic_time() - peer->join_time) / 1000));
+        if (peer->ice_batch) {
+            ice_batch_end(peer->ice_batch);
+        }
+    }
+}
+
+// 브라우저 PLI/FIR (upstream GstForceKeyUnit)이 tee를 지나 인코더로 바로 가지 않도록 잡아서
+// 피어 요청을 합쳐 보내는 request_encoder_key_unit으로 넘긴다
+static GstPadProbeReturn on_inproc_key_unit_event(GstPad *pad, GstPadProbeInfo *info, InprocPeer *peer) {
+    if (!gst_event_has_name(GST_PAD_PROBE_INFO_EVENT(info), "GstForceKeyUnit")) {
+        return GST_PAD_PROBE_OK;
+    }
+    request_encoder_key_unit(peer->tee_name);
+    return GST_PAD_PROBE_DROP;
+}
+
+// SRTP 키가 정해지면 (DTLS 완료) 최근 GOP를 먼저 보내고 live로 이어 준다
+static void on_inproc_dtls_key_set(GstElement *dtlssrtpenc, InprocPeer *peer) {
+    if (!g_atomic_int_compare_and_exchange(&peer->fast_started, FALSE, TRUE)) {
+        return;
+    }
+    glog_trace("[%s] inproc dtls connected, %ld ms after join\n", peer->peer_id,
+               (long)((g_get_monotonic_time() - peer->join_time) / 1000));
+    fast_start_branch(peer->tee_pad);
+}
+
+static void on_inproc_deep_element_added(GstBin *bin, GstBin *sub_bin, GstElement *element, InprocPeer *peer) {
+    GstElementFactory *factory = gst_element_get_factory(element);
+    if (factory && strcmp(GST_OBJECT_NAME(factory), "dtlssrtpenc") == 0) {
+        g_signal_connect(element, "on-key-set", G_CALLBACK(on_inproc_dtls_key_set), peer);
+    }
+}
+
+static void free_inproc_peer(InprocPeer *peer) {
+    gst_element_set_state(peer->webrtc, GST_STATE_NULL);
+    gst_element_set_state(peer->capsfilter, GST_STATE_NULL);
+    gst_element_set_state(peer->queue, GST_STATE_NULL);
+    gst_bin_remove_many(GST_BIN(g_pipeline), peer->queue, peer->capsfilter, peer->webrtc, NULL);
+    ice_batch_free(peer->ice_batch);
+
+    gst_element_release_request_pad(peer->tee, peer->tee_pad);
+    gst_object_unref(peer->tee_pad);
+    gst_object_unref(peer->tee);
+
+    g_free(peer->peer_id);
+    g_free(peer->tee_name);
+    g_free(peer);
+}
+
+gboolean inproc_add_peer(const gchar *peer_id, const gchar *tee_name) {
+    g_mutex_lock(&g_inproc_lock);
+    gboolean exist = find_inproc_peer(peer_id) != NULL;
+    g_mutex_unlock(&g_inproc_lock);
+    if (exist) {
+        glog_error("inproc_add_peer exist peer [%s]\n", peer_id);
+        return FALSE;
+    }
+
+    GstElement *tee = gst_bin_get_by_name(GST_BIN(g_pipeline), tee_name);
+    if (!tee) {
+        glog_error("inproc_add_peer can not find %s\n", tee_name);
+        return FALSE;
+    }
+    GstElement *webrtc = gst_element_factory_make("webrtcbin", NULL);
+    if (!webrtc) {
+        glog_error("inproc_add_peer can not create webrtcbin\n");
+        gst_object_unref(tee);
+        return FALSE;
+    }
+
+    InprocPeer *peer = g_new0(InprocPeer, 1);
+    peer->peer_id = g_strdup(peer_id);
+    peer->tee_name = g_strdup(tee_name);
+    peer->tee = tee;
+    peer->webrtc = webrtc;
+    peer->join_time = g_get_monotonic_time();
+    if (g_config.webrtc_ice_batch_ms > 0) {
+        peer->ice_batch = ice_batch_new(g_config.webrtc_ice_batch_ms, g_config.webrtc_ice_batch_max,
+                                        send_inproc_ice_batch, g_strdup(peer_id), g_free);
+    }
+
+    peer->queue = gst_element_factory_make("queue", NULL);
+    g_object_set(peer->queue, "leaky", 2, "max-size-buffers", INPROC_QUEUE_SIZE,
+                 "max-size-bytes", 0, "max-size-time", (guint64)0, NULL);
+
+    peer->capsfilter = gst_element_factory_make("capsfilter", NULL);
+    GstCaps *caps = gst_caps_from_string(INPROC_RTP_CAPS);
+    g_object_set(peer->capsfilter, "caps", caps, NULL);
+    gst_caps_unref(caps);
+
+    g_object_set(webrtc, "stun-server", INPROC_STUN_SERVER, NULL);
+    g_signal_connect(webrtc, "on-negotiation-needed", G_CALLBACK(on_inproc_negotiation_needed), peer);
+    g_signal_connect(webrtc, "on-ice-candidate", G_CALLBACK(on_inproc_ice_candidate), peer);
+    g_signal_connect(webrtc, "notify::ice-gathering-state", G_CALLBACK(on_inproc_ice_gathering_state_notify), peer);
+    g_signal_connect(webrtc, "deep-element-added", G_CALLBACK(on_inproc_deep_element_added), peer);
+
+    gst_bin_add_many(GST_BIN(g_pipeline), peer->queue, peer->capsfilter, webrtc, NULL);
+    gst_element_link(peer->queue, peer->capsfilter);
+
+    GstPad *caps_pad = gst_element_get_static_pad(peer->capsfilter, "src");
+    GstPad *webrtc_pad = gst_element_get_request_pad(webrtc, "sink_%u");
+    gst_pad_link(caps_pad, webrtc_pad);
+    gst_pad_add_probe(caps_pad, GST_PAD_PROBE_TYPE_EVENT_UPSTREAM,
+                      (GstPadProbeCallback)on_inproc_key_unit_event, peer, NULL);
+    gst_object_unref(caps_pad);
+    gst_object_unref(webrtc_pad);
+
+    gst_element_sync_state_with_parent(webrtc);
+    gst_element_sync_state_with_parent(peer->capsfilter);
+    gst_element_sync_state_with_parent(peer->queue);
+
+    // egress 브랜치와 같이 하위 요소가 준비된 뒤 tee에 연결
+    peer->tee_pad = gst_element_get_request_pad(tee, "src_%u");
+    GstPad *queue_pad = gst_element_get_static_pad(peer->queue, "sink");
+    GstPadLinkReturn ret = gst_pad_link(peer->tee_pad, queue_pad);
+    gst_object_unref(queue_pad);
+
+    if (ret != GST_PAD_LINK_OK) {
+        glog_error("inproc_add_peer link fail %s -> [%s] (%d)\n", tee_name, peer_id, ret);
+        g_signal_handlers_disconnect_by_data(webrtc, peer);
+        free_inproc_peer(peer);
+        return FALSE;
+    }
+
+    g_mutex_lock(&g_inproc_lock);
+    g_inproc_peers = g_list_prepend(g_inproc_peers, peer);
+    g_mutex_unlock(&g_inproc_lock);
+    subscribe_encoder(tee_name);
+
+    glog_trace("inproc peer attached [%s] <- %s\n", peer_id, tee_name);
+    return TRUE;
+}
+
+// 떼어낸 브랜치의 상태 변경/제거와 tee 패드 반납은 메인 루프에서 한다.
+// probe는 보통 tee 스트리밍 스레드에서 불리고, 거기서 webrtcbin을 NULL로 내리면
+// nice/DTLS/SRTP 스레드와 교착될 수 있다
+static gboolean free_inproc_peer_idle(gpointer user_data) {
+    free_inproc_peer((InprocPeer *)user_data);
+    return G_SOURCE_REMOVE;
+}
+
+// tee 패드에 데이터가 흐르지 않는 시점에 피어 브랜치를 떼어낸다 (unlink만)
+static GstPadProbeReturn remove_inproc_peer_cb(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    InprocPeer *peer = (InprocPeer *)user_data;
+
+    GstPad *queue_pad = gst_element_get_static_pad(peer->queue, "sink");
+    gst_pad_unlink(peer->tee_pad, queue_pad);
+    gst_object_unref(queue_pad);
+
+    glog_trace("inproc peer detached [%s] <- %s\n", peer->peer_id, peer->tee_name);
+    g_idle_add(free_inproc_peer_idle, peer);
+    return GST_PAD_PROBE_REMOVE;
+}
+
+void inproc_remove_peer(const gchar *peer_id) {
+    g_mutex_lock(&g_inproc_lock);
+    InprocPeer *peer = find_inproc_peer(peer_id);
+    if (peer) {
+        g_inproc_peers = g_list_remove(g_inproc_peers, peer);
+    }
+    g_mutex_unlock(&g_inproc_lock);
+
+    if (!peer) {
+        glog_error("inproc_remove_peer can not find peer [%s]\n", peer_id);
+        return;
+    }
+
+    unsubscribe_encoder(peer->tee_name);
+    g_signal_handlers_disconnect_by_data(peer->webrtc, peer);
+    gst_pad_add_probe(peer->tee_pad, GST_PAD_PROBE_TYPE_IDLE, remove_inproc_peer_cb, peer, NULL);
+}
+
+static gboolean set_inproc_remote_sdp(GstElement *webrtc, const gchar *peer_id, const gchar *sdp_type, const gchar *text) {
+    GstSDPMessage *sdp;
+    if (gst_sdp_message_new(&sdp) != GST_SDP_OK) {
+        return FALSE;
+    }
+    if (gst_sdp_message_parse_buffer((guint8 *)text, strlen(text), sdp) != GST_SDP_OK) {
+        glog_error("[%s] inproc invalid sdp %s\n", peer_id, sdp_type);
+        gst_sdp_message_free(sdp);
+        return FALSE;
+    }
+
+    gboolean is_offer = g_strcmp0(sdp_type, "offer") == 0;
+    GstWebRTCSessionDescription *desc = gst_webrtc_session_description_new(
+        is_offer ? GST_WEBRTC_SDP_TYPE_OFFER : GST_WEBRTC_SDP_TYPE_ANSWER, sdp);
+
+    GstPromise *promise = gst_promise_new();
+    g_signal_emit_by_name(webrtc, "set-remote-description", desc, promise);
+    gst_promise_interrupt(promise);
+    gst_promise_unref(promise);
+    gst_webrtc_session_description_free(desc);
+
+    // 브라우저가 먼저 offer를 보낸 경우 answer로 응답
+    if (is_offer) {
+        promise = gst_promise_new_with_change_func(
+            (GstPromiseChangeFunc)on_inproc_sdp_created, g_strdup(peer_id), g_free);
+        g_signal_emit_by_name(webrtc, "create-answer", NULL, promise);
+    }
+    return TRUE;
+}
+
+// 빈 candidate는 상대의 end-of-candidates, webrtcbin에도 빈 후보로 넘긴다 (add_remote_ice_candidate와 같음)
+static void add_inproc_remote_candidate(guint mlineindex, const gchar *candidate, gpointer user_data) {
+    GstElement *webrtc = (GstElement *)user_data;
+    if (!candidate || candidate[0] == '\0') {
+        glog_trace("inproc remote end-of-candidates\n");
+        candidate = "";
+    }
+    g_signal_emit_by_name(webrtc, "add-ice-candidate", mlineindex, candidate);
+}
+
+// on_server_message()의 answer/candidate(s) 메시지 ({peer_id, sdp:{...}} 또는 {peer_id, ice:{...} 또는 [...]})
+gboolean inproc_handle_peer_message(const gchar *peer_id, const gchar *msg) {
+    GstElement *webrtc = get_inproc_webrtc(peer_id);
+    if (!webrtc) {
+        glog_error("inproc_handle_peer_message can not find peer [%s]\n", peer_id);
+        return FALSE;
+    }
+
+    gboolean result = FALSE;
+    JsonParser *parser = json_parser_new();
+    if (!json_parser_load_from_data(parser, msg, -1, NULL) ||
+        !JSON_NODE_HOLDS_OBJECT(json_parser_get_root(parser))) {
+        glog_error("[%s] inproc unknown message '%s', ignoring\n", peer_id, msg);
+        goto out;
+    }
+
+    JsonObject *object = json_node_get_object(json_parser_get_root(parser));
+    if (json_object_has_member(object, "sdp")) {
+        JsonObject *child = json_object_get_object_member(object, "sdp");
+        const gchar *sdp_type = json_object_get_string_member(child, "type");
+        const gchar *text = json_object_get_string_member(child, "sdp");
+        if (g_strcmp0(sdp_type, "offer") != 0 && g_strcmp0(sdp_type, "answer") != 0) {
+            glog_error("[%s] inproc invalid sdp type\n", peer_id);
+            goto out;
+        }
+        result = text && set_inproc_remote_sdp(webrtc, peer_id, sdp_type, text);
+    } else if (json_object_has_member(object, "ice")) {
+        ice_candidates_foreach(json_object_get_member(object, "ice"), add_inproc_remote_candidate, webrtc);
+        result = TRUE;
+    } else {
+        glog_error("[%s] inproc ignoring unknown message '%s'\n", peer_id, msg);
+    }
+
+out:
+    g_object_unref(parser);
+    gst_object_unref(webrtc);
+    return result;
+}
@@ -0,0 +1,11 @@
+#ifndef __WEBRTC_INPROC_H__
+#define __WEBRTC_INPROC_H__
+
+#include <gst/gst.h>
+
+// in-process 모드 (config webrtc_inproc): webrtc_sender 대신 gstream_main 파이프라인에 피어별 webrtcbin을 붙임
+gboolean  inproc_add_peer(const gchar *peer_id, const gchar *tee_name);
+void      inproc_remove_peer(const gchar *peer_id);
+gboolean  inproc_handle_peer_message(const gchar *peer_id, const gchar *msg);
+
+#endif	// __WEBRTC_INPROC_H__
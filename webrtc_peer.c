@@ -2,25 +2,67 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <glib/gstdio.h>
 #include "gstream_main.h"
 #include "webrtc_peer.h"
 #include "config.h"
 #include "process_cmd.h"
+#include "webrtc_inproc.h"
+#include "ice_batch.h"
 
 extern WebRTCConfig g_config;
 
+#define SENDER_START_TIMEOUT_SEC  20     // sender 실행 후 CONNECT까지 기다리는 시간
+#define SENDER_STOP_TIMEOUT_SEC   5      // STOP_WEBRTC 후 종료하지 않으면 SIGKILL
+#define PEER_PENDING_MSG_MAX      64     // sender가 뜨기 전에 쌓아 두는 서버 메시지 수
+#define DTLS_CERT_NAME            "dtls_cert.pem"   // sender 공용 DTLS 인증서 + 키 (g_dtls_cert_dir 안)
+
+// 슬롯 상태. 전환은 모두 메인 루프에서 일어난다 (child watch, CONNECT, timeout)
+typedef enum
+{
+  PEER_FREE = 0,
+  PEER_STARTING,                  // sender 실행 후 CONNECT 대기
+  PEER_PARKED,                    // warm sender, 피어 배정 대기
+  PEER_ACTIVE,                    // 피어에 송출 중
+  PEER_STOPPING,                  // STOP_WEBRTC 보낸 뒤 종료 대기
+}PeerState;
+
 typedef struct 
 {
   gchar*         peer_id;
   SOCKETINFO*    socket;
   pid_t          child_pid; 
+  PeerState      state;
+  guint          timeout_id;      // 시작/종료 대기 타이머
+  int            egress_port;     // 이 피어를 위해 열어둔 UDP 송출 포트 (0 이면 없음)
+  gchar*         shm_tee;         // 공유 메모리로 읽는 인코더 tee (NULL 이면 없음)
+  gchar*         tee_name;        // 송출 중인 인코더 tee
+  gchar*         low_tee_name;    // 혼잡 시 sender가 전환할 한 단계 아래 tee (NULL 이면 없음)
+  int            low_port;        // 저화질 UDP 송출에 쓸 포트
+  int            low_egress_port; // 저화질 송출은 sender가 LOW_RUNG:1로 요청한 동안만 붙어 있다
+  gchar*         low_shm_tee;
+  gboolean       inproc;          // webrtc_sender 없이 gstream_main 안의 webrtcbin으로 송출
+  gint64         join_time;       // 접속 시각 (us), 첫 프레임까지 걸린 시간 로그용
+  IceBatch*      ice_batch;       // 서버에서 온 후보를 모아 sender로 넘긴다 (webrtc_ice_batch_ms > 0)
+  GPtrArray*     pending_msgs;    // sender CONNECT 전에 온 서버 메시지, on_sender_ready에서 보낸다
 }PeerInfo;
 
 static int g_MaxPeerCnt = 0;
 static PeerInfo* g_PeerInfos = NULL;
 static int g_device_cnt, g_stream_base_port, g_comm_socket_port;
 static char g_codec_name[16]; 
+static gboolean g_dtls_cert_ready = FALSE;
+static guint g_dtls_cert_timer = 0;
+static GPid g_dtls_cert_pid = 0;         // 인증서를 만드는 중인 openssl (0 이면 없음)
+static gchar *g_dtls_cert_dir = NULL;    // g_dir_make_tmp로 만든 0700 디렉터리, 종료할 때까지 유지
+static gchar *g_dtls_cert_path = NULL;
+static gchar *g_dtls_cert_arg = NULL;    // sender에 넘기는 --dtls_cert=<path>
+static gint64 g_dtls_cert_start = 0;
+static char g_ice_batch_args[2][32];    // sender에 넘기는 --ice_batch_ms, --ice_batch_max
 
 int   find_peer_index(const gchar * peer_id)
 {
@@ -37,14 +79,451 @@ int   find_peer_index(const gchar * peer_id)
 }
 
 
+// 송출 브랜치 목록은 메인 루프에서만 만지므로 소켓 스레드에서 넘겨받아 처리한다
+static gboolean on_sender_fast_start(gpointer user_data)
+{
+  int peer_idx = GPOINTER_TO_INT(user_data) / 2;
+  int low = GPOINTER_TO_INT(user_data) % 2;
+  PeerInfo *peer = &g_PeerInfos[peer_idx];
+  const gchar *tee_name = low ? peer->low_tee_name : peer->tee_name;
+  int port = low ? peer->low_egress_port : peer->egress_port;
+
+  if(peer->state != PEER_ACTIVE || tee_name == NULL)
+    return G_SOURCE_REMOVE;
+
+  glog_trace("[%s] dtls connected %ld ms after join\n", peer->peer_id ? peer->peer_id : "",
+             (long)((g_get_monotonic_time() - peer->join_time) / 1000));
+  // 캐시로 채울 수 없으면(송출 없음, 여러 피어가 같이 읽는 shm) IDR 요청으로 대신
+  if(!fast_start_egress(tee_name, port))
+    request_encoder_key_unit(tee_name);
+  return G_SOURCE_REMOVE;
+}
+
+// 피어의 tee 이름은 release_peer가 메인 루프에서 해제하므로 IDR 요청도 메인 루프에서
+static gboolean on_sender_key_unit(gpointer user_data)
+{
+  PeerInfo *peer = &g_PeerInfos[GPOINTER_TO_INT(user_data) / 2];
+  const gchar *tee_name = GPOINTER_TO_INT(user_data) % 2 ? peer->low_tee_name : peer->tee_name;
+
+  if(peer->state == PEER_ACTIVE && tee_name != NULL)
+    request_encoder_key_unit(tee_name);
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean on_sender_low_rung(gpointer user_data);
+
 void  notify_webrtc_instance(char *data , int len, void* arg)
 {
-  //PeerInfo *peer_info = (PeerInfo *) arg;
-  //gst_print("notify_webrtc_instance [%d][%s] \n", peer_info->peer_id, data);
+  SOCKETINFO *socket = (SOCKETINFO *) arg;
+  PeerInfo *peer_info = (PeerInfo *) socket->data;
+
+  // sender가 ICE 연결 후 첫 프레임을 보냈다는 알림, 서버로는 전달하지 않음
+  if(strcmp(data, "FIRST_FRAME") == 0){
+    glog_trace("[%s] join to first frame %ld ms\n", peer_info->peer_id ? peer_info->peer_id : "",
+               (long)((g_get_monotonic_time() - peer_info->join_time) / 1000));
+    return;
+  }
+  // DTLS가 끝난 sender를 GOP 캐시로 먼저 채운다 (FAST_START:0 고화질, FAST_START:1 저화질)
+  if(strncmp(data, "FAST_START:", 11) == 0){
+    int low = atoi(data + 11) ? 1 : 0;
+    g_idle_add(on_sender_fast_start, GINT_TO_POINTER((int)(peer_info - g_PeerInfos) * 2 + low));
+    return;
+  }
+  // sender의 IDR 요청: 브라우저 PLI/FIR, 화질 전환 (KEY_UNIT:0 고화질, KEY_UNIT:1 저화질)
+  // 여러 피어의 요청은 request_encoder_key_unit에서 인코더별로 합쳐진다
+  if(strncmp(data, "KEY_UNIT:", 9) == 0){
+    int low = atoi(data + 9) ? 1 : 0;
+    g_idle_add(on_sender_key_unit, GINT_TO_POINTER((int)(peer_info - g_PeerInfos) * 2 + low));
+    return;
+  }
+  // 화질 전환용 저화질 송출 요청 (LOW_RUNG:1 붙임, LOW_RUNG:0 뗌)
+  if(strncmp(data, "LOW_RUNG:", 9) == 0){
+    int attach = atoi(data + 9) ? 1 : 0;
+    g_idle_add(on_sender_low_rung, GINT_TO_POINTER((int)(peer_info - g_PeerInfos) * 2 + attach));
+    return;
+  }
   send_msg_server(data);
 }
 
 
+static void clear_peer_timeout(PeerInfo *peer)
+{
+  if(peer->timeout_id){
+    g_source_remove(peer->timeout_id);
+    peer->timeout_id = 0;
+  }
+}
+
+// 인코더 tee에 피어용 송출 브랜치를 붙인다
+// 공유 메모리를 우선 쓰고(shm_path에 경로), shm 플러그인이 없으면 UDP
+static void attach_peer_egress(const gchar *tee_name, int port, int *egress_port, gchar **shm_tee,
+                               char *shm_path, size_t len)
+{
+  if(attach_shm_egress(tee_name)){
+    *shm_tee = g_strdup(tee_name);
+    shm_egress_path(tee_name, shm_path, len);
+  } else if(attach_udp_egress(tee_name, port)){
+    *egress_port = port;
+  }
+}
+
+static void detach_peer_egress(int *egress_port, gchar **shm_tee)
+{
+  if(*egress_port != 0){
+    detach_udp_egress(*egress_port);
+    *egress_port = 0;
+  }
+  if(*shm_tee != NULL){
+    detach_shm_egress(*shm_tee);
+    g_free(*shm_tee);
+    *shm_tee = NULL;
+  }
+}
+
+// sender가 저화질로 내려갈 때만 한 단계 아래 tee에 송출을 붙이고 돌아오면 뗀다
+// 붙인 결과는 "LOW_RUNG:<port>:<shm_path>"로 돌려준다 (둘 다 비어 있으면 실패)
+static gboolean on_sender_low_rung(gpointer user_data)
+{
+  PeerInfo *peer = &g_PeerInfos[GPOINTER_TO_INT(user_data) / 2];
+  gboolean attach = GPOINTER_TO_INT(user_data) % 2;
+  char shm_path[128] = {0,};
+  char msg[160];
+
+  if(peer->state != PEER_ACTIVE || peer->low_tee_name == NULL)
+    return G_SOURCE_REMOVE;
+
+  if(!attach){
+    detach_peer_egress(&peer->low_egress_port, &peer->low_shm_tee);
+    glog_trace("[%s] low rung detached [%s]\n", peer->peer_id ? peer->peer_id : "", peer->low_tee_name);
+    return G_SOURCE_REMOVE;
+  }
+
+  if(peer->low_egress_port == 0 && peer->low_shm_tee == NULL)
+    attach_peer_egress(peer->low_tee_name, peer->low_port, &peer->low_egress_port, &peer->low_shm_tee,
+                       shm_path, sizeof(shm_path));
+  else if(peer->low_shm_tee != NULL)
+    shm_egress_path(peer->low_shm_tee, shm_path, sizeof(shm_path));
+  glog_trace("[%s] low rung attached [%s] port[%d] shm_path[%s]\n", peer->peer_id ? peer->peer_id : "",
+             peer->low_tee_name, peer->low_egress_port, shm_path);
+
+  snprintf(msg, sizeof(msg), "LOW_RUNG:%d:%s", peer->low_egress_port, shm_path);
+  send_data_socket_comm(peer->socket, msg, strlen(msg), 0);
+  return G_SOURCE_REMOVE;
+}
+
+// 피어에 붙어 있던 송출 브랜치와 peer_id를 정리한다 (sender 프로세스는 그대로)
+static void release_peer(int peer_idx)
+{
+  PeerInfo *peer = &g_PeerInfos[peer_idx];
+
+  // 보는 사람이 없으면 인코더 tee에서 송출 브랜치를 뗀다
+  detach_peer_egress(&peer->egress_port, &peer->shm_tee);
+  detach_peer_egress(&peer->low_egress_port, &peer->low_shm_tee);
+  g_free(peer->tee_name);
+  peer->tee_name = NULL;
+  g_free(peer->low_tee_name);
+  peer->low_tee_name = NULL;
+  peer->low_port = 0;
+  ice_batch_free(peer->ice_batch);
+  peer->ice_batch = NULL;
+  g_ptr_array_set_size(peer->pending_msgs, 0);
+  if(peer->peer_id != NULL){
+    free(peer->peer_id);
+    peer->peer_id = 0;
+  }
+  peer->inproc = FALSE;
+}
+
+static gboolean refill_warm_pool(gpointer user_data);
+
+static void on_sender_exit(GPid pid, gint status, gpointer user_data)
+{
+  int peer_idx = GPOINTER_TO_INT(user_data);
+  PeerInfo *peer = &g_PeerInfos[peer_idx];
+
+  g_spawn_close_pid(pid);
+  if(peer->child_pid != pid)
+    return;
+
+  if(peer->state != PEER_STOPPING){
+    glog_error("webrtc_sender exit unexpectedly peer_idx[%d] pid[%d] [%s] status[%d]\n",
+               peer_idx, pid, peer->peer_id ? peer->peer_id : "", status);
+  }
+  glog_trace("webrtc_sender exit peer_idx[%d] pid[%d] status[%d]\n", peer_idx, pid, status);
+
+  clear_peer_timeout(peer);
+  release_peer(peer_idx);
+  peer->child_pid = 0;
+  peer->socket->connect = 0;
+  peer->state = PEER_FREE;
+
+  // 실행 직후 죽는 경우 바로 다시 띄우지 않도록 잠시 뒤에 채운다
+  g_timeout_add_seconds(1, refill_warm_pool, NULL);
+}
+
+static gboolean on_sender_stop_timeout(gpointer user_data)
+{
+  int peer_idx = GPOINTER_TO_INT(user_data);
+  PeerInfo *peer = &g_PeerInfos[peer_idx];
+
+  peer->timeout_id = 0;
+  glog_error("webrtc_sender stop timeout, kill peer_idx[%d] pid[%d]\n", peer_idx, peer->child_pid);
+  kill(peer->child_pid, SIGKILL);
+  return G_SOURCE_REMOVE;
+}
+
+// 종료를 요청만 하고 돌아온다. 실제 정리는 on_sender_exit
+static void stop_sender(int peer_idx)
+{
+  PeerInfo *peer = &g_PeerInfos[peer_idx];
+  if(peer->child_pid == 0 || peer->state == PEER_STOPPING)
+    return;
+
+  if(peer->socket->connect){
+    char msg[32] = "STOP_WEBRTC";
+    send_data_socket_comm(peer->socket, msg, strlen(msg), 0);
+  } else {
+    kill(peer->child_pid, SIGTERM);
+  }
+
+  peer->state = PEER_STOPPING;
+  clear_peer_timeout(peer);
+  peer->timeout_id = g_timeout_add_seconds(SENDER_STOP_TIMEOUT_SEC, on_sender_stop_timeout, GINT_TO_POINTER(peer_idx));
+}
+
+static gboolean on_sender_start_timeout(gpointer user_data)
+{
+  int peer_idx = GPOINTER_TO_INT(user_data);
+  PeerInfo *peer = &g_PeerInfos[peer_idx];
+
+  peer->timeout_id = 0;
+  glog_error("Wait Client Fail peer_idx[%d] to pid[%d] [%s]\n", peer_idx, peer->child_pid,
+             peer->peer_id ? peer->peer_id : "");
+  release_peer(peer_idx);
+  stop_sender(peer_idx);
+  return G_SOURCE_REMOVE;
+}
+
+static void send_peer_message(int peer_idx, const gchar *msg);
+
+// sender의 CONNECT 처리 (메인 루프)
+static gboolean on_sender_ready(gpointer user_data)
+{
+  int peer_idx = GPOINTER_TO_INT(user_data);
+  PeerInfo *peer = &g_PeerInfos[peer_idx];
+
+  if(peer->state != PEER_STARTING)
+    return G_SOURCE_REMOVE;
+  clear_peer_timeout(peer);
+
+  if(peer->peer_id != NULL){
+    peer->state = PEER_ACTIVE;
+    glog_trace("webrtc_sender ready peer_idx[%d] pid[%d] [%s] %ld ms after join\n", peer_idx, peer->child_pid,
+               peer->peer_id, (long)((g_get_monotonic_time() - peer->join_time) / 1000));
+    // 기다리는 동안 온 answer/candidate를 받은 순서대로 넘긴다
+    for(guint i = 0 ; i < peer->pending_msgs->len ; i++)
+      send_peer_message(peer_idx, g_ptr_array_index(peer->pending_msgs, i));
+    g_ptr_array_set_size(peer->pending_msgs, 0);
+  } else {
+    peer->state = PEER_PARKED;
+    glog_trace("warm sender parked peer_idx[%d] pid[%d]\n", peer_idx, peer->child_pid);
+  }
+  return G_SOURCE_REMOVE;
+}
+
+// 소켓 스레드에서 CONNECT를 받으면 호출됨
+static void notify_webrtc_connect(void* arg)
+{
+  SOCKETINFO *socket = (SOCKETINFO *) arg;
+  PeerInfo *peer_info = (PeerInfo *) socket->data;
+  g_idle_add(on_sender_ready, GINT_TO_POINTER(peer_info - g_PeerInfos));
+}
+
+// sender를 실행하고 바로 돌아온다. CONNECT, 종료, 시간 초과는 메인 루프 이벤트로 처리
+static gboolean spawn_sender(int peer_idx, char *args[])
+{
+  PeerInfo *peer = &g_PeerInfos[peer_idx];
+  peer->socket->connect = 0;
+
+  int pid = fork();                   //LJH, 사용자의 접속에 따라 fork 가 계속 일어남.
+  if(pid == 0){
+    execvp(args[0], args);
+    _exit(1);
+  } else if(pid < 0){
+    glog_error("spawn_sender fork fail peer_idx[%d]\n", peer_idx);
+    return FALSE;
+  }
+
+  peer->child_pid = pid;
+  peer->state = PEER_STARTING;
+  g_child_watch_add(pid, on_sender_exit, GINT_TO_POINTER(peer_idx));
+  peer->timeout_id = g_timeout_add_seconds(SENDER_START_TIMEOUT_SEC, on_sender_start_timeout, GINT_TO_POINTER(peer_idx));
+  glog_trace("spawn webrtc_sender peer_idx[%d] pid[%d] [%s]\n", peer_idx, pid, peer->peer_id ? peer->peer_id : "warm");
+  return TRUE;
+}
+
+// sender가 피어마다 DTLS 키를 만들지 않도록 인증서 하나를 만들어 파일로 넘긴다.
+// ECDSA P-256이라 생성과 핸드셰이크 서명 모두 RSA 기본 인증서보다 가볍다.
+// GStreamer 1.16에서는 프로세스의 첫 dtlsdec가 여전히 자체 RSA 키를 만들므로,
+// 배정 시점의 키 생성이 빠지는 것은 대기 중에 이를 끝낸 warm sender뿐이다.
+// 교체 후 새로 배정되는 sender부터 새 인증서를 읽고, 송출 중인 세션은 그대로 유지된다.
+// 키가 들어 있는 파일은 모두 g_dtls_cert_dir(0700) 안에만 만든다.
+static gchar *dtls_cert_file(const gchar *name)
+{
+  return g_build_filename(g_dtls_cert_dir, name, NULL);
+}
+
+static void remove_dtls_cert_dir(void)
+{
+  if(!g_dtls_cert_dir)
+    return;
+  g_unlink(g_dtls_cert_path);
+  g_rmdir(g_dtls_cert_dir);
+  g_clear_pointer(&g_dtls_cert_dir, g_free);
+  g_clear_pointer(&g_dtls_cert_path, g_free);
+  g_clear_pointer(&g_dtls_cert_arg, g_free);
+  g_dtls_cert_ready = FALSE;
+}
+
+// openssl은 메인 루프를 막지 않도록 비동기로 돌리고 결과는 여기서 받는다
+static void on_dtls_cert_generated(GPid pid, gint status, gpointer user_data)
+{
+  gchar *cert_path = dtls_cert_file("new_cert.pem");
+  gchar *key_path = dtls_cert_file("new_key.pem");
+  gchar *cert = NULL, *key = NULL;
+
+  g_spawn_close_pid(pid);
+  g_dtls_cert_pid = 0;
+
+  // 생성 중에 release_webrtc_instance(bFinal)로 멈췄으면 버린다
+  if(g_dtls_cert_timer == 0)
+    goto out;
+
+  if(!WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+     !g_file_get_contents(cert_path, &cert, NULL, NULL) ||
+     !g_file_get_contents(key_path, &key, NULL, NULL)){
+    glog_error("dtls certificate generation fail [openssl status %d]\n", status);
+    goto out;
+  }
+
+  // 같은 디렉터리에 mkstemp로 새로 만들어 쓰고 rename으로 바꾼다.
+  // 읽는 쪽은 반쯤 쓴 파일을 보지 않고, 다른 사용자는 경로를 미리 만들거나 링크로 가로챌 수 없다
+  gchar *tmp_path = dtls_cert_file("dtls_cert.XXXXXX");
+  int fd = g_mkstemp(tmp_path);
+  gboolean written = fd >= 0 && fchmod(fd, 0600) == 0 &&
+                     write(fd, cert, strlen(cert)) == (ssize_t)strlen(cert) &&
+                     write(fd, key, strlen(key)) == (ssize_t)strlen(key);
+  if(fd >= 0)
+    close(fd);
+  if(written && g_rename(tmp_path, g_dtls_cert_path) == 0){
+    g_dtls_cert_ready = TRUE;
+    glog_trace("dtls certificate refreshed in %ld ms, next in %d hours\n",
+               (long)((g_get_monotonic_time() - g_dtls_cert_start) / 1000), g_config.webrtc_dtls_cert_hours);
+  } else {
+    glog_error("dtls certificate write fail [%s]\n", tmp_path);
+    if(fd >= 0)
+      g_unlink(tmp_path);
+  }
+  g_free(tmp_path);
+
+out:
+  if(key)
+    memset(key, 0, strlen(key));
+  g_unlink(cert_path);
+  g_unlink(key_path);
+  g_free(cert_path);
+  g_free(key_path);
+  g_free(cert);
+  g_free(key);
+  if(g_dtls_cert_timer == 0)
+    remove_dtls_cert_dir();
+}
+
+static gboolean refresh_dtls_certificate(gpointer user_data)
+{
+  GError *error = NULL;
+
+  // 이전 생성이 아직 안 끝났으면 이번 주기는 건너뛴다
+  if(g_dtls_cert_pid != 0)
+    return G_SOURCE_CONTINUE;
+
+  if(!g_dtls_cert_dir){
+    g_dtls_cert_dir = g_dir_make_tmp("webrtc_dtls_XXXXXX", &error);
+    if(!g_dtls_cert_dir){
+      glog_error("dtls certificate directory fail [%s]\n", error->message);
+      g_clear_error(&error);
+      return G_SOURCE_CONTINUE;
+    }
+    g_dtls_cert_path = dtls_cert_file(DTLS_CERT_NAME);
+    g_dtls_cert_arg = g_strdup_printf("--dtls_cert=%s", g_dtls_cert_path);
+  }
+
+  gchar *cert_path = dtls_cert_file("new_cert.pem");
+  gchar *key_path = dtls_cert_file("new_key.pem");
+  gchar *days = g_strdup_printf("%d", g_config.webrtc_dtls_cert_hours / 24 + 7);
+  gchar *argv[] = {"openssl", "req", "-x509", "-newkey", "ec", "-pkeyopt", "ec_paramgen_curve:prime256v1",
+                   "-nodes", "-days", days, "-subj", "/CN=webrtc_sender",
+                   "-keyout", key_path, "-out", cert_path, NULL};
+  GPid pid;
+
+  g_dtls_cert_start = g_get_monotonic_time();
+  if(g_spawn_async(NULL, argv, NULL,
+                   G_SPAWN_SEARCH_PATH | G_SPAWN_DO_NOT_REAP_CHILD |
+                   G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL,
+                   NULL, NULL, &pid, &error)){
+    g_dtls_cert_pid = pid;
+    g_child_watch_add(pid, on_dtls_cert_generated, NULL);
+  } else {
+    glog_error("dtls certificate generation fail [%s]\n", error->message);
+    g_clear_error(&error);
+  }
+  g_free(cert_path);
+  g_free(key_path);
+  g_free(days);
+  return G_SOURCE_CONTINUE;
+}
+
+// 피어 없이 webrtc_sender를 먼저 띄워둔다. 준비가 끝나면 sender가 CONNECT를 보낸다
+static void spawn_warm_sender(int peer_idx)
+{
+  char *programName = "./webrtc_sender";
+  char strtemp[2][64];
+  snprintf(strtemp[0], 64, "--comm_socket_port=%d", g_comm_socket_port + peer_idx); 
+  snprintf(strtemp[1], 64, "--codec_name=%s", "H264"); 
+  char *args[8]={programName, strtemp[0], strtemp[1], "--warm", NULL};
+  int argc = 4;
+  if(g_dtls_cert_ready)
+    args[argc++] = g_dtls_cert_arg;
+  if(g_config.webrtc_ice_batch_ms > 0){
+    args[argc++] = g_ice_batch_args[0];
+    args[argc++] = g_ice_batch_args[1];
+  }
+  spawn_sender(peer_idx, args);
+}
+
+// 대기 중인 sender가 webrtc_warm_pool 개가 되도록 빈 슬롯에 채운다
+static gboolean refill_warm_pool(gpointer user_data)
+{
+  if(g_config.webrtc_inproc || g_MaxPeerCnt == 0)
+    return G_SOURCE_REMOVE;
+
+  int warm_cnt = 0;
+  for(int i = 0 ; i < g_MaxPeerCnt ; i++){
+    if(g_PeerInfos[i].state == PEER_PARKED ||
+       (g_PeerInfos[i].state == PEER_STARTING && g_PeerInfos[i].peer_id == 0))
+      warm_cnt++;
+  }
+
+  for(int i = 0 ; i < g_MaxPeerCnt && warm_cnt < g_config.webrtc_warm_pool ; i++){
+    if(g_PeerInfos[i].state == PEER_FREE){
+      spawn_warm_sender(i);
+      warm_cnt++;
+    }
+  }
+  return G_SOURCE_REMOVE;
+}
+
+
 gboolean init_webrtc_peer(int max_peer_cnt, int device_cnt, int stream_base_port, char *codec_name, int comm_socket_port)
 {
   g_MaxPeerCnt  = max_peer_cnt;
@@ -52,15 +531,26 @@ gboolean init_webrtc_peer(int max_peer_cnt, int device_cnt, int stream_base_port
   g_stream_base_port = stream_base_port;
   g_comm_socket_port = comm_socket_port;
   strcpy(g_codec_name, codec_name);
+  snprintf(g_ice_batch_args[0], 32, "--ice_batch_ms=%d", g_config.webrtc_ice_batch_ms);
+  snprintf(g_ice_batch_args[1], 32, "--ice_batch_max=%d", g_config.webrtc_ice_batch_max);
   
   g_PeerInfos   = (PeerInfo*)calloc(max_peer_cnt, sizeof(PeerInfo));
   for(int i = 0 ; i < g_MaxPeerCnt ; i++){
     g_PeerInfos[i].peer_id = NULL;
     g_PeerInfos[i].socket = init_socket_comm_server(g_comm_socket_port + i);
     g_PeerInfos[i].socket->call_fun = notify_webrtc_instance;
+    g_PeerInfos[i].socket->connect_fun = notify_webrtc_connect;
     g_PeerInfos[i].socket->data = (PeerInfo*)&g_PeerInfos[i];
     g_PeerInfos[i].socket->connect = 0;
+    g_PeerInfos[i].pending_msgs = g_ptr_array_new_with_free_func(g_free);
   }
+
+  if(!g_config.webrtc_inproc && g_config.webrtc_dtls_cert_hours > 0 && g_dtls_cert_timer == 0){
+    refresh_dtls_certificate(NULL);
+    g_dtls_cert_timer = g_timeout_add_seconds(g_config.webrtc_dtls_cert_hours * 3600, refresh_dtls_certificate, NULL);
+  }
+
+  refill_warm_pool(NULL);
   return TRUE;
 }
 
@@ -72,17 +562,83 @@ void  free_webrtc_peer(gboolean bFinal)
       if(g_PeerInfos[i].peer_id != NULL){
         remove_peer_from_pipeline(g_PeerInfos[i].peer_id);
       }
-      if(bFinal)
+      // 메인 루프가 끝난 뒤라 child watch가 돌지 않으므로 여기서 직접 기다린다
+      if(bFinal && g_PeerInfos[i].child_pid != 0){
+        int status;
+        stop_sender(i);
+        waitpid(g_PeerInfos[i].child_pid, &status, 0);
+        clear_peer_timeout(&g_PeerInfos[i]);
+        g_PeerInfos[i].child_pid = 0;
+        g_PeerInfos[i].state = PEER_FREE;
+      }
+      if(bFinal){
         close_socket_comm(g_PeerInfos[i].socket);
+        g_ptr_array_free(g_PeerInfos[i].pending_msgs, TRUE);
+        g_PeerInfos[i].pending_msgs = NULL;
+      }
     }
   }
 
   if(bFinal){
     g_MaxPeerCnt  = 0;
+    if(g_dtls_cert_timer){
+      g_source_remove(g_dtls_cert_timer);
+      g_dtls_cert_timer = 0;
+    }
+    // 만들던 인증서가 있으면 on_dtls_cert_generated가 버리고 디렉터리를 지운다
+    if(g_dtls_cert_pid)
+      kill(g_dtls_cert_pid, SIGTERM);
+    else
+      remove_dtls_cert_dir();
   }  
 }
 
 
+// 모은 후보를 {"ice":[...]} 한 메시지로 sender에 넘긴다 (메인 루프)
+static void send_sender_ice_batch(const gchar *ice_array, guint count, gboolean end, gpointer user_data)
+{
+  PeerInfo *peer = &g_PeerInfos[GPOINTER_TO_INT(user_data)];
+  if(peer->socket->connect == 0){
+    glog_error("send_sender_ice_batch sender not ready [%s]\n", peer->peer_id ? peer->peer_id : "");
+    return;
+  }
+  gchar *msg = g_strdup_printf("{\"ice\":%s}", ice_array);
+  send_data_socket_comm(peer->socket, msg, strlen(msg), 0);
+  g_free(msg);
+}
+
+static void add_sender_ice_candidate(guint mlineindex, const gchar *candidate, gpointer user_data)
+{
+  ice_batch_add((IceBatch *)user_data, mlineindex, candidate);
+}
+
+// 서버에서 온 후보 메시지면 ice_batch에 모으고 TRUE, 아니면 FALSE
+static gboolean queue_sender_ice(int peer_idx, const gchar *msg)
+{
+  PeerInfo *peer = &g_PeerInfos[peer_idx];
+  gboolean queued = FALSE;
+  JsonParser *parser = json_parser_new();
+
+  if(json_parser_load_from_data(parser, msg, -1, NULL) && JSON_NODE_HOLDS_OBJECT(json_parser_get_root(parser))){
+    JsonObject *object = json_node_get_object(json_parser_get_root(parser));
+    if(json_object_has_member(object, "ice")){
+      if(peer->ice_batch == NULL)
+        peer->ice_batch = ice_batch_new(g_config.webrtc_ice_batch_ms, g_config.webrtc_ice_batch_max,
+                                        send_sender_ice_batch, GINT_TO_POINTER(peer_idx), NULL);
+      queued = ice_candidates_foreach(json_object_get_member(object, "ice"), add_sender_ice_candidate, peer->ice_batch) > 0;
+    }
+  }
+  g_object_unref(parser);
+  return queued;
+}
+
+static void send_peer_message(int peer_idx, const gchar *msg)
+{
+  if(g_config.webrtc_ice_batch_ms > 0 && queue_sender_ice(peer_idx, msg))
+    return;
+  send_data_socket_comm(g_PeerInfos[peer_idx].socket, msg, strlen(msg), 0);
+}
+
 gboolean handle_peer_message (const gchar * peer_id, const gchar * msg)
 {
   //1. find webrtc sender 
@@ -92,7 +648,27 @@ gboolean handle_peer_message (const gchar * peer_id, const gchar * msg)
     return FALSE;    
   }
 
-  send_data_socket_comm(g_PeerInfos[peer_idx].socket, msg, strlen(msg), 0);
+  if(g_PeerInfos[peer_idx].inproc){
+    return inproc_handle_peer_message(peer_id, msg);
+  }
+
+  // sender가 아직 뜨는 중이면 CONNECT까지 쌓아 둔다
+  PeerInfo *peer = &g_PeerInfos[peer_idx];
+  if(peer->state == PEER_STARTING){
+    if(peer->pending_msgs->len >= PEER_PENDING_MSG_MAX){
+      glog_error("handle_peer_message too many pending messages [%s]\n", peer_id);
+      return FALSE;
+    }
+    g_ptr_array_add(peer->pending_msgs, g_strdup(msg));
+    return TRUE;
+  }
+
+  if(peer->state != PEER_ACTIVE || peer->socket->connect == 0){
+    glog_error("handle_peer_message sender not ready [%s]\n", peer_id);
+    return FALSE;
+  }
+
+  send_peer_message(peer_idx, msg);
   return TRUE;
 }
 
@@ -108,18 +684,16 @@ void remove_peer_from_pipeline (const gchar * peer_id)
   //send close message
   glog_trace("send endup peer_idx [%d]:  [%s] \n", peer_idx, g_PeerInfos[peer_idx].peer_id);
 
-  int status, endpid;
-  char msg[32] = "STOP_WEBRTC";
-  send_data_socket_comm(g_PeerInfos[peer_idx].socket, msg, strlen(msg), 0);
-
-  endpid=waitpid(g_PeerInfos[peer_idx].child_pid,&status,0);
-
-  free(g_PeerInfos[peer_idx].peer_id);
-  g_PeerInfos[peer_idx].peer_id = 0;
-  g_PeerInfos[peer_idx].child_pid = 0;
-  g_PeerInfos[peer_idx].socket->connect = 0;
+  if(g_PeerInfos[peer_idx].inproc){
+    inproc_remove_peer(peer_id);
+    release_peer(peer_idx);
+    g_PeerInfos[peer_idx].state = PEER_FREE;
+    return;
+  }
 
-  glog_trace("remove_peer_from_pipeline peer [%d]:  %d\n", endpid, status);
+  // peer_id는 바로 비워서 같은 피어가 다시 들어올 수 있게 하고, 슬롯은 sender가 끝나면 비워진다
+  release_peer(peer_idx);
+  stop_sender(peer_idx);
 }
 
 //LJH: gstream_main 에서 webrtc_sender 를 호출
@@ -132,8 +706,15 @@ gboolean add_peer_to_pipeline (const gchar * peer_id, const gchar * channel)
     return FALSE;    
   }
 
+  // 준비된 warm sender가 있으면 그 슬롯을 쓰고, 없으면 빈 슬롯에 새로 띄운다
   for(int i = 0 ; i < g_MaxPeerCnt ; i++){
-    if(g_PeerInfos[i].peer_id == 0){
+    if(g_PeerInfos[i].state == PEER_PARKED){
+      peer_idx = i;
+      break; 
+    }
+  }
+  for(int i = 0 ; i < g_MaxPeerCnt && peer_idx == -1 ; i++){
+    if(g_PeerInfos[i].state == PEER_FREE){
       peer_idx = i;
       break; 
     }
@@ -169,43 +750,90 @@ gboolean add_peer_to_pipeline (const gchar * peer_id, const gchar * channel)
   int   stream_base_port = g_stream_base_port + peer_idx* g_device_cnt + index;
   int   comm_socket_port = g_comm_socket_port+peer_idx;
   g_PeerInfos[peer_idx].peer_id = g_strdup(peer_id);
-  
-  int pid = fork();                   //LJH, 사용자의 접속에 따라 fork 가 계속 일어남.
-  if(pid == 0){
-    //./webrtc_sender --stream_cnt=1 --stream_base_port=5000 --comm_port=6000 --peer-id="test"C
-    char *programName = "./webrtc_sender";
-    // char *programName = "./webrtc_sender_go";
-    char strtemp[4][64];
-    char peer_id_arg[256];
-    snprintf(strtemp[0], 64, "--stream_cnt=%d", 1);       //LJH, 1개씩 해서 필요에 따라 여러번 호출될 수 있음.
-    snprintf(strtemp[1], 64, "--stream_base_port=%d", stream_base_port); 
-    snprintf(strtemp[2], 64, "--comm_socket_port=%d", comm_socket_port); 
-    snprintf(strtemp[3], 64, "--codec_name=%s", "H264"); 
-    snprintf(peer_id_arg, 256, "--peer_id=%s", peer_id); 
-    char *args[]={programName,strtemp[0], strtemp[1] ,strtemp[2], strtemp[3],peer_id_arg, NULL};
-    execvp(programName, args);
-
-    //printf("Start 1 ...%d \n", pid); 
-  } else if(pid > 0){
-    g_PeerInfos[peer_idx].child_pid = pid;
-    glog_trace("Wait for strat clinet peer_idx[%d] to pid[%d] socket [%d] \n", peer_idx, pid, g_PeerInfos[peer_idx].socket->clientaddr); 
-
-    //wait start webrtc sender ... 
-    int i = 0;
-    for (i = 0; i < 20; i++){
-      sleep(1);
-      if(g_PeerInfos[peer_idx].socket->connect == 0){
-        glog_trace("Wait Client count [%d] to peer_idx[%d] to pid[%d] \n", i, peer_idx, pid); 
-      } else {
-        break;
-      }
-    }
+  g_PeerInfos[peer_idx].join_time = g_get_monotonic_time();
+
+  // 피어가 받을 인코더 출력(index / 100: 화질 단계, 0 고해상도)만 내보낸다
+  char tee_name[32] = {0,};
+  char low_tee_name[32] = {0,};
+  if(index / 100 < get_encoder_rung_cnt(index % 100)){
+    snprintf(tee_name, sizeof(tee_name), "video_enc_tee%d_%d", index / 100 + 1, index % 100);
+  }
+  if(index / 100 + 1 < get_encoder_rung_cnt(index % 100)){
+    snprintf(low_tee_name, sizeof(low_tee_name), "video_enc_tee%d_%d", index / 100 + 2, index % 100);
+  }
 
-    if(i == 5){
-      glog_error("Wait Client Fail peer_idx[%d] to pid[%d] \n", i, peer_idx, pid); 
+  // in-process 모드: fork 없이 tee에 피어용 webrtcbin을 바로 붙인다
+  if(g_config.webrtc_inproc){
+    if(tee_name[0] == 0 || !inproc_add_peer(peer_id, tee_name)){
+      glog_error("add_peer_to_pipeline inproc fail [%s] [%s]\n", peer_id, channel);
+      release_peer(peer_idx);
+      return FALSE;
     }
+    g_PeerInfos[peer_idx].inproc = TRUE;
+    g_PeerInfos[peer_idx].state = PEER_ACTIVE;
+    return TRUE;
   }
 
+  PeerInfo *peer = &g_PeerInfos[peer_idx];
+  char shm_path[128] = {0,};
+  if(tee_name[0]){
+    peer->tee_name = g_strdup(tee_name);
+    attach_peer_egress(tee_name, stream_base_port, &peer->egress_port, &peer->shm_tee,
+                       shm_path, sizeof(shm_path));
+  }
+
+  // 한 단계 아래 화질은 이름만 정해 두고, sender가 혼잡해서 LOW_RUNG:1을 보낼 때 붙인다
+  // (보는 사람마다 저화질 인코더까지 열면 구독자 기준 게이팅이 의미 없어진다)
+  if(tee_name[0] && low_tee_name[0]){
+    peer->low_tee_name = g_strdup(low_tee_name);
+    peer->low_port = stream_base_port + 100;
+  }
+
+  // warm sender에는 포트와 피어 정보만 넘기고 바로 돌아온다
+  if(g_PeerInfos[peer_idx].state == PEER_PARKED){
+    char assign[512];
+    snprintf(assign, sizeof(assign), "ASSIGN:%d:%s:%d:%s", stream_base_port, shm_path,
+             peer->low_tee_name != NULL, peer_id);
+    send_data_socket_comm(g_PeerInfos[peer_idx].socket, assign, strlen(assign), 0);
+    g_PeerInfos[peer_idx].state = PEER_ACTIVE;
+    glog_trace("assign warm sender peer_idx[%d] pid[%d] [%s]\n", peer_idx, g_PeerInfos[peer_idx].child_pid, peer_id);
+
+    g_idle_add(refill_warm_pool, NULL);
+    return TRUE;
+  }
+
+  //./webrtc_sender --stream_cnt=1 --stream_base_port=5000 --comm_port=6000 --peer-id="test"C
+  char *programName = "./webrtc_sender";
+  // char *programName = "./webrtc_sender_go";
+  char strtemp[4][64];
+  char peer_id_arg[256];
+  char shm_path_arg[160];
+  snprintf(strtemp[0], 64, "--stream_cnt=%d", 1);       //LJH, 1개씩 해서 필요에 따라 여러번 호출될 수 있음.
+  snprintf(strtemp[1], 64, "--stream_base_port=%d", stream_base_port); 
+  snprintf(strtemp[2], 64, "--comm_socket_port=%d", comm_socket_port); 
+  snprintf(strtemp[3], 64, "--codec_name=%s", "H264"); 
+  snprintf(peer_id_arg, 256, "--peer_id=%s", peer_id); 
+  snprintf(shm_path_arg, 160, "--shm_path=%s", shm_path); 
+
+  // 옵션 인자는 있는 것만 붙인다
+  char *args[16]={programName,strtemp[0], strtemp[1] ,strtemp[2], strtemp[3],peer_id_arg, NULL};
+  int argc = 6;
+  if(shm_path[0])
+    args[argc++] = shm_path_arg;
+  if(peer->low_tee_name)
+    args[argc++] = "--low_rung";
+  if(g_dtls_cert_ready)
+    args[argc++] = g_dtls_cert_arg;
+  if(g_config.webrtc_ice_batch_ms > 0){
+    args[argc++] = g_ice_batch_args[0];
+    args[argc++] = g_ice_batch_args[1];
+  }
+
+  // CONNECT는 on_sender_ready에서 처리, 여기서는 기다리지 않는다
+  if(!spawn_sender(peer_idx, args)){
+    release_peer(peer_idx);
+    return FALSE;
+  }
   return TRUE;
 }
 
@@ -12,12 +12,14 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 
 #include "socket_comm.h"
 #define USE_JSON_MESSAGE_TEMPLATE
 #include "json_utils.h"
 #include "log_wrapper.h"
+#include "ice_batch.h"
 
 static GMainLoop *loop;
 static GstElement *pipeline, *webrtc = NULL;
@@ -29,6 +31,21 @@ static int g_stream_base_port;
 static int g_comm_port;
 static char* g_codec_name;
 static char* peer_id;
+static char* g_shm_path = NULL;   // 있으면 udpsrc 대신 공유 메모리(shmsrc)로 받음
+static gboolean g_warm = FALSE;   // 피어 없이 먼저 떠서 대기하다가 ASSIGN 메시지로 배정받음
+static gboolean g_low_rung = FALSE;   // 혼잡 시 전환할 저화질 스트림이 있음 (LOW_RUNG:1로 요청해야 붙는다)
+static char* g_dtls_cert_path = NULL;   // gstream_main이 만든 공용 DTLS 인증서 (없으면 webrtcbin 기본 생성)
+static gchar* g_dtls_pem = NULL;
+static gboolean g_join_key_unit_sent = FALSE;   // DTLS 완료 후 FAST_START를 보냈는지
+static gint64 g_last_pli_relay = 0;
+static int g_ice_batch_ms = 0;      // 0이면 후보마다 "candidate" 메시지
+static int g_ice_batch_max = 8;
+static IceBatch *g_ice_batch = NULL;
+
+// 배정(또는 시작)부터 ICE 연결 후 첫 프레임까지 걸린 시간 측정
+static gint64 g_assign_time = 0;
+static gboolean ice_connected = FALSE;
+static gboolean first_frame_sent = FALSE;
 
 // DTLS 안정화 관련 변수들
 static gboolean pipeline_created = FALSE;
@@ -36,12 +53,55 @@ static gint retry_count = 0;
 static const gint max_retries = 3;
 static guint retry_timeout_id = 0;
 
+/*
+ * 화질 전환 (--low_rung인 경우)
+ * 두 스트림을 depay 해서 input-selector로 고르고 하나의 rtph264pay로 다시 묶는다.
+ * 저화질 스트림은 내려갈 때 LOW_RUNG:1로 gstream_main에 송출을 요청해 붙이고,
+ * 고화질로 돌아오면 떼고 LOW_RUNG:0으로 돌려준다 (보는 동안 저화질 인코더를 계속 열어두지 않는다).
+ * SSRC/시퀀스가 이어지므로 재협상 없이 바꿀 수 있고, 전환은 새 스트림의 키프레임에서 한다.
+ * webrtcbin 통계(RTCP receiver report)로 손실/RTT를 보고 가용 대역을 추정한다.
+ */
+#define RENDITION_HIGH              0
+#define RENDITION_LOW               1
+#define RENDITION_STATS_INTERVAL_MS 1000
+#define RENDITION_DOWN_COUNT        3     // 연속 3초 부족하면 저화질로
+#define RENDITION_UP_COUNT          10    // 연속 10초 여유가 있으면 고화질로
+#define RENDITION_LOSS_HIGH         0.10
+#define RENDITION_LOSS_LOW          0.02
+#define RENDITION_RTT_HIGH          0.5   // 초
+#define PLI_RELAY_MIN_INTERVAL_MS   200   // PLI/FIR을 gstream_main으로 넘기는 최소 간격
+
+static GstElement *rendition_selector = NULL;
+static GstPad *rendition_pads[2];
+static GstElement *low_rung_src = NULL;   // 저화질로 내려가 있는 동안만 있는 소스
+static gint active_rendition = RENDITION_HIGH;
+static gint pending_rendition = -1;
+static guint stats_timeout_id = 0;
+
+typedef struct {
+  guint64 bytes_sent;
+  guint64 packets_sent;
+  gint64 packets_lost;
+  gdouble rtt;
+} RtpStats;
+
+static RtpStats last_stats;
+static gdouble estimate_bps = 0;      // 추정 가용 대역
+static gdouble high_rate_bps = 0;     // 고화질 송출 비트레이트 (고화질일 때 측정)
+static gint down_count = 0, up_count = 0;
+
 static GOptionEntry entries[] = {
   {"stream_cnt", 0, 0, G_OPTION_ARG_INT, &g_stream_cnt, "stream_cnt", NULL},
   {"stream_base_port", 0, 0, G_OPTION_ARG_INT, &g_stream_base_port, "stream_port", NULL},
   {"comm_socket_port", 0, 0, G_OPTION_ARG_INT, &g_comm_port, "comm_socket_port", NULL},
   {"codec_name", 0, 0, G_OPTION_ARG_STRING, &g_codec_name, "codec_name", NULL},
   {"peer_id", 0, 0, G_OPTION_ARG_STRING, &peer_id, "String ID of the peer to connect to", "ID"},
+  {"shm_path", 0, 0, G_OPTION_ARG_STRING, &g_shm_path, "shmsink socket path of the encoder stream", NULL},
+  {"low_rung", 0, 0, G_OPTION_ARG_NONE, &g_low_rung, "a lower rendition can be requested from gstream_main", NULL},
+  {"warm", 0, 0, G_OPTION_ARG_NONE, &g_warm, "start parked and wait for ASSIGN from gstream_main", NULL},
+  {"dtls_cert", 0, 0, G_OPTION_ARG_STRING, &g_dtls_cert_path, "PEM file with the shared DTLS certificate and key", NULL},
+  {"ice_batch_ms", 0, 0, G_OPTION_ARG_INT, &g_ice_batch_ms, "coalesce ICE candidates for this many ms (0: one message per candidate)", NULL},
+  {"ice_batch_max", 0, 0, G_OPTION_ARG_INT, &g_ice_batch_max, "max ICE candidates per message", NULL},
   {NULL}
 };
 
@@ -93,8 +153,14 @@ static gboolean restart_pipeline_on_dtls_error(gpointer user_data) {
         gst_object_unref(pipeline);
         pipeline = NULL;
         webrtc = NULL;
+        rendition_selector = NULL;
         pipeline_created = FALSE;
     }
+    // 새 파이프라인은 고화질로 시작하므로 저화질 송출도 돌려준다
+    if (low_rung_src) {
+        low_rung_src = NULL;
+        send_data_socket_comm(g_socket, "LOW_RUNG:0", 11, 1);
+    }
     
     // 잠시 대기 후 재시작
     g_usleep(1000000);  // 1초 대기
@@ -230,6 +296,11 @@ send_ice_candidate_message (GstElement * webrtc G_GNUC_UNUSED, guint mlineindex,
     first_send_ice = FALSE;
   }
 
+  if (g_ice_batch) {
+    ice_batch_add (g_ice_batch, mlineindex, candidate);
+    return;
+  }
+
   ice = json_object_new ();
   json_object_set_string_member (ice, "candidate", candidate);
   json_object_set_int_member (ice, "sdpMLineIndex", mlineindex);
@@ -240,6 +311,14 @@ send_ice_candidate_message (GstElement * webrtc G_GNUC_UNUSED, guint mlineindex,
   g_free (text);
 }
 
+// 모은 후보를 "candidates" 한 메시지로 보낸다 (end이면 마지막 항목이 end-of-candidates)
+static void
+send_ice_candidates_batch (const gchar * ice_array, guint count, gboolean end, gpointer user_data)
+{
+  glog_trace ("[%s] send %u ICE candidates%s\n", peer_id, count, end ? " (end-of-candidates)" : "");
+  send_room_peer_msg ("candidates", peer_id, "ice", ice_array);
+}
+
 static void
 send_room_peer_sdp (GstWebRTCSessionDescription * desc, const gchar * peer_id)
 {
@@ -284,6 +363,9 @@ on_offer_created (GstPromise * promise, GstElement * webrtc)
       GST_TYPE_WEBRTC_SESSION_DESCRIPTION, &offer, NULL);
   gst_promise_unref (promise);
 
+  glog_trace ("[%s] offer created %ld ms after assign, dtls cert[%s]\n", peer_id,
+      (long) ((g_get_monotonic_time () - g_assign_time) / 1000), g_dtls_pem ? "shared" : "generated");
+
   promise = gst_promise_new ();
   g_signal_emit_by_name (webrtc, "set-local-description", offer, promise);
   gst_promise_interrupt (promise);
@@ -326,52 +408,147 @@ on_ice_gathering_state_notify (GstElement * webrtcbin, GParamSpec * pspec, gpoin
       new_state = "complete";
       // ICE complete 후 DTLS 준비 시간
       g_usleep(100000);  // 100ms 대기
+      if (g_ice_batch)
+        ice_batch_end (g_ice_batch);
       break;
   }
   glog_trace ("[%s] ICE gathering state changed to %s \n", peer_id, new_state);
 }
 
-// 개선된 파이프라인 시작 함수
-static gboolean start_pipeline (void)
+static void
+on_ice_connection_state_notify (GstElement * webrtcbin, GParamSpec * pspec, gpointer data)
 {
-  GstStateChangeReturn ret;
-  GError *error = NULL;
-  GstBus *bus;
-  
-  if (pipeline_created) {
-    glog_trace("Pipeline already created, skipping");
-    return TRUE;
+  GstWebRTCICEConnectionState state;
+
+  g_object_get (webrtcbin, "ice-connection-state", &state, NULL);
+  if (state == GST_WEBRTC_ICE_CONNECTION_STATE_CONNECTED ||
+      state == GST_WEBRTC_ICE_CONNECTION_STATE_COMPLETED)
+    ice_connected = TRUE;
+}
+
+// ICE 연결 후 webrtcbin에 처음 들어가는 프레임 시점을 gstream_main에 알린다
+static GstPadProbeReturn
+on_first_frame_probe (GstPad * pad, GstPadProbeInfo * info, gpointer data)
+{
+  if (first_frame_sent)
+    return GST_PAD_PROBE_REMOVE;
+  if (!ice_connected)
+    return GST_PAD_PROBE_OK;
+
+  first_frame_sent = TRUE;
+  glog_trace ("[%s] first frame %ld ms after assign\n", peer_id,
+      (long) ((g_get_monotonic_time () - g_assign_time) / 1000));
+  send_data_socket_comm (g_socket, "FIRST_FRAME", 12, 1);
+  return GST_PAD_PROBE_REMOVE;
+}
+
+// 보고 있는 화질(전환 중이면 전환할 화질)의 인코더에 IDR 요청
+static void
+send_key_unit_request (const gchar * reason)
+{
+  char msg[32];
+  gint rendition = pending_rendition >= 0 ? pending_rendition : active_rendition;
+
+  // 저화질 소스가 아직 붙지 않았으면 보고 있는 고화질 인코더로
+  if (rendition == RENDITION_LOW && !low_rung_src)
+    rendition = RENDITION_HIGH;
+  glog_trace ("[%s] key unit request (%s)\n", peer_id, reason);
+  snprintf (msg, sizeof (msg), "KEY_UNIT:%d", rendition);
+  send_data_socket_comm (g_socket, msg, strlen (msg) + 1, 1);
+}
+
+// 브라우저의 PLI/FIR은 webrtcbin rtpsession에서 upstream GstForceKeyUnit 이벤트로 올라온다.
+// udpsrc/shmsrc에서는 버려지므로 여기서 잡아 gstream_main의 인코더로 넘긴다
+static GstPadProbeReturn
+on_key_unit_event_probe (GstPad * pad, GstPadProbeInfo * info, gpointer data)
+{
+  GstEvent *event = GST_PAD_PROBE_INFO_EVENT (info);
+  gint64 now = g_get_monotonic_time ();
+
+  if (!gst_event_has_name (event, "GstForceKeyUnit"))
+    return GST_PAD_PROBE_OK;
+
+  // 손실이 이어지면 PLI가 연달아 오므로 sender에서도 한 번 걸러 보낸다
+  if (now - g_last_pli_relay >= PLI_RELAY_MIN_INTERVAL_MS * 1000) {
+    g_last_pli_relay = now;
+    send_key_unit_request ("pli/fir");
   }
+  return GST_PAD_PROBE_DROP;
+}
 
-  glog_trace("Creating new pipeline with DTLS stabilization");
+static void
+watch_key_unit_requests (GstElement * src)
+{
+  GstPad *pad = gst_element_get_static_pad (src, "src");
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_EVENT_UPSTREAM, on_key_unit_event_probe, NULL, NULL);
+  gst_object_unref (pad);
+}
 
-  char str_pipeline[2048] = {0,};
-  char str_video[512];
+// SRTP 키가 정해진 시점부터 브라우저가 패킷을 받을 수 있으므로 이때 gstream_main이
+// 최근 GOP를 먼저 보내고 live로 이어 준다 (캐시가 없으면 gstream_main이 IDR 요청으로 대신)
+static void
+on_dtls_key_set (GstElement * dtlssrtpenc, gpointer data)
+{
+  char msg[32];
 
-  // STUN 서버를 여러 개 시도할 수 있도록 설정
-  strcpy(str_pipeline, "webrtcbin stun-server=stun://stun.l.google.com:19302 name=sender ");
-  
-  for( int i = 0 ; i< g_stream_cnt ;i++){
-    snprintf(str_video, 512, 
-      "udpsrc port=%d ! queue ! "
-      "application/x-rtp,media=video,encoding-name=%s,payload=96,"
-      "width=(int)1920,height=(int)1080,framerate=(fraction)15/1 ! "
-      "sender. ",  
-      g_stream_base_port + i, g_codec_name); 
-    strcat(str_pipeline, str_video);
+  if (g_join_key_unit_sent)
+    return;
+  g_join_key_unit_sent = TRUE;
+  glog_trace ("[%s] dtls connected %ld ms after assign, fast start\n", peer_id,
+      (long) ((g_get_monotonic_time () - g_assign_time) / 1000));
+  snprintf (msg, sizeof (msg), "FAST_START:%d", pending_rendition >= 0 ? pending_rendition : active_rendition);
+  send_data_socket_comm (g_socket, msg, strlen (msg) + 1, 1);
+}
+
+// GStreamer 1.16 webrtcbin에는 certificate 속성이 없어 transport마다 만들어지는 dtlssrtpdec의
+// pem을 직접 바꾼다. SDP fingerprint도 이 값에서 읽으므로 offer 전에만 설정되면 된다.
+static void
+on_deep_element_added (GstBin * bin, GstBin * sub_bin, GstElement * element, gpointer data)
+{
+  GstElementFactory *factory = gst_element_get_factory (element);
+
+  if (!factory)
+    return;
+
+  if (strcmp (GST_OBJECT_NAME (factory), "dtlssrtpenc") == 0) {
+    g_signal_connect (element, "on-key-set", G_CALLBACK (on_dtls_key_set), NULL);
+    return;
   }
-  
-  glog_trace("%lu  %s\n", strlen(str_pipeline), str_pipeline);
-  pipeline = gst_parse_launch (str_pipeline, &error);
+  if (strcmp (GST_OBJECT_NAME (factory), "dtlssrtpdec") != 0 || !g_dtls_cert_path)
+    return;
 
-  if (error) {
-    glog_error ("Failed to parse launch: %s\n", error->message);
-    g_error_free (error);
-    goto err;
+  // 교체된 인증서가 다음 배정부터 쓰이도록 파이프라인마다 처음 한 번 읽는다
+  if (!g_dtls_pem && !g_file_get_contents (g_dtls_cert_path, &g_dtls_pem, NULL, NULL)) {
+    glog_error ("Failed to read dtls certificate %s, using generated one\n", g_dtls_cert_path);
+    return;
   }
+  g_object_set (element, "pem", g_dtls_pem, NULL);
+}
 
+// webrtcbin만 있는 파이프라인을 만들어 READY까지 올려둔다
+// warm 모드에서는 피어가 배정되기 전에 미리 호출된다
+static gboolean prepare_pipeline (void)
+{
+  GstBus *bus;
+
+  if (pipeline)
+    return TRUE;
+
+  ice_connected = FALSE;
+  pipeline = gst_pipeline_new ("pipeline");
+  g_clear_pointer (&g_dtls_pem, g_free);
+  g_join_key_unit_sent = FALSE;
+  g_signal_connect (pipeline, "deep-element-added", G_CALLBACK (on_deep_element_added), NULL);
+  GstElement *element = gst_element_factory_make ("webrtcbin", "sender");
+  if (!element) {
+    glog_error ("Failed to create webrtcbin\n");
+    g_clear_object (&pipeline);
+    return FALSE;
+  }
+  // STUN 서버를 여러 개 시도할 수 있도록 설정
+  g_object_set (element, "stun-server", "stun://stun.l.google.com:19302", NULL);
+  gst_bin_add (GST_BIN (pipeline), element);
   webrtc = gst_bin_get_by_name (GST_BIN (pipeline), "sender");
-  g_assert_nonnull (webrtc);
 
   // 버스 메시지 핸들러 추가 (DTLS 에러 감지용)
   bus = gst_element_get_bus(pipeline);
@@ -385,12 +562,344 @@ static gboolean start_pipeline (void)
       G_CALLBACK (send_ice_candidate_message), NULL);
   g_signal_connect (webrtc, "notify::ice-gathering-state",
       G_CALLBACK (on_ice_gathering_state_notify), NULL);
+  g_signal_connect (webrtc, "notify::ice-connection-state",
+      G_CALLBACK (on_ice_connection_state_notify), NULL);
 
   // 단계적 상태 변경 (DTLS 안정화)
   glog_trace ("Setting pipeline to READY\n");
   gst_element_set_state (pipeline, GST_STATE_READY);
   g_usleep(500000);  // 500ms 대기
 
+  return TRUE;
+}
+
+static GstElement *
+add_video_source (const gchar * description, GstElement * target)
+{
+  GError *error = NULL;
+  GstElement *src = gst_parse_bin_from_description (description, TRUE, &error);
+
+  glog_trace ("%s\n", description);
+  if (error) {
+    glog_error ("Failed to parse source: %s\n", error->message);
+    g_error_free (error);
+    return NULL;
+  }
+
+  gst_bin_add (GST_BIN (pipeline), src);
+  if (!gst_element_link (src, target)) {
+    glog_error ("Failed to link source to %s\n", GST_ELEMENT_NAME (target));
+    return NULL;
+  }
+
+  GstPad *pad = gst_element_get_static_pad (src, "src");
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER, on_first_frame_probe, NULL, NULL);
+  gst_object_unref (pad);
+  if (target == webrtc)
+    watch_key_unit_requests (src);
+  return src;
+}
+
+static gboolean remove_low_rung_source (gpointer user_data);
+
+// 새 스트림의 키프레임이 selector에 도착하면 그때 전환
+static GstPadProbeReturn
+on_rendition_probe (GstPad * pad, GstPadProbeInfo * info, gpointer data)
+{
+  gint rendition = GPOINTER_TO_INT (data);
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+
+  if (pending_rendition != rendition ||
+      GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+    return GST_PAD_PROBE_OK;
+
+  g_object_set (rendition_selector, "active-pad", rendition_pads[rendition], NULL);
+  active_rendition = rendition;
+  pending_rendition = -1;
+  glog_trace ("[%s] rendition switched to %s\n", peer_id,
+      rendition == RENDITION_HIGH ? "high" : "low");
+  // 고화질로 돌아오면 저화질 소스는 메인 루프에서 뗀다
+  if (rendition == RENDITION_HIGH)
+    g_idle_add (remove_low_rung_source, NULL);
+  return GST_PAD_PROBE_OK;
+}
+
+static void
+request_rendition (gint rendition)
+{
+  if (pending_rendition == rendition || active_rendition == rendition)
+    return;
+
+  pending_rendition = rendition;
+  glog_trace ("[%s] switching rendition to %s, estimate %.0f kbps (high %.0f kbps)\n", peer_id,
+      rendition == RENDITION_HIGH ? "high" : "low", estimate_bps / 1000, high_rate_bps / 1000);
+
+  // 저화질 소스가 없으면 송출부터 요청한다. 키프레임 요청은 붙은 뒤 add_low_rung_source에서
+  if (rendition == RENDITION_LOW && !low_rung_src) {
+    send_data_socket_comm (g_socket, "LOW_RUNG:1", 11, 1);
+    return;
+  }
+  // 다음 GOP까지 기다리지 않도록 gstream_main에 해당 인코더 키프레임 요청
+  send_key_unit_request ("rendition");
+}
+
+static gboolean
+collect_rtp_stats (GQuark field_id, const GValue * value, gpointer user_data)
+{
+  RtpStats *stats = (RtpStats *) user_data;
+  const GstStructure *s;
+  GstWebRTCStatsType type;
+
+  if (!GST_VALUE_HOLDS_STRUCTURE (value))
+    return TRUE;
+  s = gst_value_get_structure (value);
+  if (!gst_structure_get (s, "type", GST_TYPE_WEBRTC_STATS_TYPE, &type, NULL))
+    return TRUE;
+
+  if (type == GST_WEBRTC_STATS_OUTBOUND_RTP) {
+    guint64 bytes = 0, packets = 0;
+    gst_structure_get_uint64 (s, "bytes-sent", &bytes);
+    gst_structure_get_uint64 (s, "packets-sent", &packets);
+    stats->bytes_sent += bytes;
+    stats->packets_sent += packets;
+  } else if (type == GST_WEBRTC_STATS_REMOTE_INBOUND_RTP) {
+    gint lost = 0;
+    gdouble rtt = 0;
+    gst_structure_get_int (s, "packets-lost", &lost);
+    gst_structure_get_double (s, "round-trip-time", &rtt);
+    stats->packets_lost += lost;
+    stats->rtt = MAX (stats->rtt, rtt);
+  }
+  return TRUE;
+}
+
+// 손실 기반 추정 (GCC loss-based controller 방식): 손실이 크면 줄이고 작으면 조금씩 늘린다
+static void
+on_stats_reply (GstPromise * promise, gpointer user_data)
+{
+  RtpStats stats = { 0, };
+
+  if (gst_promise_wait (promise) != GST_PROMISE_RESULT_REPLIED) {
+    gst_promise_unref (promise);
+    return;
+  }
+  gst_structure_foreach (gst_promise_get_reply (promise), collect_rtp_stats, &stats);
+  gst_promise_unref (promise);
+
+  guint64 packets = stats.packets_sent - last_stats.packets_sent;
+  gdouble rate_bps = (stats.bytes_sent - last_stats.bytes_sent) * 8.0 * 1000 / RENDITION_STATS_INTERVAL_MS;
+  gdouble loss = packets > 0 ? (gdouble) MAX (stats.packets_lost - last_stats.packets_lost, 0) / packets : 0;
+  gboolean first = last_stats.packets_sent == 0;
+  last_stats = stats;
+  if (first || packets == 0)
+    return;
+
+  if (active_rendition == RENDITION_HIGH)
+    high_rate_bps = high_rate_bps > 0 ? high_rate_bps * 0.8 + rate_bps * 0.2 : rate_bps;
+  if (estimate_bps <= 0)
+    estimate_bps = rate_bps;
+
+  if (loss > RENDITION_LOSS_HIGH)
+    estimate_bps *= 1 - 0.5 * loss;
+  else if (stats.rtt > RENDITION_RTT_HIGH)
+    estimate_bps *= 0.85;
+  else if (loss < RENDITION_LOSS_LOW)
+    estimate_bps = MIN (estimate_bps * 1.08, MAX (high_rate_bps, rate_bps) * 1.5);
+
+  // 히스테리시스: 내릴 때는 빨리, 올릴 때는 충분히 여유가 지속될 때만
+  gboolean short_bw = estimate_bps < high_rate_bps * 0.85;
+  gboolean spare_bw = estimate_bps > high_rate_bps * 1.1 && loss < RENDITION_LOSS_LOW;
+  down_count = short_bw ? down_count + 1 : 0;
+  up_count = spare_bw ? up_count + 1 : 0;
+
+  if (active_rendition == RENDITION_HIGH && down_count >= RENDITION_DOWN_COUNT) {
+    request_rendition (RENDITION_LOW);
+    down_count = 0;
+  } else if (active_rendition == RENDITION_LOW && up_count >= RENDITION_UP_COUNT) {
+    request_rendition (RENDITION_HIGH);
+    up_count = 0;
+  }
+}
+
+static gboolean
+on_stats_timeout (gpointer user_data)
+{
+  if (webrtc && pipeline_created) {
+    GstPromise *promise = gst_promise_new_with_change_func (on_stats_reply, NULL, NULL);
+    g_signal_emit_by_name (webrtc, "get-stats", NULL, promise);
+  }
+  return G_SOURCE_CONTINUE;
+}
+
+static void
+video_source_description (char *buf, gsize len, int port, const char *shm_path, gboolean depay)
+{
+  char src[256];
+
+  if (shm_path != NULL)
+    snprintf (src, sizeof (src), "shmsrc socket-path=%s is-live=true do-timestamp=true", shm_path);
+  else
+    snprintf (src, sizeof (src), "udpsrc port=%d", port);
+
+  if (depay)
+    snprintf (buf, len,
+      "%s ! queue ! application/x-rtp,media=video,clock-rate=90000,encoding-name=%s,payload=96 ! "
+      "rtph264depay ! h264parse config-interval=-1",
+      src, g_codec_name);
+  else
+    snprintf (buf, len,
+      "%s ! queue ! "
+      "application/x-rtp,media=video,encoding-name=%s,payload=96,"
+      "width=(int)1920,height=(int)1080,framerate=(fraction)15/1",
+      src, g_codec_name);
+}
+
+// selector에 소스 하나를 붙이고 키프레임 전환용 probe를 건다
+static GstElement *
+add_rendition_source (gint rendition, int port, const char *shm_path)
+{
+  char str_video[512];
+
+  video_source_description (str_video, sizeof (str_video), port, shm_path, TRUE);
+  GstElement *src = add_video_source (str_video, rendition_selector);
+  if (!src)
+    return NULL;
+
+  GstPad *src_pad = gst_element_get_static_pad (src, "src");
+  rendition_pads[rendition] = gst_pad_get_peer (src_pad);
+  gst_object_unref (rendition_pads[rendition]);     // selector가 소유, 포인터만 보관
+  gst_pad_add_probe (src_pad, GST_PAD_PROBE_TYPE_BUFFER, on_rendition_probe, GINT_TO_POINTER (rendition), NULL);
+  gst_object_unref (src_pad);
+  return src;
+}
+
+// gstream_main의 응답 "LOW_RUNG:<port>:<shm_path>" (둘 다 비어 있으면 송출 실패)
+// 저화질 소스를 붙이고 키프레임을 요청한다. 전환은 키프레임이 오면 on_rendition_probe에서
+static gboolean
+add_low_rung_source (gpointer user_data)
+{
+  gchar **fields = g_strsplit ((const gchar *) user_data, ":", 2);
+  int port = atoi (fields[0]);
+  const char *shm_path = fields[1] && fields[1][0] ? fields[1] : NULL;
+
+  g_free (user_data);
+  if (low_rung_src) {
+    g_strfreev (fields);
+    return G_SOURCE_REMOVE;
+  }
+  // 그 사이 파이프라인을 다시 만들었으면 받은 송출은 바로 돌려준다
+  if (!rendition_selector || pending_rendition != RENDITION_LOW) {
+    if (port != 0 || shm_path != NULL)
+      send_data_socket_comm (g_socket, "LOW_RUNG:0", 11, 1);
+    g_strfreev (fields);
+    return G_SOURCE_REMOVE;
+  }
+  if (port == 0 && shm_path == NULL) {
+    glog_error ("[%s] lower rendition not available, staying high\n", peer_id);
+    pending_rendition = -1;
+    g_strfreev (fields);
+    return G_SOURCE_REMOVE;
+  }
+
+  low_rung_src = add_rendition_source (RENDITION_LOW, port, shm_path);
+  g_strfreev (fields);
+  if (!low_rung_src) {
+    pending_rendition = -1;
+    send_data_socket_comm (g_socket, "LOW_RUNG:0", 11, 1);
+    return G_SOURCE_REMOVE;
+  }
+  gst_element_sync_state_with_parent (low_rung_src);
+  send_key_unit_request ("rendition");
+  return G_SOURCE_REMOVE;
+}
+
+// 고화질로 돌아온 뒤 저화질 소스를 떼고 gstream_main에 송출 해제를 알린다
+static gboolean
+remove_low_rung_source (gpointer user_data)
+{
+  // 그 사이 다시 내려가기로 했으면 그대로 둔다
+  if (!low_rung_src || active_rendition != RENDITION_HIGH || pending_rendition == RENDITION_LOW)
+    return G_SOURCE_REMOVE;
+
+  gst_element_set_state (low_rung_src, GST_STATE_NULL);
+  gst_bin_remove (GST_BIN (pipeline), low_rung_src);
+  gst_element_release_request_pad (rendition_selector, rendition_pads[RENDITION_LOW]);
+  rendition_pads[RENDITION_LOW] = NULL;
+  low_rung_src = NULL;
+  send_data_socket_comm (g_socket, "LOW_RUNG:0", 11, 1);
+  glog_trace ("[%s] lower rendition released\n", peer_id);
+  return G_SOURCE_REMOVE;
+}
+
+// 고화질(+ 내려가 있는 동안 저화질) 스트림 ! input-selector ! rtph264pay ! webrtcbin
+static gboolean
+add_rendition_sources (void)
+{
+  GError *error = NULL;
+  GstElement *pay = gst_parse_bin_from_description (
+      "rtph264pay pt=96 config-interval=-1 ! "
+      "application/x-rtp,media=video,encoding-name=H264,payload=96", TRUE, &error);
+
+  if (error) {
+    glog_error ("Failed to parse payloader: %s\n", error->message);
+    g_error_free (error);
+    return FALSE;
+  }
+
+  rendition_selector = gst_element_factory_make ("input-selector", "rendition");
+  gst_bin_add_many (GST_BIN (pipeline), rendition_selector, pay, NULL);
+  if (!gst_element_link (rendition_selector, pay) || !gst_element_link (pay, webrtc))
+    return FALSE;
+  watch_key_unit_requests (pay);
+
+  low_rung_src = NULL;
+  rendition_pads[RENDITION_LOW] = NULL;
+  if (!add_rendition_source (RENDITION_HIGH, g_stream_base_port, g_shm_path))
+    return FALSE;
+
+  g_object_set (rendition_selector, "active-pad", rendition_pads[RENDITION_HIGH], NULL);
+  active_rendition = RENDITION_HIGH;
+  pending_rendition = -1;
+  memset (&last_stats, 0, sizeof (last_stats));
+  estimate_bps = high_rate_bps = 0;
+
+  if (stats_timeout_id == 0)
+    stats_timeout_id = g_timeout_add (RENDITION_STATS_INTERVAL_MS, on_stats_timeout, NULL);
+  return TRUE;
+}
+
+// 개선된 파이프라인 시작 함수
+static gboolean start_pipeline (void)
+{
+  GstStateChangeReturn ret;
+  char str_video[512];
+  
+  if (pipeline_created) {
+    glog_trace("Pipeline already created, skipping");
+    return TRUE;
+  }
+
+  glog_trace("Creating new pipeline with DTLS stabilization");
+
+  if (!prepare_pipeline ())
+    goto err;
+
+  if (g_low_rung) {
+    if (!add_rendition_sources ())
+      goto err;
+  } else if (g_shm_path != NULL) {
+    // gstream_main의 shmsink가 쓴 RTP를 공유 메모리에서 바로 읽는다 (패킷마다 커널 복사 없음)
+    video_source_description (str_video, sizeof (str_video), 0, g_shm_path, FALSE);
+    if (!add_video_source (str_video, webrtc))
+      goto err;
+  }
+
+  for( int i = 0 ; i< g_stream_cnt && g_shm_path == NULL && rendition_selector == NULL ;i++){
+    video_source_description (str_video, sizeof (str_video), g_stream_base_port + i, NULL, FALSE);
+    if (!add_video_source (str_video, webrtc))
+      goto err;
+  }
+
   glog_trace ("Starting pipeline\n");
   ret = gst_element_set_state (GST_ELEMENT (pipeline), GST_STATE_PLAYING);
   if (ret == GST_STATE_CHANGE_FAILURE)
@@ -411,10 +920,39 @@ err:
   }
   if (webrtc)
     webrtc = NULL;
+  rendition_selector = NULL;
   pipeline_created = FALSE;
   return FALSE;
 }
 
+// warm 모드에서 gstream_main이 보낸
+// "ASSIGN:<stream_port>:<shm_path>:<low_rung>:<peer_id>"
+static void
+handle_assign (const gchar * args)
+{
+  gchar **fields = g_strsplit (args, ":", 4);
+
+  if (g_strv_length (fields) != 4 || pipeline_created) {
+    glog_error ("Invalid ASSIGN '%s'\n", args);
+    g_strfreev (fields);
+    return;
+  }
+
+  g_stream_cnt = 1;
+  g_stream_base_port = atoi (fields[0]);
+  g_free (g_shm_path);
+  g_shm_path = fields[1][0] ? g_strdup (fields[1]) : NULL;
+  g_low_rung = atoi (fields[2]) != 0;
+  g_free (peer_id);
+  peer_id = g_strdup (fields[3]);
+  g_strfreev (fields);
+
+  g_assign_time = g_get_monotonic_time ();
+  glog_trace ("[%s] assigned, stream_port[%d] shm_path[%s] low_rung[%d]\n", peer_id,
+      g_stream_base_port, g_shm_path ? g_shm_path : "", g_low_rung);
+  start_pipeline ();
+}
+
 // 나머지 함수들은 기존과 동일...
 static void
 on_answer_created (GstPromise * promise, const gchar * peer_id)
@@ -503,6 +1041,18 @@ handle_sdp_answer (const gchar * peer_id, const gchar * text)
   gst_promise_unref (promise);
 }
 
+// 빈 candidate는 상대의 end-of-candidates, webrtcbin에도 빈 후보로 그대로 넘긴다
+// (원격 gathering 완료를 아는 버전은 이것으로 ICE를 마무리하고, 1.16은 경고만 남기고 무시)
+static void
+add_remote_ice_candidate (guint mlineindex, const gchar * candidate, gpointer user_data)
+{
+  if (!candidate || candidate[0] == '\0') {
+    glog_trace ("[%s] remote end-of-candidates\n", peer_id);
+    candidate = "";
+  }
+  g_signal_emit_by_name (webrtc, "add-ice-candidate", mlineindex, candidate);
+}
+
 static void handle_peer_message (gchar * msg, int len, void* arg)
 { 
   if (strcmp(msg, "STOP_WEBRTC") == 0)
@@ -511,6 +1061,18 @@ static void handle_peer_message (gchar * msg, int len, void* arg)
     cleanup_and_quit_loop("Received STOP_WEBRTC signal", APP_STATE_UNKNOWN);
     return;
   }
+
+  if (strncmp(msg, "ASSIGN:", 7) == 0)
+  {
+    handle_assign(msg + 7);
+    return;
+  }
+
+  if (strncmp(msg, "LOW_RUNG:", 9) == 0)
+  {
+    g_idle_add(add_low_rung_source, g_strdup(msg + 9));
+    return;
+  }
   
   JsonNode *root;
   JsonObject *object, *child;
@@ -559,14 +1121,8 @@ static void handle_peer_message (gchar * msg, int len, void* arg)
       return;
     }
   } else if (json_object_has_member (object, "ice")) {
-    const gchar *candidate;
-    gint sdpmlineindex;
-
-    child = json_object_get_object_member (object, "ice");
-    candidate = json_object_get_string_member (child, "candidate");
-    sdpmlineindex = json_object_get_int_member (child, "sdpMLineIndex");
-
-    g_signal_emit_by_name (webrtc, "add-ice-candidate", sdpmlineindex, candidate);
+    // 후보 하나 또는 gstream_main/서버가 모아 보낸 배열
+    ice_candidates_foreach (json_object_get_member (object, "ice"), add_remote_ice_candidate, NULL);
   } else {
     glog_error ("Ignoring unknown JSON message:\n%s\n", msg);
   }
@@ -595,12 +1151,33 @@ main (int argc, char *argv[])
   // 소켓 연결
   glog_trace("Initializing socket client for port %d\n", g_comm_port);
   g_socket = init_socket_comm_client(g_comm_port);
-  glog_trace("Sending CONNECT message to port %d\n", g_comm_port);
-  send_data_socket_comm(g_socket, "CONNECT", 8, 1);
+  if (!g_socket) {
+    glog_error("Failed to connect to gstream_main [%d]\n", g_comm_port);
+    return -1;
+  }
   g_socket->call_fun = handle_peer_message;
 
-  // WebRTC 파이프라인 시작
-  start_pipeline();
+  if (g_ice_batch_ms > 0)
+    g_ice_batch = ice_batch_new (g_ice_batch_ms, g_ice_batch_max, send_ice_candidates_batch, NULL, NULL);
+
+  if (g_warm) {
+    // webrtcbin을 READY까지 올려둔 뒤 CONNECT로 준비 완료를 알리고 ASSIGN을 기다린다
+    prepare_pipeline();
+    // 1.16 dtlsdec는 처음 생성될 때 pem과 상관없이 기본 RSA 인증서를 한 번 만든다 (프로세스 공용).
+    // 대기 중에 미리 만들어 두어 배정 후 offer 경로에서 키 생성이 빠지게 한다
+    GstElement *dtls = gst_element_factory_make ("dtlssrtpdec", NULL);
+    if (dtls)
+      gst_object_unref (dtls);
+    glog_trace("Sending CONNECT message to port %d (warm)\n", g_comm_port);
+    send_data_socket_comm(g_socket, "CONNECT", 8, 1);
+  } else {
+    glog_trace("Sending CONNECT message to port %d\n", g_comm_port);
+    send_data_socket_comm(g_socket, "CONNECT", 8, 1);
+
+    // WebRTC 파이프라인 시작
+    g_assign_time = g_get_monotonic_time();
+    start_pipeline();
+  }
   
   loop = g_main_loop_new (NULL, FALSE);
   g_main_loop_run (loop);
@@ -612,11 +1189,10 @@ main (int argc, char *argv[])
 
   glog_trace("Pipeline stopped\n");
 
-  if (g_socket) {
-      close(g_socket->socketfd);  // 단순히 소켓만 닫기
-      free(g_socket);             // 메모리 해제
-      g_socket = NULL;
-  }
+  ice_batch_free (g_ice_batch);
+  g_ice_batch = NULL;
+  close_socket_comm(g_socket);
+  g_socket = NULL;
 
   glog_trace("Pipeline stopped end client [%d] \n", g_comm_port);
 